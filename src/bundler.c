@@ -0,0 +1,524 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "bundler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+#include <openssl/evp.h>
+
+#include "storage.h"
+
+/* Bundler resources, libraries lists are lines of tab separated sha256, id and path. */
+#define BUNDLER_MAIN_CLASS "META-INF/main-class"
+#define BUNDLER_VERSIONS_DIR "META-INF/versions/"
+#define BUNDLER_VERSIONS_LIST "META-INF/versions.list"
+#define BUNDLER_LIBRARIES_DIR "META-INF/libraries/"
+#define BUNDLER_LIBRARIES_LIST "META-INF/libraries.list"
+
+/* ZIP records signatures and fixed sizes, see APPNOTE.TXT. */
+#define BUNDLER_ZIP_EOCD_SIGNATURE 0x06054b50
+#define BUNDLER_ZIP_EOCD_SIZE 22
+#define BUNDLER_ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define BUNDLER_ZIP_CENTRAL_SIZE 46
+#define BUNDLER_ZIP_LOCAL_SIGNATURE 0x04034b50
+#define BUNDLER_ZIP_LOCAL_SIZE 30
+#define BUNDLER_ZIP_COMMENT_MAX 0xffff
+
+#define BUNDLER_ZIP_STORED 0
+#define BUNDLER_ZIP_DEFLATED 8
+
+/* Libraries are unpacked by at most that many threads besides the main one. */
+#define BUNDLER_THREADS_MAX 16
+
+struct bundler {
+	const uint8_t *map;
+	size_t size;
+	const uint8_t *central;
+	size_t central_size;
+	unsigned int entries;
+};
+
+struct bundler_entry {
+	const uint8_t *data;
+	size_t compressed_size, size;
+	unsigned int method;
+};
+
+struct bundler_library {
+	char sha256[65];
+	char *name;
+	char *path;
+	struct bundler_entry entry;
+	bool valid;
+};
+
+struct bundler_pool {
+	struct bundler_library *libraries;
+	size_t count;
+	atomic_size_t next;
+};
+
+static inline uint16_t
+bundler_le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t
+bundler_le32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool
+bundler_open(const char *archive, struct bundler *bundler) {
+	const int fd = open(archive, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		warn("open '%s'", archive);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	bundler->size = st.st_size;
+	bundler->map = bundler->size >= BUNDLER_ZIP_EOCD_SIZE
+		? mmap(NULL, bundler->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (bundler->map == MAP_FAILED) {
+		warnx("Unable to map '%s'", archive);
+		return false;
+	}
+
+	/* The end of central directory record is last, only followed by a comment. */
+	const uint8_t *eocd = bundler->map + bundler->size - BUNDLER_ZIP_EOCD_SIZE;
+	const uint8_t * const lowest = bundler->size - BUNDLER_ZIP_EOCD_SIZE > BUNDLER_ZIP_COMMENT_MAX
+		? eocd - BUNDLER_ZIP_COMMENT_MAX : bundler->map;
+
+	while (eocd >= lowest && bundler_le32(eocd) != BUNDLER_ZIP_EOCD_SIGNATURE) {
+		eocd--;
+	}
+
+	if (eocd >= lowest) {
+		bundler->entries = bundler_le16(eocd + 10);
+		bundler->central_size = bundler_le32(eocd + 12);
+
+		const size_t offset = bundler_le32(eocd + 16);
+		if (offset <= bundler->size && bundler->central_size <= bundler->size - offset) {
+			bundler->central = bundler->map + offset;
+			return true;
+		}
+	}
+
+	warnx("Invalid archive '%s'", archive);
+	munmap((void *)bundler->map, bundler->size);
+
+	return false;
+}
+
+static void
+bundler_close(struct bundler *bundler) {
+	munmap((void *)bundler->map, bundler->size);
+}
+
+static bool
+bundler_find(const struct bundler *bundler, const char *name, struct bundler_entry *entry) {
+	const size_t length = strlen(name);
+	const uint8_t *record = bundler->central;
+	const uint8_t * const end = bundler->central + bundler->central_size;
+
+	for (unsigned int i = 0; i < bundler->entries; i++) {
+		if (end - record < BUNDLER_ZIP_CENTRAL_SIZE
+			|| bundler_le32(record) != BUNDLER_ZIP_CENTRAL_SIGNATURE) {
+			return false;
+		}
+
+		const size_t name_length = bundler_le16(record + 28);
+		const size_t record_size = BUNDLER_ZIP_CENTRAL_SIZE + name_length
+			+ bundler_le16(record + 30) + bundler_le16(record + 32);
+
+		if ((size_t)(end - record) < record_size) {
+			return false;
+		}
+
+		if (name_length == length && memcmp(record + BUNDLER_ZIP_CENTRAL_SIZE, name, length) == 0) {
+			const size_t offset = bundler_le32(record + 42);
+			const uint8_t * const local = bundler->map + offset;
+
+			if (offset > bundler->size - BUNDLER_ZIP_LOCAL_SIZE
+				|| bundler_le32(local) != BUNDLER_ZIP_LOCAL_SIGNATURE) {
+				return false;
+			}
+
+			/* Local extra field may differ from the central one. */
+			const size_t data_offset = offset + BUNDLER_ZIP_LOCAL_SIZE
+				+ bundler_le16(local + 26) + bundler_le16(local + 28);
+
+			entry->method = bundler_le16(record + 10);
+			entry->compressed_size = bundler_le32(record + 20);
+			entry->size = bundler_le32(record + 24);
+			entry->data = bundler->map + data_offset;
+
+			return data_offset <= bundler->size
+				&& entry->compressed_size <= bundler->size - data_offset;
+		}
+
+		record += record_size;
+	}
+
+	return false;
+}
+
+/* Decompresses an entry in buffer, which must hold its whole size. */
+static bool
+bundler_inflate(const struct bundler_entry *entry, uint8_t *buffer) {
+	switch (entry->method) {
+	case BUNDLER_ZIP_STORED:
+		if (entry->compressed_size != entry->size) {
+			return false;
+		}
+		memcpy(buffer, entry->data, entry->size);
+		return true;
+	case BUNDLER_ZIP_DEFLATED: {
+		z_stream stream = {
+			.next_in = (Bytef *)entry->data,
+			.avail_in = entry->compressed_size,
+			.next_out = buffer,
+			.avail_out = entry->size,
+		};
+
+		/* Raw deflate, ZIP entries have no zlib header. */
+		if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+			return false;
+		}
+
+		const int status = inflate(&stream, Z_FINISH);
+		const bool inflated = status == Z_STREAM_END && stream.total_out == entry->size;
+
+		inflateEnd(&stream);
+
+		return inflated;
+	}
+	default:
+		return false;
+	}
+}
+
+/* Reads a whole entry as a string, NULL if absent. */
+static char *
+bundler_read(const struct bundler *bundler, const char *name) {
+	struct bundler_entry entry;
+
+	if (!bundler_find(bundler, name, &entry)) {
+		return NULL;
+	}
+
+	char * const contents = malloc(entry.size + 1);
+	if (contents == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (!bundler_inflate(&entry, (uint8_t *)contents)) {
+		warnx("Unable to inflate '%s'", name);
+		free(contents);
+		return NULL;
+	}
+	contents[entry.size] = '\0';
+
+	return contents;
+}
+
+static bool
+bundler_list(const struct bundler *bundler, const char *list, const char *directory,
+	struct bundler_library **librariesp, size_t *countp) {
+	char * const contents = bundler_read(bundler, list);
+	char *next = contents, *line;
+
+	if (contents == NULL) {
+		return false;
+	}
+
+	while ((line = strsep(&next, "\n")) != NULL) {
+		char * const sha256 = strsep(&line, "\t");
+		const char * const id = strsep(&line, "\t");
+		const char * const path = line;
+
+		if (*sha256 == '\0') {
+			continue;
+		}
+
+		size_t digits = 0;
+		while (isxdigit((unsigned char)sha256[digits])) {
+			digits++;
+		}
+
+		if (digits != 64 || sha256[digits] != '\0' || id == NULL || path == NULL) {
+			warnx("Invalid line in '%s'", list);
+			free(contents);
+			return false;
+		}
+
+		*librariesp = realloc(*librariesp, (*countp + 1) * sizeof (**librariesp));
+		if (*librariesp == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		struct bundler_library * const library = &(*librariesp)[(*countp)++];
+
+		*library = (struct bundler_library) { };
+		for (unsigned int i = 0; i < 64; i++) {
+			library->sha256[i] = tolower((unsigned char)sha256[i]);
+		}
+
+		if (asprintf(&library->name, "%s%s", directory, path) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		if (!bundler_find(bundler, library->name, &library->entry)) {
+			warnx("Missing '%s' in bundler", library->name);
+			free(contents);
+			return false;
+		}
+
+		library->path = storage_library_path(library->sha256);
+	}
+
+	free(contents);
+
+	return true;
+}
+
+/* Unpacks a library in store, unless it already is, its digest being its name. */
+static void
+bundler_library_unpack(struct bundler_library *library) {
+	if (access(library->path, R_OK) == 0) {
+		library->valid = true;
+		return;
+	}
+
+	uint8_t * const data = malloc(library->entry.size != 0 ? library->entry.size : 1);
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digestsz;
+
+	if (data == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (!bundler_inflate(&library->entry, data)) {
+		warnx("Unable to inflate '%s'", library->name);
+	} else if (EVP_Digest(data, library->entry.size, digest, &digestsz, EVP_sha256(), NULL) != 1) {
+		warnx("Unable to digest '%s'", library->name);
+	} else {
+		char hex[2 * EVP_MAX_MD_SIZE + 1];
+
+		for (unsigned int i = 0; i < digestsz; i++) {
+			snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+		}
+
+		if (strcmp(hex, library->sha256) != 0) {
+			warnx("Incoherent digest for '%s'!", library->name);
+		} else {
+			library->valid = storage_store(library->path, data, library->entry.size);
+		}
+	}
+
+	free(data);
+}
+
+static void *
+bundler_worker(void *data) {
+	struct bundler_pool * const pool = data;
+	size_t i;
+
+	while (i = atomic_fetch_add(&pool->next, 1), i < pool->count) {
+		bundler_library_unpack(&pool->libraries[i]);
+	}
+
+	return NULL;
+}
+
+static void
+bundler_libraries_unpack(struct bundler_library *libraries, size_t count) {
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	const unsigned int threads = online <= 1 ? 0 : online - 1 < BUNDLER_THREADS_MAX ? online - 1 : BUNDLER_THREADS_MAX;
+	struct bundler_pool pool = {
+		.libraries = libraries,
+		.count = count,
+	};
+	pthread_t workers[BUNDLER_THREADS_MAX];
+	unsigned int started = 0;
+
+	atomic_init(&pool.next, 0);
+
+	while (started < threads && started < count
+		&& pthread_create(&workers[started], NULL, bundler_worker, &pool) == 0) {
+		started++;
+	}
+
+	/* Help the workers, or do it all if none could be started. */
+	bundler_worker(&pool);
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+}
+
+/*
+ * Unpacks the versions and libraries of a bundler archive in store,
+ * and writes the main class and classpath to launch the server directly.
+ * Returns false if the archive is not a bundler or could not be unpacked.
+ */
+bool
+bundler_unpack(const char *archive) {
+	struct bundler bundler;
+
+	if (!bundler_open(archive, &bundler)) {
+		return false;
+	}
+
+	/* Archives prior to 1.18 are not bundlers, recorded with an empty classpath not to be looked into again. */
+	char * const main_class = bundler_read(&bundler, BUNDLER_MAIN_CLASS);
+	if (main_class == NULL) {
+		char * const classpath = storage_archive_classpath_path(archive);
+
+		storage_store(classpath, "", 0);
+
+		free(classpath);
+		bundler_close(&bundler);
+		return false;
+	}
+	main_class[strcspn(main_class, " \t\r\n")] = '\0';
+
+	/* Versions come first in the classpath, as the bundler itself orders them. */
+	struct bundler_library *libraries = NULL;
+	size_t count = 0;
+	bool unpacked = bundler_list(&bundler, BUNDLER_VERSIONS_LIST, BUNDLER_VERSIONS_DIR, &libraries, &count)
+		&& bundler_list(&bundler, BUNDLER_LIBRARIES_LIST, BUNDLER_LIBRARIES_DIR, &libraries, &count);
+
+	if (unpacked) {
+		bundler_libraries_unpack(libraries, count);
+
+		size_t length = strlen(main_class) + 2;
+		for (size_t i = 0; i < count; i++) {
+			unpacked = unpacked && libraries[i].valid;
+			length += strlen(libraries[i].path) + 1;
+		}
+
+		if (unpacked) {
+			char * const contents = malloc(length + 1), *current = contents;
+
+			current = stpcpy(stpcpy(current, main_class), "\n");
+			for (size_t i = 0; i < count; i++) {
+				current = stpcpy(current, libraries[i].path);
+				*current++ = i + 1 < count ? ':' : '\n';
+			}
+
+			char * const classpath = storage_archive_classpath_path(archive);
+			unpacked = storage_store(classpath, contents, current - contents);
+
+			free(classpath);
+			free(contents);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(libraries[i].name);
+		free(libraries[i].path);
+	}
+	free(libraries);
+	free(main_class);
+	bundler_close(&bundler);
+
+	return unpacked;
+}
+
+/*
+ * Reads the main class and classpath of an unpacked bundler, if all its libraries are still in store.
+ * Both are NULL for an archive recorded as not being a bundler.
+ */
+static bool
+bundler_classpath_load(const char *archive, char **main_classp, char **classpathp) {
+	char * const path = storage_archive_classpath_path(archive);
+	FILE * const filep = fopen(path, "r");
+	char *main_class = NULL, *classpath = NULL;
+	size_t main_class_capacity = 0, classpath_capacity = 0;
+	bool loaded = false;
+
+	free(path);
+
+	if (filep == NULL) {
+		return false;
+	}
+
+	const ssize_t length = getline(&main_class, &main_class_capacity, filep);
+
+	if (length < 0 && feof(filep)) {
+		free(main_class);
+		main_class = NULL;
+		loaded = true;
+	} else if (length > 1 && getline(&classpath, &classpath_capacity, filep) > 1) {
+		main_class[strcspn(main_class, "\n")] = '\0';
+		classpath[strcspn(classpath, "\n")] = '\0';
+
+		loaded = true;
+
+		char * const libraries = strdup(classpath), *next = libraries;
+		const char *library;
+		while (loaded && (library = strsep(&next, ":")) != NULL) {
+			loaded = access(library, R_OK) == 0;
+		}
+		free(libraries);
+	}
+
+	fclose(filep);
+
+	if (loaded) {
+		*main_classp = main_class;
+		*classpathp = classpath;
+	} else {
+		free(main_class);
+		free(classpath);
+	}
+
+	return loaded;
+}
+
+/*
+ * Tail of the server command line, either the archive itself,
+ * or the main class on the classpath of its unpacked bundler.
+ */
+char **
+bundler_server_target(const char *archive) {
+	char ** const target = malloc(4 * sizeof (*target));
+	char *main_class, *classpath;
+
+	if ((bundler_classpath_load(archive, &main_class, &classpath)
+		|| (bundler_unpack(archive) && bundler_classpath_load(archive, &main_class, &classpath)))
+		&& main_class != NULL) {
+		target[0] = "-cp";
+		target[1] = classpath;
+		target[2] = main_class;
+		target[3] = NULL;
+	} else {
+		target[0] = "-jar";
+		target[1] = (char *)archive;
+		target[2] = NULL;
+	}
+
+	/* NB: Will leak, living as long as the command line. */
+
+	return target;
+}
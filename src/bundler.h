@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef BUNDLER_H
+#define BUNDLER_H
+
+#include <stdbool.h>
+
+bool bundler_unpack(const char *archive);
+
+char **bundler_server_target(const char *archive);
+
+/* BUNDLER_H */
+#endif
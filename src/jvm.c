@@ -0,0 +1,875 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "jvm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <json-c/json.h>
+
+#include "storage.h"
+
+/* Memory left to the JVM's own native allocations, metaspace, code cache, thread stacks... */
+#define JVM_RESERVE_MIN (256 << 20)
+#define JVM_RESERVE_MAX (2048UL << 20)
+
+/* Heaps are never sized below this, even on small hosts. */
+#define JVM_HEAP_MIN (512 << 20)
+
+/* Initial heap, grown up to the maximum on demand, so the maximum is not committed up front. */
+#define JVM_HEAP_INITIAL (512 << 20)
+
+/* Identity of the JVM which dumped a class data sharing archive, kept aside it. */
+#define JVM_CDS_STAMP_SUFFIX ".jvm"
+#define JVM_CDS_TEMPORARY_SUFFIX ".tmp"
+
+/* A training or benchmarked server not done loading in time is killed. */
+#define JVM_RUN_TIMEOUT 600
+
+/* Each benchmark is run as many times, reporting medians. */
+#define JVM_BENCH_RUNS 3
+
+/* Server logs this once it is ready to accept players. */
+#define JVM_SERVER_DONE "]: Done ("
+
+static const char * const jvm_profile_g1[] = {
+	"-XX:+UseG1GC",
+	"-XX:MaxGCPauseMillis=130",
+	"-XX:+ParallelRefProcEnabled",
+	"-XX:+DisableExplicitGC",
+	"-XX:+UnlockExperimentalVMOptions",
+	"-XX:G1NewSizePercent=30",
+	"-XX:G1MaxNewSizePercent=40",
+	"-XX:G1HeapRegionSize=8M",
+	"-XX:G1ReservePercent=20",
+	"-XX:InitiatingHeapOccupancyPercent=15",
+	NULL,
+};
+
+static const char * const jvm_profile_zgc[] = {
+	"-XX:+UseZGC",
+	"-XX:+DisableExplicitGC",
+	NULL,
+};
+
+static const char * const jvm_profile_zgc_generational[] = {
+	"-XX:+UseZGC",
+	"-XX:+ZGenerational",
+	"-XX:+DisableExplicitGC",
+	NULL,
+};
+
+static const char * const jvm_profile_pretouch[] = {
+	"-XX:+UseG1GC",
+	"-XX:MaxGCPauseMillis=130",
+	"-XX:+ParallelRefProcEnabled",
+	"-XX:+DisableExplicitGC",
+	"-XX:+AlwaysPreTouch",
+	"-XX:+UseTransparentHugePages",
+	NULL,
+};
+
+static const char * const jvm_profile_none[] = {
+	NULL,
+};
+
+static const struct {
+	const char *name;
+	const char * const *options;
+} jvm_profiles[] = {
+	{ "g1", jvm_profile_g1 },
+	{ "zgc", jvm_profile_zgc },
+	{ "zgc-generational", jvm_profile_zgc_generational },
+	{ "pretouch", jvm_profile_pretouch },
+	{ "none", jvm_profile_none },
+};
+
+static const char * const *
+jvm_profile_options(const char *profile) {
+	for (unsigned int i = 0; i < sizeof (jvm_profiles) / sizeof (*jvm_profiles); i++) {
+		if (strcmp(jvm_profiles[i].name, profile) == 0) {
+			return jvm_profiles[i].options;
+		}
+	}
+
+	return NULL;
+}
+
+bool
+jvm_profile_exists(const char *profile) {
+	return jvm_profile_options(profile) != NULL;
+}
+
+/*
+ * Reads the cgroup v2 limit of our cgroup and its ancestors,
+ * returns the lowest one, or SIZE_MAX if unlimited or unknown.
+ */
+static size_t
+jvm_memory_cgroup_limit(void) {
+	FILE *filep = fopen("/proc/self/cgroup", "r");
+	size_t limit = SIZE_MAX;
+
+	if (filep == NULL) {
+		return limit;
+	}
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	/* The unified hierarchy is the single line of hierarchy id 0. */
+	while (length = getline(&line, &capacity, filep), length > 0) {
+		if (strncmp(line, "0::/", 4) == 0) {
+			break;
+		}
+	}
+	fclose(filep);
+
+	if (length <= 0) {
+		free(line);
+		return limit;
+	}
+
+	if (line[length - 1] == '\n') {
+		line[length - 1] = '\0';
+	}
+
+	char *cgroup = line + 3;
+	while (*cgroup != '\0') {
+		char *path, value[32];
+
+		if (asprintf(&path, "/sys/fs/cgroup%s/memory.max", cgroup) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		if ((filep = fopen(path, "r")) != NULL) {
+			if (fgets(value, sizeof (value), filep) != NULL && strncmp(value, "max", 3) != 0) {
+				const unsigned long long max = strtoull(value, NULL, 10);
+
+				if (max != 0 && max < limit) {
+					limit = max;
+				}
+			}
+			fclose(filep);
+		}
+		free(path);
+
+		*strrchr(cgroup, '/') = '\0';
+	}
+
+	free(line);
+
+	return limit;
+}
+
+/*
+ * Heap size of one of several instances sharing the memory of the host,
+ * or of our cgroup if it is lower, after their native overhead reserve.
+ */
+static size_t
+jvm_heap_size(unsigned int instances) {
+	const long pages = sysconf(_SC_PHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+	size_t memory = pages > 0 && pagesize > 0 ? (size_t)pages * pagesize : SIZE_MAX;
+	const size_t limit = jvm_memory_cgroup_limit();
+
+	if (limit < memory) {
+		memory = limit;
+	}
+
+	if (memory == SIZE_MAX) {
+		return 1024 << 20;
+	}
+
+	const size_t share = memory / instances;
+	size_t reserve = share / 4;
+
+	if (reserve < JVM_RESERVE_MIN) {
+		reserve = JVM_RESERVE_MIN;
+	} else if (reserve > JVM_RESERVE_MAX) {
+		reserve = JVM_RESERVE_MAX;
+	}
+
+	if (share < JVM_HEAP_MIN + reserve) {
+		return JVM_HEAP_MIN;
+	}
+
+	return share - reserve;
+}
+
+/*
+ * Server command line: the heap sizes, the profile options, the class
+ * data sharing option, then user options, and the server target.
+ * The maximum heap is heap MiB, or a share of the memory by instances if zero.
+ */
+char **
+jvm_argv(const char *jvm, const char *profile, unsigned int heap, unsigned int instances,
+	const char *cds, char * const *target, char **options, int count) {
+	const char * const *profile_options = jvm_profile_options(profile);
+	unsigned int profile_count = 0, target_count = 0;
+
+	if (profile_options == NULL) {
+		errx(EXIT_FAILURE, "Unknown JVM profile '%s'", profile);
+	}
+
+	/*
+	 * Only one collector can be selected, and an initial heap larger than the maximum
+	 * is refused, the user's collector and heap sizes take precedence over ours.
+	 */
+	bool collector = false, heap_set = false;
+	for (int option = 0; option < count; option++) {
+		const size_t length = strlen(options[option]);
+
+		if (strncmp(options[option], "-XX:+Use", 8) == 0
+			&& length > 10 && strcmp(options[option] + length - 2, "GC") == 0) {
+			collector = true;
+		} else if (strncmp(options[option], "-Xmx", 4) == 0
+			|| strncmp(options[option], "-Xms", 4) == 0) {
+			heap_set = true;
+		}
+	}
+
+	if (!collector) {
+		while (profile_options[profile_count] != NULL) {
+			profile_count++;
+		}
+	}
+
+	while (target[target_count] != NULL) {
+		target_count++;
+	}
+
+	char ** const argv = malloc((5 + profile_count + count + target_count) * sizeof (*argv));
+	unsigned int i = 0;
+
+	argv[i++] = (char *)jvm;
+
+	if (!heap_set) {
+		const size_t size = heap != 0 ? heap : jvm_heap_size(instances) >> 20;
+		const size_t initial = size < JVM_HEAP_INITIAL >> 20 ? size : JVM_HEAP_INITIAL >> 20;
+
+		/* NB: Both leak, living as long as argv. */
+		if (asprintf(&argv[i++], "-Xmx%zuM", size) < 0
+			|| asprintf(&argv[i++], "-Xms%zuM", initial) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+	}
+
+	for (unsigned int option = 0; option < profile_count; option++) {
+		argv[i++] = (char *)profile_options[option];
+	}
+
+	if (cds != NULL) {
+		argv[i++] = (char *)cds;
+	}
+
+	for (int option = 0; option < count; option++) {
+		argv[i++] = options[option];
+	}
+
+	for (unsigned int argument = 0; argument < target_count; argument++) {
+		argv[i++] = target[argument];
+	}
+	argv[i] = NULL;
+
+	return argv;
+}
+
+/* Real path of the JVM binary, looked up in PATH like execvp does. */
+static char *
+jvm_resolve(const char *jvm) {
+	if (strchr(jvm, '/') != NULL) {
+		return realpath(jvm, NULL);
+	}
+
+	const char * const env = getenv("PATH");
+	char * const paths = strdup(env != NULL ? env : "/usr/bin:/bin");
+	char *resolved = NULL, *next = paths;
+	const char *directory;
+
+	while (resolved == NULL && (directory = strsep(&next, ":")) != NULL) {
+		char *candidate;
+
+		if (asprintf(&candidate, "%s/%s", *directory != '\0' ? directory : ".", jvm) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		if (access(candidate, X_OK) == 0) {
+			resolved = realpath(candidate, NULL);
+		}
+
+		free(candidate);
+	}
+
+	free(paths);
+
+	return resolved;
+}
+
+/* The JVM binary's real path, device, inode, size and modification time. */
+static bool
+jvm_stamp(const char *jvm, char *stamp, size_t size) {
+	char * const resolved = jvm_resolve(jvm);
+	struct stat st;
+
+	if (resolved == NULL || stat(resolved, &st) != 0) {
+		free(resolved);
+		return false;
+	}
+
+	const struct timespec mtime = storage_mtime(&st);
+
+	snprintf(stamp, size, "%s %ju %ju %jd %jd.%09ld", resolved,
+		(uintmax_t)st.st_dev, (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+		(intmax_t)mtime.tv_sec, mtime.tv_nsec);
+
+	free(resolved);
+
+	return true;
+}
+
+static char *
+jvm_cds_stamp_path(const char *archive) {
+	char *path;
+
+	if (asprintf(&path, "%s" JVM_CDS_STAMP_SUFFIX, archive) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return path;
+}
+
+static bool
+jvm_cds_stamp_matches(const char *archive, const char *stamp) {
+	char * const path = jvm_cds_stamp_path(archive);
+	FILE * const filep = fopen(path, "r");
+	bool matches = false;
+
+	if (filep != NULL) {
+		char *line = NULL;
+		size_t capacity = 0;
+		const ssize_t length = getline(&line, &capacity, filep);
+
+		if (length > 0) {
+			if (line[length - 1] == '\n') {
+				line[length - 1] = '\0';
+			}
+			matches = strcmp(line, stamp) == 0;
+		}
+
+		free(line);
+		fclose(filep);
+	}
+
+	free(path);
+
+	return matches;
+}
+
+static void
+jvm_cds_stamp_save(const char *archive, const char *stamp) {
+	char * const path = jvm_cds_stamp_path(archive);
+	FILE * const filep = fopen(path, "w");
+
+	if (filep == NULL) {
+		warn("fopen '%s'", path);
+	} else {
+		fprintf(filep, "%s\n", stamp);
+
+		if (fclose(filep) != 0) {
+			warn("fclose '%s'", path);
+		}
+	}
+
+	free(path);
+}
+
+/*
+ * Option to use the class data sharing archive, if there is one.
+ * An archive dumped by another JVM would be ignored, the server
+ * dumps it again on exit instead, to a temporary of its own described
+ * in *dumpp, see jvm_cds_dump_finish.
+ */
+char *
+jvm_cds_option(const char *jvm, const char *archive, struct jvm_cds_dump **dumpp) {
+	static unsigned int dumps;
+	char stamp[PATH_MAX + 128], *option;
+
+	*dumpp = NULL;
+
+	if (access(archive, R_OK) != 0 || !jvm_stamp(jvm, stamp, sizeof (stamp))) {
+		return NULL;
+	}
+
+	if (jvm_cds_stamp_matches(archive, stamp)) {
+		if (asprintf(&option, "-XX:SharedArchiveFile=%s", archive) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+	} else {
+		struct jvm_cds_dump * const dump = malloc(sizeof (*dump));
+
+		warnx("Class data sharing archive '%s' was dumped by another JVM, dumping it again on exit", archive);
+
+		/* Supervised worlds may share an archive, each dumps to its own temporary. */
+		if (asprintf(&dump->archive, "%s", archive) < 0 || asprintf(&dump->stamp, "%s", stamp) < 0
+			|| asprintf(&dump->temporary, "%s.%d.%u" JVM_CDS_TEMPORARY_SUFFIX, archive, (int)getpid(), dumps++) < 0
+			|| asprintf(&dump->option, "-XX:ArchiveClassesAtExit=%s", dump->temporary) < 0
+			|| asprintf(&dump->share, "-XX:SharedArchiveFile=%s", archive) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		option = dump->option;
+		*dumpp = dump;
+	}
+
+	return option;
+}
+
+/*
+ * Puts the archive dumped by a server in place once it exited cleanly, only then stamping it
+ * with the JVM which dumped it, and returns whether it did. Once in place, the dump option in
+ * argv, if any, is replaced to use the archive, and dump is freed. Otherwise its temporary is removed.
+ */
+bool
+jvm_cds_dump_finish(struct jvm_cds_dump *dump, char **argv, bool clean) {
+
+	if (!clean || access(dump->temporary, R_OK) != 0) {
+		unlink(dump->temporary);
+		return false;
+	}
+
+	const int lock = storage_lock(dump->archive, true);
+
+	if (rename(dump->temporary, dump->archive) != 0) {
+		warn("rename '%s'", dump->archive);
+		unlink(dump->temporary);
+		storage_unlock(lock);
+		return false;
+	}
+
+	jvm_cds_stamp_save(dump->archive, dump->stamp);
+
+	storage_unlock(lock);
+
+	for (char **argp = argv; argp != NULL && *argp != NULL; argp++) {
+		if (*argp == dump->option) {
+			*argp = dump->share;
+		}
+	}
+
+	/* NB: The share option is not freed, it may live as long as argv. */
+	free(dump->option);
+	free(dump->temporary);
+	free(dump->stamp);
+	free(dump->archive);
+	free(dump);
+
+	return true;
+}
+
+static pid_t jvm_cds_dump_pid;
+
+static void
+jvm_cds_dump_forward(int signo) {
+	kill(jvm_cds_dump_pid, signo);
+}
+
+/*
+ * Runs a server dumping its class data sharing archive, rather than replacing us,
+ * to put the archive in place once it exited. Returns the status to exit with.
+ * Terminal interrupts reach the server through the process group, others are forwarded.
+ */
+int
+jvm_cds_dump_run(char * const *argv, struct jvm_cds_dump *dump) {
+	const pid_t pid = fork();
+	int status;
+
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		execvp(*argv, argv);
+		warn("execvp %s", *argv);
+		_exit(127);
+	}
+
+	jvm_cds_dump_pid = pid;
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTERM, jvm_cds_dump_forward);
+	signal(SIGHUP, jvm_cds_dump_forward);
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "waitpid");
+		}
+	}
+
+	const bool clean = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	if (!jvm_cds_dump_finish(dump, NULL, clean)) {
+		warnx("Server did not exit cleanly, its class data sharing archive was discarded");
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+ * Option to use the class data sharing archive, only if it was dumped by this JVM.
+ * Unlike jvm_cds_option, it never has the server dump it again.
+ */
+char *
+jvm_cds_share_option(const char *jvm, const char *archive) {
+	char stamp[PATH_MAX + 128], *option;
+
+	if (access(archive, R_OK) != 0 || !jvm_stamp(jvm, stamp, sizeof (stamp))
+		|| !jvm_cds_stamp_matches(archive, stamp)) {
+		return NULL;
+	}
+
+	if (asprintf(&option, "-XX:SharedArchiveFile=%s", archive) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return option;
+}
+
+static pid_t jvm_run_pid;
+
+static void
+jvm_run_timeout(int signo) {
+	kill(jvm_run_pid, SIGKILL);
+}
+
+static void
+jvm_scratch_file(const char *directory, const char *name, const char *mode, const char *contents) {
+	char *path;
+
+	if (asprintf(&path, "%s/%s", directory, name) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	FILE * const filep = fopen(path, mode);
+	if (filep == NULL || fputs(contents, filep) == EOF || fclose(filep) != 0) {
+		err(EXIT_FAILURE, "Unable to write '%s'", path);
+	}
+
+	free(path);
+}
+
+/*
+ * Creates a scratch directory to run a server in, with a copy of world if any.
+ * Else, every run generates the same world, for comparable timings.
+ */
+static char *
+jvm_scratch_world(const char *world) {
+	char * const directory = storage_scratch_directory();
+
+	jvm_scratch_file(directory, "eula.txt", "w", "eula=true\n");
+
+	if (world != NULL) {
+		char * const source = storage_world_directory(world);
+
+		storage_copy_tree(source, directory);
+		free(source);
+
+		/* Last values win, never conflict with the ports of the world's own server. */
+		jvm_scratch_file(directory, "server.properties", "a",
+			"\nserver-port=0\nenable-query=false\nenable-rcon=false\n");
+	} else {
+		jvm_scratch_file(directory, "server.properties", "w", "level-seed=mcserver\nserver-port=0\n");
+	}
+
+	return directory;
+}
+
+struct jvm_run {
+	/* Milliseconds until done loading, zero on failure. */
+	uint64_t ready;
+	/* Until stopped, CPU time in milliseconds and peak resident set size in KiB. */
+	uint64_t cpu, rss;
+};
+
+/* Runs a server in directory until it is done loading, then stops it. */
+static void
+jvm_run(char * const *argv, const char *directory, struct jvm_run *run) {
+	int input[2], output[2];
+	struct timespec start, now;
+	struct rusage usage;
+
+	run->ready = 0;
+
+	if (pipe(input) != 0 || pipe(output) != 0) {
+		err(EXIT_FAILURE, "pipe");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+
+		if (dup2(input[0], STDIN_FILENO) < 0
+			|| dup2(output[1], STDOUT_FILENO) < 0
+			|| dup2(output[1], STDERR_FILENO) < 0) {
+			_exit(127);
+		}
+		close(input[0]);
+		close(input[1]);
+		close(output[0]);
+		close(output[1]);
+
+		if (chdir(directory) != 0) {
+			_exit(127);
+		}
+
+		execvp(*argv, argv);
+		_exit(127);
+	}
+
+	close(input[0]);
+	close(output[1]);
+
+	jvm_run_pid = pid;
+	signal(SIGALRM, jvm_run_timeout);
+	alarm(JVM_RUN_TIMEOUT);
+
+	FILE * const filep = fdopen(output[0], "r");
+	char *line = NULL, *last = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	while (length = getline(&line, &capacity, filep), length > 0) {
+		if (run->ready == 0 && strstr(line, JVM_SERVER_DONE) != NULL) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			run->ready = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (run->ready == 0) {
+				run->ready = 1;
+			}
+
+			if (write(input[1], "stop\n", 5) != 5) {
+				warn("Unable to stop server");
+			}
+		}
+
+		if (line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		free(last);
+		last = strdup(line);
+	}
+
+	fclose(filep);
+	close(input[1]);
+
+	int status;
+	while (wait4(pid, &status, 0, &usage) < 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "wait4");
+		}
+	}
+	alarm(0);
+
+	if (run->ready == 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		warnx("Server failed, its last words were: %s", last != NULL ? last : "none");
+		run->ready = 0;
+	}
+
+	run->cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+#ifdef __APPLE__
+	/* In bytes on macOS, kilobytes elsewhere. */
+	run->rss = usage.ru_maxrss / 1024;
+#else
+	run->rss = usage.ru_maxrss;
+#endif
+
+	free(line);
+	free(last);
+}
+
+/* Runs a server in a generated scratch world, returns the milliseconds it took to be done, or zero on failure. */
+static uint64_t
+jvm_cds_run(char * const *argv) {
+	char * const directory = jvm_scratch_world(NULL);
+	struct jvm_run run;
+
+	jvm_run(argv, directory, &run);
+
+	storage_remove(directory);
+	free(directory);
+
+	return run.ready;
+}
+
+/*
+ * Dumps the class data sharing archive of a server with a training run,
+ * then measures the improvement with a second run using it.
+ */
+bool
+jvm_cds_generate(const char *jvm, const char *profile, char * const *target, const char *archive) {
+	char stamp[PATH_MAX + 128], *temporary, *dump, *share;
+
+	if (!jvm_stamp(jvm, stamp, sizeof (stamp))) {
+		warnx("Unable to find JVM '%s'", jvm);
+		return false;
+	}
+
+	if (asprintf(&temporary, "%s" JVM_CDS_TEMPORARY_SUFFIX, archive) < 0
+		|| asprintf(&dump, "-XX:ArchiveClassesAtExit=%s", temporary) < 0
+		|| asprintf(&share, "-XX:SharedArchiveFile=%s", temporary) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	/* Writes to a dead training server must not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	char *options[] = { "-Djava.awt.headless=true" };
+	char ** const dump_argv = jvm_argv(jvm, profile, 0, 1, dump, target, options, 1);
+	char ** const share_argv = jvm_argv(jvm, profile, 0, 1, share, target, options, 1);
+	uint64_t cold, warm = 0;
+	bool generated = false;
+
+	if ((cold = jvm_cds_run(dump_argv)) != 0) {
+		if (access(temporary, R_OK) != 0) {
+			warnx("JVM '%s' did not dump a class data sharing archive, it requires JDK 13 or later", jvm);
+		} else if ((warm = jvm_cds_run(share_argv)) != 0) {
+			if (rename(temporary, archive) != 0) {
+				warn("rename '%s'", archive);
+			} else {
+				jvm_cds_stamp_save(archive, stamp);
+				generated = true;
+			}
+		}
+	}
+
+	if (generated) {
+		printf("%s: Done in %" PRIu64 ".%03" PRIu64 "s without class data sharing, %" PRIu64 ".%03" PRIu64 "s with it\n",
+			archive, cold / 1000, cold % 1000, warm / 1000, warm % 1000);
+	} else {
+		unlink(temporary);
+	}
+
+	free(dump_argv);
+	free(share_argv);
+	free(share);
+	free(dump);
+	free(temporary);
+
+	return generated;
+}
+
+static int
+jvm_bench_compare(const void *lhs, const void *rhs) {
+	const uint64_t a = *(const uint64_t *)lhs, b = *(const uint64_t *)rhs;
+
+	return (a > b) - (a < b);
+}
+
+static uint64_t
+jvm_bench_median(uint64_t *values, size_t count) {
+
+	qsort(values, count, sizeof (*values), jvm_bench_compare);
+
+	return values[count / 2];
+}
+
+/* Runs a server several times in a scratch world, a copy of world if any, keeping the medians. */
+void
+jvm_bench_run(char * const *argv, const char *world, struct jvm_bench *bench) {
+	uint64_t ready[JVM_BENCH_RUNS], cpu[JVM_BENCH_RUNS], rss[JVM_BENCH_RUNS];
+
+	/* Writes to a dead server must not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	bench->ready = 0;
+
+	for (unsigned int i = 0; i < JVM_BENCH_RUNS; i++) {
+		char * const directory = jvm_scratch_world(world);
+		struct jvm_run run;
+
+		jvm_run(argv, directory, &run);
+
+		storage_remove(directory);
+		free(directory);
+
+		/* A failure makes the whole benchmark irrelevant. */
+		if (run.ready == 0) {
+			return;
+		}
+
+		ready[i] = run.ready;
+		cpu[i] = run.cpu;
+		rss[i] = run.rss;
+	}
+
+	bench->ready = jvm_bench_median(ready, JVM_BENCH_RUNS);
+	bench->cpu = jvm_bench_median(cpu, JVM_BENCH_RUNS);
+	bench->rss = jvm_bench_median(rss, JVM_BENCH_RUNS);
+}
+
+/* Prints a comparison table of benchmarks on stderr, and their JSON on stdout. */
+void
+jvm_bench_report(const struct jvm_bench *benches, size_t count) {
+	struct json_object * const report = json_object_new_object(), * const array = json_object_new_array();
+	uint64_t fastest = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (benches[i].ready != 0 && (fastest == 0 || benches[i].ready < fastest)) {
+			fastest = benches[i].ready;
+		}
+	}
+
+	fprintf(stderr, "%-24s %-18s %-4s %10s %10s %10s %8s\n",
+		"VERSION", "PROFILE", "CDS", "READY", "CPU", "RSS", "SLOWER");
+
+	for (size_t i = 0; i < count; i++) {
+		const struct jvm_bench * const bench = &benches[i];
+		struct json_object * const object = json_object_new_object();
+
+		json_object_object_add(object, "version", json_object_new_string(bench->version));
+		json_object_object_add(object, "profile", json_object_new_string(bench->profile));
+		json_object_object_add(object, "cds", json_object_new_boolean(bench->cds));
+
+		if (bench->ready == 0) {
+			fprintf(stderr, "%-24s %-18s %-4s %10s %10s %10s %8s\n",
+				bench->version, bench->profile, bench->cds ? "yes" : "no", "failed", "-", "-", "-");
+			json_object_object_add(object, "failed", json_object_new_boolean(true));
+		} else {
+			fprintf(stderr, "%-24s %-18s %-4s %7" PRIu64 ".%" PRIu64 "s %7" PRIu64 ".%" PRIu64 "s %7" PRIu64 "MiB %7" PRIu64 "%%\n",
+				bench->version, bench->profile, bench->cds ? "yes" : "no",
+				bench->ready / 1000, bench->ready % 1000 / 100, bench->cpu / 1000, bench->cpu % 1000 / 100,
+				bench->rss / 1024, (bench->ready - fastest) * 100 / fastest);
+			json_object_object_add(object, "failed", json_object_new_boolean(false));
+			json_object_object_add(object, "ready_ms", json_object_new_int64(bench->ready));
+			json_object_object_add(object, "cpu_ms", json_object_new_int64(bench->cpu));
+			json_object_object_add(object, "peak_rss_kib", json_object_new_int64(bench->rss));
+		}
+
+		json_object_array_add(array, object);
+	}
+
+	json_object_object_add(report, "runs", json_object_new_int64(JVM_BENCH_RUNS));
+	json_object_object_add(report, "benches", array);
+
+	puts(json_object_to_json_string_ext(report, JSON_C_TO_STRING_PRETTY));
+
+	json_object_put(report);
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef JVM_H
+#define JVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct jvm_bench {
+	const char *version, *profile;
+	bool cds;
+	/* Medians of the runs, in milliseconds until done loading, zero if any failed. */
+	uint64_t ready;
+	/* Until stopped, CPU time in milliseconds and peak resident set size in KiB. */
+	uint64_t cpu, rss;
+};
+
+/* A class data sharing archive a server dumps on exit, to a temporary until it exited cleanly. */
+struct jvm_cds_dump {
+	char *archive, *temporary, *stamp;
+	/* Options to dump the archive, and to use it once in place. */
+	char *option, *share;
+};
+
+bool jvm_profile_exists(const char *profile);
+
+char **jvm_argv(const char *jvm, const char *profile, unsigned int heap, unsigned int instances,
+	const char *cds, char * const *target, char **options, int count);
+
+char *jvm_cds_option(const char *jvm, const char *archive, struct jvm_cds_dump **dumpp);
+
+bool jvm_cds_dump_finish(struct jvm_cds_dump *dump, char **argv, bool clean);
+
+int jvm_cds_dump_run(char * const *argv, struct jvm_cds_dump *dump);
+
+char *jvm_cds_share_option(const char *jvm, const char *archive);
+
+bool jvm_cds_generate(const char *jvm, const char *profile, char * const *target, const char *archive);
+
+void jvm_bench_run(char * const *argv, const char *world, struct jvm_bench *bench);
+
+void jvm_bench_report(const struct jvm_bench *benches, size_t count);
+
+/* JVM_H */
+#endif
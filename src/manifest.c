@@ -5,26 +5,51 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <errno.h>
 #include <err.h>
 
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <json-c/json.h>
 #include <curl/curl.h>
 
+#include "bundler.h"
 #include "storage.h"
+#include "trace.h"
 
 struct fetch_and_decode_json {
 	struct json_tokener *tokener;
 	struct json_object *object;
+
+	/* Raw document, kept to be verified and cached. */
+	char *data;
+	size_t size, capacity;
 };
 
 static size_t
 fetch_and_decode_json_write(const void *data,
 	size_t one, size_t count, struct fetch_and_decode_json *context) {
 
+	if (context->size + count > context->capacity) {
+		char * const buffer = realloc(context->data, (context->size + count) * 2);
+
+		if (buffer == NULL) {
+			warn("realloc");
+			return 0;
+		}
+
+		context->data = buffer;
+		context->capacity = (context->size + count) * 2;
+	}
+
+	memcpy(context->data + context->size, data, count);
+	context->size += count;
+
 	/* Discard bytes after one object was parsed, abort if an error occured. */
 	if (context->object == NULL) {
 		struct json_tokener * const tokener = context->tokener;
@@ -46,95 +71,257 @@ fetch_and_decode_json_write(const void *data,
 	return count;
 }
 
-static struct json_object *
-fetch_and_decode_json(const char *url) {
-	struct fetch_and_decode_json context = {
-		.tokener = json_tokener_new(),
-		.object = NULL,
-	};
+static CURL *
+fetch_and_decode_json_open(const char *url, struct fetch_and_decode_json *context) {
+	CURL * const easy = storage_transfer_open(url, true);
 
-	CURL * const easy = curl_easy_init();
+	context->tokener = json_tokener_new();
+	context->object = NULL;
+	context->data = NULL;
+	context->size = 0;
+	context->capacity = 0;
 
-	curl_easy_setopt(easy, CURLOPT_URL, url);
-	curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "https");
+	curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
 	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, fetch_and_decode_json_write);
-	curl_easy_setopt(easy, CURLOPT_WRITEDATA, &context);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, context);
+
+	return easy;
+}
+
+/* NB: The raw document in context->data is left to the caller to release. */
+static struct json_object *
+fetch_and_decode_json_close(CURL *easy, struct fetch_and_decode_json *context, CURLcode res) {
+	struct json_object *object = context->object;
+	const char *url;
+
+	curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+	trace_transfer("package", easy);
 
-	const CURLcode res = curl_easy_perform(easy);
 	if (res != CURLE_OK) {
-		errx(EXIT_FAILURE, "curl_easy_perform %s: %s", url, curl_easy_strerror(res));
+		warnx("Unable to fetch '%s': %s", url, curl_easy_strerror(res));
+		json_object_put(object);
+		object = NULL;
+	} else if (object == NULL) {
+		warnx("Unable to fetch '%s': Truncated JSON document", url);
 	}
 
 	curl_easy_cleanup(easy);
+	json_tokener_free(context->tokener);
 
-	json_tokener_free(context.tokener);
-
-	return context.object;
+	return object;
 }
 
+static const char * const manifest_types[] = {
+	"release",
+	"snapshot",
+	"old_beta",
+	"old_alpha",
+};
+
+#define MANIFEST_TYPES_COUNT (sizeof (manifest_types) / sizeof (*manifest_types))
+
+/*
+ * The version manifest index is a flat file, mapped in memory as is.
+ * It holds a header, a power of two count of hash buckets, the versions
+ * entries in manifest order, then a pool of nul-terminated strings.
+ * Buckets and entries chain entries indices, strings are offsets
+ * in the pool, whose first string is the empty string.
+ */
+#define MANIFEST_INDEX_MAGIC "MCSIDX02"
+#define MANIFEST_INDEX_NONE UINT32_MAX
+
+struct manifest_index_header {
+	char magic[8];
+	/* Identity of the version manifest the index was built from. */
+	uint64_t manifest_dev, manifest_ino, manifest_size;
+	int64_t manifest_mtime_sec, manifest_mtime_nsec;
+	uint32_t latest[MANIFEST_TYPES_COUNT];
+	uint32_t buckets_count, entries_count, strings_size;
+};
+
+struct manifest_index_entry {
+	uint32_t hash, next;
+	uint32_t type, id, url, sha1;
+};
+
 static struct {
-	struct json_object *object;
+	const struct manifest_index_header *header;
+	size_t size;
+	const uint32_t *buckets;
+	const struct manifest_index_entry *entries;
+	const char *strings;
+	const char *url;
+	time_t max_age;
+	bool offline;
 } manifest;
 
+static uint32_t
+manifest_index_hash(const char *type, const char *id) {
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a of "type/id". */
+	for (const char *c = type; *c != '\0'; c++) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+
+	hash = (hash ^ '/') * 16777619u;
+
+	for (const char *c = id; *c != '\0'; c++) {
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+
+	return hash;
+}
+
+static const struct manifest_index_entry *
+manifest_index_find(const char *type, const char *id) {
+	const uint32_t hash = manifest_index_hash(type, id);
+	uint32_t next = manifest.buckets[hash & (manifest.header->buckets_count - 1)];
+
+	while (next != MANIFEST_INDEX_NONE) {
+		const struct manifest_index_entry * const entry = &manifest.entries[next];
+
+		if (entry->hash == hash
+			&& strcmp(manifest.strings + entry->id, id) == 0
+			&& strcmp(manifest.strings + entry->type, type) == 0) {
+			return entry;
+		}
+
+		next = entry->next;
+	}
+
+	return NULL;
+}
+
 static void
 manifest_resolve_version(const char *version, const char **typep, const char **idp) {
-	static const char * const types[] = {
-		"release",
-		"snapshot",
-		"old_beta",
-		"old_alpha",
-	};
-	const char * const separator = strchr(version, '/'), *type, *id;
+	const char * const separator = strchr(version, '/'), *id;
+	const uint64_t start = trace_now();
+	unsigned int type = 0;
 
 	if (separator != NULL) {
-		unsigned int i = 0;
-		size_t length;
+		const size_t length = separator - version;
 
-		while (i < sizeof (types) / sizeof (*types)
-			&& (length = separator - version, strlen(types[i]) != length
-				|| strncmp(types[i], version, length) != 0)) {
-			i++;
+		while (type < MANIFEST_TYPES_COUNT
+			&& (strlen(manifest_types[type]) != length
+				|| strncmp(manifest_types[type], version, length) != 0)) {
+			type++;
 		}
 
-		if (i == sizeof (types) / sizeof (*types)) {
+		if (type == MANIFEST_TYPES_COUNT) {
 			errx(EXIT_FAILURE, "Unknown version type '%.*s'", (int)length, version);
 		}
 
-		type = types[i];
 		id = separator + 1;
 	} else {
-		type = types[0];
 		id = version;
 	}
 
 	if (strcmp("latest", id) == 0) {
-		struct json_object *latest;
+		const uint32_t latest = manifest.header->latest[type];
 
-		if (!json_object_object_get_ex(manifest.object, "latest", &latest)) {
-			errx(EXIT_FAILURE, "Unable to get 'latest' in version manifest!");
+		if (latest == MANIFEST_INDEX_NONE) {
+			errx(EXIT_FAILURE, "Unable to get 'latest.%s' in version manifest!", manifest_types[type]);
 		}
 
-		if (!json_object_object_get_ex(latest, type, &latest)) {
-			errx(EXIT_FAILURE, "Unable to get 'latest.%s' in version manifest!", type);
+		id = manifest.strings + latest;
+	}
+
+	*typep = manifest_types[type];
+	*idp = id;
+
+	trace_phase("manifest.resolve", version, start, -1);
+}
+
+static const char *
+manifest_version_package_url(const char *type, const char *id) {
+	const struct manifest_index_entry * const entry = manifest_index_find(type, id);
+
+	if (entry == NULL) {
+		errx(EXIT_FAILURE, "Version %s/%s not found in manifest!", type, id);
+	}
+
+	return manifest.strings + entry->url;
+}
+
+struct manifest_index_strings {
+	char *pool;
+	size_t size, capacity;
+};
+
+static uint32_t
+manifest_index_strings_push(struct manifest_index_strings *strings, const char *string) {
+	const size_t length = strlen(string) + 1;
+	const size_t offset = strings->size;
+
+	if (offset + length > strings->capacity) {
+		strings->capacity = (offset + length) * 2;
+		strings->pool = realloc(strings->pool, strings->capacity);
+		if (strings->pool == NULL) {
+			err(EXIT_FAILURE, "realloc");
 		}
+	}
+
+	memcpy(strings->pool + offset, string, length);
+	strings->size += length;
+
+	return offset;
+}
+
+static const char *
+manifest_object_string(struct json_object *object, const char *field, size_t idx) {
+	struct json_object *value_object;
+
+	if (!json_object_object_get_ex(object, field, &value_object)) {
+		errx(EXIT_FAILURE, "Unable to get 'versions[%lu].%s' in manifest!", idx, field);
+	}
+
+	const char * const value = json_object_get_string(value_object);
+	if (value == NULL) {
+		errx(EXIT_FAILURE, "'versions[%lu].%s' is null in manifest!", idx, field);
+	}
+
+	return value;
+}
+
+static struct json_object *
+manifest_parse(const char *path) {
+	struct json_tokener * const tokener = json_tokener_new();
+	struct json_object *object = NULL;
+	const int fd = open(path, O_RDONLY);
+	char buffer[getpagesize()];
+	ssize_t copied;
+
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open '%s'", path);
+	}
 
-		const char * const resolved = json_object_get_string(latest);
-		if (resolved == NULL) {
-			errx(EXIT_FAILURE, "'latest.%s' in version manifest is null!", type);
+	while (copied = read(fd, buffer, sizeof (buffer)), object == NULL && copied > 0) {
+		object = json_tokener_parse_ex(tokener, buffer, copied);
+
+		const enum json_tokener_error jerr = json_tokener_get_error(tokener);
+		if (jerr != json_tokener_continue && jerr != json_tokener_success) {
+			errx(EXIT_FAILURE, "Unable to parse version manifest file '%s': %s", path, json_tokener_error_desc(jerr));
 		}
+	}
 
-		id = resolved;
+	close(fd);
+	json_tokener_free(tokener);
+
+	if (object == NULL) {
+		errx(EXIT_FAILURE, "Unable to parse version manifest file '%s': Truncated JSON document", path);
 	}
 
-	*typep = type;
-	*idp = id;
+	return object;
 }
 
-static const char *
-manifest_version_package_url(const char *type, const char *id) {
-	struct json_object *versions_object;
+/* Builds the index of the version manifest at path, and writes it at index_path. */
+static void
+manifest_index_build(const char *path, const struct stat *st, const char *index_path) {
+	struct json_object * const object = manifest_parse(path);
+	struct json_object *versions_object, *latest_object;
 
-	if (!json_object_object_get_ex(manifest.object, "versions", &versions_object)) {
+	if (!json_object_object_get_ex(object, "versions", &versions_object)) {
 		errx(EXIT_FAILURE, "Unable to get 'versions' in version manifest!");
 	}
 
@@ -142,166 +329,1034 @@ manifest_version_package_url(const char *type, const char *id) {
 		errx(EXIT_FAILURE, "'versions' is not an array in version manifest!");
 	}
 
-	/* Must iterate all versions and find by type/id. */
-	const size_t versions_object_length = json_object_array_length(versions_object);
-	for (size_t idx = 0; idx < versions_object_length; idx++) {
-		struct json_object * const version_object = json_object_array_get_idx(versions_object, idx);
-		struct json_object *object;
+	if (!json_object_object_get_ex(object, "latest", &latest_object)) {
+		errx(EXIT_FAILURE, "Unable to get 'latest' in version manifest!");
+	}
+
+	const size_t entries_count = json_object_array_length(versions_object);
+	uint32_t buckets_count = 1;
+
+	/* Keep the load factor under one half. */
+	while (buckets_count < 2 * entries_count) {
+		buckets_count <<= 1;
+	}
+
+	const struct timespec mtime = storage_mtime(st);
+	struct manifest_index_header header = {
+		.magic = MANIFEST_INDEX_MAGIC,
+		.manifest_dev = st->st_dev,
+		.manifest_ino = st->st_ino,
+		.manifest_size = st->st_size,
+		.manifest_mtime_sec = mtime.tv_sec,
+		.manifest_mtime_nsec = mtime.tv_nsec,
+		.buckets_count = buckets_count,
+		.entries_count = entries_count,
+	};
+	uint32_t * const buckets = malloc(buckets_count * sizeof (*buckets));
+	struct manifest_index_entry * const entries = calloc(entries_count, sizeof (*entries));
+	struct manifest_index_strings strings = { };
+
+	manifest_index_strings_push(&strings, "");
 
-		/* Check type. */
-		if (!json_object_object_get_ex(version_object, "type", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'versions[%lu].type' in manifest!", idx);
+	for (unsigned int type = 0; type < MANIFEST_TYPES_COUNT; type++) {
+		struct json_object *latest;
+		const char *latest_id;
+
+		if (json_object_object_get_ex(latest_object, manifest_types[type], &latest)
+			&& (latest_id = json_object_get_string(latest)) != NULL) {
+			header.latest[type] = manifest_index_strings_push(&strings, latest_id);
+		} else {
+			header.latest[type] = MANIFEST_INDEX_NONE;
 		}
+	}
+
+	memset(buckets, 0xff, buckets_count * sizeof (*buckets));
 
-		const char * const version_object_type = json_object_get_string(object);
-		if (version_object_type == NULL) {
-			errx(EXIT_FAILURE, "'versions[%lu].type' is null in manifest!", idx);
+	for (size_t idx = 0; idx < entries_count; idx++) {
+		struct json_object * const version_object = json_object_array_get_idx(versions_object, idx);
+		struct manifest_index_entry * const entry = &entries[idx];
+		const char * const type = manifest_object_string(version_object, "type", idx),
+			* const id = manifest_object_string(version_object, "id", idx);
+		struct json_object *sha1_object;
+		const char *sha1;
+
+		entry->hash = manifest_index_hash(type, id);
+		entry->type = manifest_index_strings_push(&strings, type);
+		entry->id = manifest_index_strings_push(&strings, id);
+		entry->url = manifest_index_strings_push(&strings, manifest_object_string(version_object, "url", idx));
+
+		/* Only present in later revisions of the manifest. */
+		if (json_object_object_get_ex(version_object, "sha1", &sha1_object)
+			&& (sha1 = json_object_get_string(sha1_object)) != NULL) {
+			entry->sha1 = manifest_index_strings_push(&strings, sha1);
+		} else {
+			entry->sha1 = 0;
 		}
 
-		if (strcmp(type, version_object_type) != 0) {
-			continue;
+		/* Prepend to the bucket's chain, chains are reversed once complete. */
+		uint32_t * const bucket = &buckets[entry->hash & (buckets_count - 1)];
+		entry->next = *bucket;
+		*bucket = idx;
+	}
+
+	json_object_put(object);
+
+	/* Lookups walk chains from the head, restore manifest order within each bucket. */
+	for (uint32_t i = 0; i < buckets_count; i++) {
+		uint32_t previous = MANIFEST_INDEX_NONE, current = buckets[i];
+
+		while (current != MANIFEST_INDEX_NONE) {
+			const uint32_t next = entries[current].next;
+
+			entries[current].next = previous;
+			previous = current;
+			current = next;
 		}
 
-		/* Check id. */
-		if (!json_object_object_get_ex(version_object, "id", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'versions[%lu].id' in manifest!", idx);
+		buckets[i] = previous;
+	}
+
+	header.strings_size = strings.size;
+
+	/* Write in a temporary file, renamed so concurrent readers never map a partial index. */
+	char *temporary;
+
+	if (asprintf(&temporary, "%s.XXXXXX", index_path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const int fd = mkstemp(temporary);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "mkstemp '%s'", temporary);
+	}
+
+	FILE * const filep = fdopen(fd, "w");
+	if (filep == NULL
+		|| fwrite(&header, sizeof (header), 1, filep) != 1
+		|| fwrite(buckets, sizeof (*buckets), buckets_count, filep) != buckets_count
+		|| fwrite(entries, sizeof (*entries), entries_count, filep) != entries_count
+		|| fwrite(strings.pool, 1, strings.size, filep) != strings.size
+		|| fclose(filep) != 0) {
+		unlink(temporary);
+		err(EXIT_FAILURE, "write '%s'", temporary);
+	}
+
+	if (rename(temporary, index_path) != 0) {
+		unlink(temporary);
+		err(EXIT_FAILURE, "rename '%s'", index_path);
+	}
+
+	free(temporary);
+	free(strings.pool);
+	free(entries);
+	free(buckets);
+}
+
+/*
+ * Checks every index and offset of a mapped index is in bounds, and its chains only go forward,
+ * so a corrupt index never makes lookups read outside the mapping or loop forever.
+ */
+static bool
+manifest_index_valid(const struct manifest_index_header *header) {
+	const uint32_t * const buckets = (const uint32_t *)(header + 1);
+	const struct manifest_index_entry * const entries = (const struct manifest_index_entry *)(buckets + header->buckets_count);
+
+	for (unsigned int type = 0; type < MANIFEST_TYPES_COUNT; type++) {
+		if (header->latest[type] != MANIFEST_INDEX_NONE && header->latest[type] >= header->strings_size) {
+			return false;
 		}
+	}
 
-		const char * const version_object_id = json_object_get_string(object);
-		if (version_object_id == NULL) {
-			errx(EXIT_FAILURE, "'versions[%lu].id' is null in manifest!", idx);
+	for (uint32_t i = 0; i < header->buckets_count; i++) {
+		if (buckets[i] != MANIFEST_INDEX_NONE && buckets[i] >= header->entries_count) {
+			return false;
 		}
+	}
 
-		if (strcmp(id, version_object_id) != 0) {
-			continue;
+	for (uint32_t i = 0; i < header->entries_count; i++) {
+		const struct manifest_index_entry * const entry = &entries[i];
+
+		if ((entry->next != MANIFEST_INDEX_NONE && (entry->next <= i || entry->next >= header->entries_count))
+			|| entry->type >= header->strings_size || entry->id >= header->strings_size
+			|| entry->url >= header->strings_size || entry->sha1 >= header->strings_size) {
+			return false;
 		}
+	}
+
+	return true;
+}
+
+/*
+ * Maps the index at index_path, if it was built from the version manifest described by st.
+ * The mapping is kept for the whole process lifetime, resolved strings point into it.
+ */
+static bool
+manifest_index_load(const char *index_path, const struct stat *st) {
+	const int fd = open(index_path, O_RDONLY);
+	struct stat index_st;
 
-		/* We found it, now get url */
-		if (!json_object_object_get_ex(version_object, "url", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'versions[%lu].id' in manifest!", idx);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			warn("open '%s'", index_path);
 		}
+		return false;
+	}
+
+	if (fstat(fd, &index_st) != 0 || (size_t)index_st.st_size < sizeof (*manifest.header)) {
+		close(fd);
+		return false;
+	}
+
+	const size_t size = index_st.st_size;
+	void * const mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (mapping == MAP_FAILED) {
+		warn("mmap '%s'", index_path);
+		return false;
+	}
+
+	const struct manifest_index_header * const header = mapping;
+	const struct timespec mtime = storage_mtime(st);
+	const size_t expected_size = sizeof (*header)
+		+ (size_t)header->buckets_count * sizeof (*manifest.buckets)
+		+ (size_t)header->entries_count * sizeof (*manifest.entries)
+		+ header->strings_size;
+
+	/* Strings are nul-terminated within the mapping once its last byte is. */
+	if (memcmp(header->magic, MANIFEST_INDEX_MAGIC, sizeof (header->magic)) != 0
+		|| header->manifest_dev != (uint64_t)st->st_dev
+		|| header->manifest_ino != (uint64_t)st->st_ino
+		|| header->manifest_size != (uint64_t)st->st_size
+		|| header->manifest_mtime_sec != (int64_t)mtime.tv_sec
+		|| header->manifest_mtime_nsec != (int64_t)mtime.tv_nsec
+		|| header->buckets_count == 0 || (header->buckets_count & (header->buckets_count - 1)) != 0
+		|| header->strings_size == 0 || expected_size != size
+		|| ((const char *)mapping)[size - 1] != '\0'
+		|| !manifest_index_valid(header)) {
+		munmap(mapping, size);
+		return false;
+	}
+
+	manifest.header = header;
+	manifest.size = size;
+	manifest.buckets = (const uint32_t *)(header + 1);
+	manifest.entries = (const struct manifest_index_entry *)(manifest.buckets + header->buckets_count);
+	manifest.strings = (const char *)(manifest.entries + header->entries_count);
 
-		const char * const version_object_url = json_object_get_string(object);
-		if (version_object_url == NULL) {
-			errx(EXIT_FAILURE, "'versions[%lu].url' is null in manifest!", idx);
+	return true;
+}
+
+/* Maps the version manifest index, (re)building it if it is not the manifest's one. */
+static void
+manifest_index_map(const char *path, const struct stat *st) {
+	char * const index_path = storage_version_manifest_index_path();
+	uint64_t start = trace_now();
+
+	if (!manifest_index_load(index_path, st)) {
+		manifest_index_build(path, st, index_path);
+		trace_phase("manifest.parse", path, start, st->st_size);
+
+		start = trace_now();
+		if (!manifest_index_load(index_path, st)) {
+			errx(EXIT_FAILURE, "Unable to load version manifest index '%s'", index_path);
 		}
+	}
+
+	trace_phase("manifest.index", index_path, start, -1);
+
+	free(index_path);
+}
 
-		return version_object_url;
+/*
+ * Refreshes the version manifest from a detached process, so the caller goes on with
+ * the stale one and the next invocation picks the fresh one up, its index already built.
+ * When the previous latest release is installed, the new one is prefetched so nodes
+ * following it restart on it at once.
+ */
+static void
+manifest_revalidate(const char *path, const char *url) {
+	const int lock = storage_lock(path, false);
+
+	/* Another process is already fetching it. */
+	if (lock < 0) {
+		return;
+	}
+	storage_unlock(lock);
+
+	if (!storage_detach()) {
+		return;
+	}
+
+	const uint32_t latest = manifest.header->latest[0];
+	bool following = false;
+
+	if (latest != MANIFEST_INDEX_NONE) {
+		char * const previous = storage_archive_path(manifest.strings + latest);
+
+		following = access(previous, R_OK) == 0;
+		free(previous);
+	}
+
+	struct stat st;
+
+	if (!storage_fetch(path, url)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (stat(path, &st) != 0) {
+		err(EXIT_FAILURE, "stat '%s'", path);
 	}
 
-	errx(EXIT_FAILURE, "Version %s/%s not found in manifest!", type, id);
+	/* NB: The stale index stays mapped, this process is short-lived. */
+	manifest_index_map(path, &st);
+
+	if (following && !manifest_install_versions((const char * const []) { "release/latest" }, 1, 1, 1)) {
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
 }
 
 void
-manifest_setup(const char *url, time_t max_age) {
+manifest_setup(const char *url, time_t max_age, bool offline, bool stale) {
 	char * const path = storage_version_manifest_path();
-	bool update = false;
+	bool update = false, revalidate = false;
+	const uint64_t start = trace_now();
 	struct stat st;
 
-	if (stat(path, &st) != 0) {
+	manifest.url = url;
+	manifest.max_age = max_age;
+	manifest.offline = offline;
+
+	const int stat_result = stat(path, &st);
+	trace_phase("manifest.stat", path, start, -1);
+
+	if (stat_result != 0) {
 		/* Either there is no manifest or an error occured. */
 		if (errno != ENOENT) {
 			err(EXIT_FAILURE, "stat '%s'", path);
 		}
+
+		if (offline) {
+			errx(EXIT_FAILURE, "No version manifest in store, unable to work offline");
+		}
 		update = true;
-	} else if (time(NULL) - st.st_mtime >= max_age) {
-		/* Max age expired, download new version. */
-		update = true;
+	} else if (!offline && time(NULL) - st.st_mtime >= max_age) {
+		/* Max age expired, download new version, now or in the background if a stale one is good enough. */
+		update = !stale;
+		revalidate = stale;
 	}
 
 	/* Download version manifest if required. */
 	if (update) {
-		storage_fetch(path, url);
+		if (!storage_fetch(path, url)) {
+			exit(EXIT_FAILURE);
+		}
+
+		if (stat(path, &st) != 0) {
+			err(EXIT_FAILURE, "stat '%s'", path);
+		}
 	}
 
-	/* Read version manifest from storage. */
-	struct json_tokener * const tokener = json_tokener_new();
-	const int fd = open(path, O_RDONLY);
-	char buffer[getpagesize()];
-	ssize_t copied;
+	manifest_index_map(path, &st);
 
-	if (fd < 0) {
-		err(EXIT_FAILURE, "open '%s'", path);
+	if (revalidate) {
+		manifest_revalidate(path, url);
 	}
 
-	while (copied = read(fd, buffer, sizeof (buffer)), manifest.object == NULL && copied > 0) {
-		manifest.object = json_tokener_parse_ex(tokener, buffer, copied);
+	free(path);
+}
 
-		const enum json_tokener_error jerr = json_tokener_get_error(tokener);
-		if (jerr != json_tokener_continue && jerr != json_tokener_success) {
-			errx(EXIT_FAILURE, "Unable to parse version manifest file '%s': %s", path, json_tokener_error_desc(jerr));
-		}
-	}
+static atomic_bool manifest_refreshing;
 
-	close(fd);
-	json_tokener_free(tokener);
+/* Fetches the version manifest and builds its index, for manifest_refresh to map once done. */
+static void *
+manifest_refresh_worker(void *data) {
+	char * const path = data;
+	struct stat st;
+
+	if (storage_fetch(path, manifest.url) && stat(path, &st) == 0) {
+		char * const index_path = storage_version_manifest_index_path();
+
+		manifest_index_build(path, &st, index_path);
+		free(index_path);
+	}
 
 	free(path);
+	atomic_store(&manifest_refreshing, false);
 
-	/* NB: manifest.object will leak, missing a json_object_put. */
+	return NULL;
 }
 
+/*
+ * Keeps the version manifest of a long-running process fresh: maps its index again once the manifest
+ * was replaced, and refreshes it from a worker thread once expired, going on with the stale one meanwhile.
+ * NB: Transfers share unlocked libcurl state, the caller must not transfer while the worker runs.
+ */
 void
-manifest_install_version(const char *version, char **pathp) {
+manifest_refresh(void) {
+	char * const path = storage_version_manifest_path();
+	struct stat st;
+
+	/* The manifest is only mapped again once the worker built its index. */
+	if (atomic_load(&manifest_refreshing) || stat(path, &st) != 0) {
+		free(path);
+		return;
+	}
+
+	const struct manifest_index_header * const header = manifest.header;
+	const size_t size = manifest.size;
+	const struct timespec mtime = storage_mtime(&st);
+
+	if (header->manifest_dev != (uint64_t)st.st_dev || header->manifest_ino != (uint64_t)st.st_ino
+		|| header->manifest_size != (uint64_t)st.st_size
+		|| header->manifest_mtime_sec != (int64_t)mtime.tv_sec || header->manifest_mtime_nsec != (int64_t)mtime.tv_nsec) {
+		manifest_index_map(path, &st);
+		munmap((void *)header, size);
+	}
+
+	if (!manifest.offline && time(NULL) - st.st_mtime >= manifest.max_age) {
+		pthread_t worker;
+
+		atomic_store(&manifest_refreshing, true);
+
+		if (pthread_create(&worker, NULL, manifest_refresh_worker, path) != 0) {
+			warnx("Unable to refresh the version manifest");
+			atomic_store(&manifest_refreshing, false);
+		} else {
+			pthread_detach(worker);
+			return;
+		}
+	}
+
+	free(path);
+}
+
+struct manifest_install {
+	const char *type, *id;
+	char *path;
+
+	enum {
+		MANIFEST_INSTALL_PACKAGE,
+		MANIFEST_INSTALL_ARCHIVE,
+		MANIFEST_INSTALL_DONE,
+	} step;
+
+	struct fetch_and_decode_json package;
+	char *package_path;
+	const char *package_sha1;
+
+	struct storage_download *download;
+
+	/* Held from start to done, so concurrent processes install an archive once. */
+	int lock;
+};
+
+static bool
+manifest_package_server(struct json_object *package_object,
+	const char **urlp, const char **sha1p, size_t *sizep) {
+	struct json_object *server_object, *object;
+
+	if (!json_object_object_get_ex(package_object, "downloads", &object)) {
+		warnx("Unable to get 'downloads' in package!");
+		return false;
+	}
+
+	if (!json_object_object_get_ex(object, "server", &server_object)) {
+		warnx("Unable to get 'downloads.server' in package!");
+		return false;
+	}
+
+	/* Get server archive's url. */
+	if (!json_object_object_get_ex(server_object, "url", &object)
+		|| (*urlp = json_object_get_string(object)) == NULL) {
+		warnx("Unable to get 'downloads.server.url' in package!");
+		return false;
+	}
+
+	/* Get server archive's sha1. */
+	if (!json_object_object_get_ex(server_object, "sha1", &object)
+		|| (*sha1p = json_object_get_string(object)) == NULL) {
+		warnx("Unable to get 'downloads.server.sha1' in package!");
+		return false;
+	}
+
+	/* Get server archive's size. */
+	if (!json_object_object_get_ex(server_object, "size", &object)) {
+		warnx("Unable to get 'downloads.server.size' in package!");
+		return false;
+	}
+
+	errno = 0;
+	*sizep = json_object_get_uint64(object);
+	if (*sizep == 0 && errno != 0) {
+		warn("'downloads.server.size' is invalid in package!");
+		return false;
+	}
+
+	return true;
+}
+
+/* Package of an entry from the store, without any transfer, NULL if it was never cached. */
+static struct json_object *
+manifest_package_cached(const struct manifest_index_entry *entry) {
+
+	if (entry->sha1 == 0) {
+		return NULL;
+	}
+
+	char * const package_path = storage_package_path(manifest.strings + entry->sha1);
+	struct json_object * const package_object = json_object_from_file(package_path);
+
+	free(package_path);
+
+	return package_object;
+}
+
+/*
+ * Gets the package of a version, from the store if it was cached, else fetching it.
+ * Returns NULL on failure, which was already reported.
+ */
+static struct json_object *
+manifest_package(const struct manifest_index_entry *entry) {
+	struct json_object * const cached_object = manifest_package_cached(entry);
+
+	if (cached_object != NULL) {
+		return cached_object;
+	}
+
+	char * const package_path = entry->sha1 != 0 ? storage_package_path(manifest.strings + entry->sha1) : NULL;
+
+	if (manifest.offline) {
+		warnx("Package of %s/%s is not in store, unable to fetch it offline",
+			manifest.strings + entry->type, manifest.strings + entry->id);
+		free(package_path);
+		return NULL;
+	}
+
+	struct fetch_and_decode_json context;
+	struct json_object *package_object;
+	bool failover;
+
+	do {
+		CURL * const easy = fetch_and_decode_json_open(manifest.strings + entry->url, &context);
+		const CURLcode res = curl_easy_perform(easy);
+
+		/* Retry on the next mirror if one failed. */
+		failover = res != CURLE_OK && storage_mirror_failover(easy);
+		package_object = fetch_and_decode_json_close(easy, &context, res);
+		if (failover) {
+			free(context.data);
+		}
+	} while (failover);
+
+	if (package_object != NULL && package_path != NULL
+		&& !storage_store_verified(package_path, context.data, context.size, manifest.strings + entry->sha1)) {
+		json_object_put(package_object);
+		package_object = NULL;
+	}
+
+	free(context.data);
+	free(package_path);
+
+	return package_object;
+}
+
+/*
+ * Gets the Java runtime component a version runs on, versions predating them run on the legacy one.
+ * Returns NULL if its package is unavailable, which was already reported.
+ */
+char *
+manifest_version_java_component(const char *version) {
 	const char *type, *id;
 
 	manifest_resolve_version(version, &type, &id);
 
-	char * const path = storage_archive_path(id);
-	if (access(path, R_OK) != 0) {
-		const char * const package_url = manifest_version_package_url(type, id);
-		struct json_object * const package_object = fetch_and_decode_json(package_url),
-			*server_object, *object;
+	const struct manifest_index_entry * const entry = manifest_index_find(type, id);
+	if (entry == NULL) {
+		errx(EXIT_FAILURE, "Version %s/%s not found in manifest!", type, id);
+	}
+
+	struct json_object * const package_object = manifest_package(entry);
+	struct json_object *object;
+	char *component;
+
+	if (package_object == NULL) {
+		return NULL;
+	}
+
+	if (json_object_object_get_ex(package_object, "javaVersion", &object)
+		&& json_object_object_get_ex(object, "component", &object)) {
+		component = strdup(json_object_get_string(object));
+	} else {
+		component = strdup("jre-legacy");
+	}
+
+	json_object_put(package_object);
+
+	return component;
+}
+
+/*
+ * Starts the server archive download described by the package.
+ * Returns true if the install has a transfer running.
+ */
+static bool
+manifest_install_package(struct manifest_install *install, struct json_object *package_object,
+	CURLM *multi, unsigned int segments, bool interactive, bool *failedp) {
+	const char *url, *sha1;
+	size_t size;
+
+	if (package_object == NULL
+		|| !manifest_package_server(package_object, &url, &sha1, &size)) {
+		warnx("Unable to install %s/%s", install->type, install->id);
+		json_object_put(package_object);
+		install->step = MANIFEST_INSTALL_DONE;
+		*failedp = true;
+		return false;
+	}
+
+	install->download = storage_download_open(install->path, url, sha1, size, segments, interactive);
+	install->step = MANIFEST_INSTALL_ARCHIVE;
+
+	/* Release package object, the download keeps its own copies. */
+	json_object_put(package_object);
+
+	storage_download_start(install->download, multi, install);
+
+	return true;
+}
+
+/*
+ * Starts an install, from its package in store if it was cached.
+ * Returns true if the install has a transfer running.
+ */
+static bool
+manifest_install_start(struct manifest_install *install, CURLM *multi,
+	unsigned int segments, bool interactive, bool *failedp) {
+	const struct manifest_index_entry * const entry = manifest_index_find(install->type, install->id);
+
+	if (entry == NULL) {
+		errx(EXIT_FAILURE, "Version %s/%s not found in manifest!", install->type, install->id);
+	}
+
+	if (manifest.offline) {
+		warnx("Unable to install %s/%s offline, its archive is not in store", install->type, install->id);
+		install->step = MANIFEST_INSTALL_DONE;
+		*failedp = true;
+		return false;
+	}
+
+	install->step = MANIFEST_INSTALL_PACKAGE;
+	install->package_path = NULL;
+
+	if (entry->sha1 != 0) {
+		install->package_path = storage_package_path(manifest.strings + entry->sha1);
+		install->package_sha1 = manifest.strings + entry->sha1;
+
+		struct json_object * const package_object = json_object_from_file(install->package_path);
+		if (package_object != NULL) {
+			return manifest_install_package(install, package_object, multi, segments, interactive, failedp);
+		}
+	}
+
+	CURL * const easy = fetch_and_decode_json_open(manifest.strings + entry->url, &install->package);
+
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, install);
+	curl_multi_add_handle(multi, easy);
+
+	return true;
+}
+
+/*
+ * Advances an install once one of its transfers is done.
+ * Returns true if the install still has transfers running.
+ */
+static bool
+manifest_install_continue(struct manifest_install *install, CURLM *multi, CURL *easy,
+	CURLcode res, unsigned int segments, bool interactive, bool *failedp) {
+
+	switch (install->step) {
+	case MANIFEST_INSTALL_PACKAGE: {
+		const bool failover = res != CURLE_OK && storage_mirror_failover(easy);
+		struct json_object *package_object = fetch_and_decode_json_close(easy, &install->package, res);
+
+		/* Fetch the package again from the next mirror if one failed. */
+		if (failover) {
+			const struct manifest_index_entry * const entry = manifest_index_find(install->type, install->id);
+
+			free(install->package.data);
+
+			CURL * const retry = fetch_and_decode_json_open(manifest.strings + entry->url, &install->package);
+			curl_easy_setopt(retry, CURLOPT_PRIVATE, install);
+			curl_multi_add_handle(multi, retry);
+
+			return true;
+		}
+
+		/* Only cache packages whose digest is known, and never use one which does not match it. */
+		if (package_object != NULL && install->package_path != NULL
+			&& !storage_store_verified(install->package_path,
+				install->package.data, install->package.size, install->package_sha1)) {
+			json_object_put(package_object);
+			package_object = NULL;
+		}
 
-		if (!json_object_object_get_ex(package_object, "downloads", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'downloads' in package!");
+		free(install->package.data);
+
+		return manifest_install_package(install, package_object, multi, segments, interactive, failedp);
+	}
+	case MANIFEST_INSTALL_ARCHIVE:
+		if (!storage_download_finished(install->download, multi, easy, res)) {
+			return true;
 		}
 
-		if (!json_object_object_get_ex(object, "server", &server_object)) {
-			errx(EXIT_FAILURE, "Unable to get 'downloads.server' in package!");
+		if (!storage_download_close(install->download)) {
+			warnx("Unable to install %s/%s", install->type, install->id);
+			*failedp = true;
+		} else {
+			/* Servers can still start from the archive if unpacking fails. */
+			bundler_unpack(install->path);
 		}
+		install->step = MANIFEST_INSTALL_DONE;
+		return false;
+	case MANIFEST_INSTALL_DONE:
+		break;
+	}
+
+	abort();
+}
+
+/*
+ * Runs at most parallel installs at once, each install being
+ * a package JSON fetch followed by its server archive download,
+ * the latter possibly split in segments transferred concurrently.
+ * Returns the number of failed installs.
+ */
+static size_t
+manifest_install_run(struct manifest_install *installs, size_t count,
+	unsigned int parallel, unsigned int segments) {
+	const bool interactive = count == 1;
+	CURLM * const multi = curl_multi_init();
+	size_t next = 0, running = 0, failures = 0;
+
+	while (next < count || running != 0) {
+
+		while (running < parallel && next < count) {
+			struct manifest_install * const install = &installs[next];
+			bool failed = false;
+
+			/* Another process installs this archive, only wait for it once we have nothing else to do. */
+			install->lock = storage_lock(install->path, running == 0);
+			if (install->lock < 0) {
+				break;
+			}
+			next++;
+
+			if (access(install->path, R_OK) == 0) {
+				/* Installed while we waited. */
+				install->step = MANIFEST_INSTALL_DONE;
+				storage_unlock(install->lock);
+				continue;
+			}
+
+			if (manifest_install_start(install, multi, segments, interactive, &failed)) {
+				running++;
+			} else {
+				storage_unlock(install->lock);
+			}
 
-		/* Get server archive's url. */
-		if (!json_object_object_get_ex(server_object, "url", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'downloads.server.url' in package!");
+			if (failed) {
+				failures++;
+			}
 		}
 
-		const char * const server_object_url = json_object_get_string(object);
-		if (server_object_url == NULL) {
-			errx(EXIT_FAILURE, "'downloads.server.url' is null in package!");
+		/* Restart failed transfers whose backoff expired, and wake up for the next one. */
+		long timeout = -1;
+		for (size_t i = 0; i < next; i++) {
+			if (installs[i].step == MANIFEST_INSTALL_ARCHIVE) {
+				const long retry = storage_download_retry(installs[i].download, multi);
+
+				if (retry >= 0 && (timeout < 0 || retry < timeout)) {
+					timeout = retry;
+				}
+			}
 		}
 
-		/* Get server archive's sha1. */
-		if (!json_object_object_get_ex(server_object, "sha1", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'downloads.server.sha1' in package!");
+		int still_running;
+		CURLMcode mres = curl_multi_perform(multi, &still_running);
+
+		if (mres == CURLM_OK && (still_running != 0 || timeout >= 0)) {
+			mres = curl_multi_poll(multi, NULL, 0,
+				timeout >= 0 && timeout < 1000 ? timeout : 1000, NULL);
 		}
 
-		const char * const server_object_sha1 = json_object_get_string(object);
-		if (server_object_sha1 == NULL) {
-			errx(EXIT_FAILURE, "'downloads.server.sha1' is null in package!");
+		if (mres != CURLM_OK) {
+			errx(EXIT_FAILURE, "curl_multi: %s", curl_multi_strerror(mres));
 		}
 
-		/* Get server archive's size. */
-		if (!json_object_object_get_ex(server_object, "size", &object)) {
-			errx(EXIT_FAILURE, "Unable to get 'downloads.server.size' in package!");
+		const CURLMsg *message;
+		int queued;
+
+		while ((message = curl_multi_info_read(multi, &queued)) != NULL) {
+			if (message->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			/* Message is invalidated by curl_multi_remove_handle. */
+			CURL * const easy = message->easy_handle;
+			const CURLcode res = message->data.result;
+			struct manifest_install *install;
+			bool failed = false;
+
+			curl_easy_getinfo(easy, CURLINFO_PRIVATE, &install);
+			curl_multi_remove_handle(multi, easy);
+
+			if (!manifest_install_continue(install, multi, easy, res, segments, interactive, &failed)) {
+				storage_unlock(install->lock);
+				running--;
+			}
+
+			if (failed) {
+				failures++;
+			}
 		}
+	}
 
-		errno = 0;
-		const size_t server_object_size = json_object_get_uint64(object);
-		if (server_object_size == 0 && errno != 0) {
-			err(EXIT_FAILURE, "'downloads.server.size' is invalid in package!");
+	curl_multi_cleanup(multi);
+
+	/* Make room for what was just installed, never at its expense. */
+	if (count != 0) {
+		const char ** const kept = malloc(count * sizeof (*kept));
+
+		for (size_t i = 0; i < count; i++) {
+			kept[i] = installs[i].id;
 		}
 
-		storage_fetch_and_verify(path, server_object_url,
-			server_object_sha1, server_object_size);
+		storage_archives_evict(kept, count);
+		free(kept);
+	}
 
-		/* Release package object. */
-		json_object_put(package_object);
+	return failures;
+}
+
+void
+manifest_install_version(const char *version, unsigned int segments, char **pathp) {
+	struct manifest_install install = { };
+
+	manifest_resolve_version(version, &install.type, &install.id);
+
+	install.path = storage_archive_path(install.id);
+	if (access(install.path, R_OK) != 0
+		&& manifest_install_run(&install, 1, 1, segments) != 0) {
+		exit(EXIT_FAILURE);
 	}
 
+	free(install.package_path);
+
 	if (pathp != NULL) {
-		*pathp = path;
+		*pathp = install.path;
 	} else {
+		free(install.path);
+	}
+}
+
+static void
+manifest_install_push(struct manifest_install **installsp, size_t *countp, const char *type, const char *id) {
+	struct manifest_install *installs = *installsp;
+	size_t count = *countp;
+
+	/* Skip duplicates, an id is unique across all types. */
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(installs[i].id, id) == 0) {
+			return;
+		}
+	}
+
+	char * const path = storage_archive_path(id);
+	if (access(path, R_OK) == 0) {
 		free(path);
+		return;
+	}
+
+	installs = realloc(installs, (count + 1) * sizeof (*installs));
+	if (installs == NULL) {
+		err(EXIT_FAILURE, "realloc");
 	}
+
+	installs[count] = (struct manifest_install) {
+		.type = type,
+		.id = id,
+		.path = path,
+	};
+
+	*installsp = installs;
+	*countp = count + 1;
+}
+
+bool
+manifest_install_versions(const char * const *versions, size_t versions_count,
+	unsigned int parallel, unsigned int segments) {
+	struct manifest_install *installs = NULL;
+	size_t count = 0;
+
+	for (size_t i = 0; i < versions_count; i++) {
+		const char * const version = versions[i];
+		const char * const separator = strchr(version, '/');
+
+		if (separator != NULL && strcmp(separator + 1, "*") == 0) {
+			/* Wildcard, expand to every version of the type, in manifest order. */
+			const char *type, *id;
+			size_t matches = 0;
+
+			manifest_resolve_version(version, &type, &id);
+
+			for (uint32_t i = 0; i < manifest.header->entries_count; i++) {
+				const struct manifest_index_entry * const entry = &manifest.entries[i];
+
+				if (strcmp(type, manifest.strings + entry->type) == 0) {
+					manifest_install_push(&installs, &count, type, manifest.strings + entry->id);
+					matches++;
+				}
+			}
+
+			if (matches == 0) {
+				errx(EXIT_FAILURE, "No version matching %s in manifest!", version);
+			}
+		} else {
+			const char *type, *id;
+
+			manifest_resolve_version(version, &type, &id);
+
+			/* Fail early on unknown versions, before any transfer starts. */
+			manifest_version_package_url(type, id);
+
+			manifest_install_push(&installs, &count, type, id);
+		}
+	}
+
+	const size_t failures = manifest_install_run(installs, count, parallel, segments);
+
+	for (size_t i = 0; i < count; i++) {
+		free(installs[i].package_path);
+		free(installs[i].path);
+	}
+	free(installs);
+
+	return failures == 0;
+}
+
+bool
+manifest_verify_archives(unsigned int parallel) {
+	char **ids;
+	const size_t count = storage_archives_list(&ids);
+	struct storage_verify * const archives = calloc(count, sizeof (*archives));
+	struct json_object ** const packages = calloc(count, sizeof (*packages));
+	size_t failures = 0;
+
+	/* Resolve expected digests, ids are unique across all types. */
+	for (size_t i = 0; i < count; i++) {
+		struct storage_verify * const archive = &archives[i];
+		const struct manifest_index_entry *entry = NULL;
+
+		archive->id = ids[i];
+		archive->status = STORAGE_VERIFY_UNKNOWN;
+
+		for (unsigned int type = 0; entry == NULL && type < MANIFEST_TYPES_COUNT; type++) {
+			entry = manifest_index_find(manifest_types[type], archive->id);
+		}
+
+		if (entry == NULL) {
+			warnx("%s: Not found in manifest", archive->id);
+			continue;
+		}
+
+		const char *url;
+
+		packages[i] = manifest_package(entry);
+		if (packages[i] != NULL
+			&& manifest_package_server(packages[i], &url, &archive->sha1, &archive->size)) {
+			archive->status = STORAGE_VERIFY_PENDING;
+		}
+	}
+
+	storage_verify_archives(archives, count, parallel);
+
+	for (size_t i = 0; i < count; i++) {
+		const struct storage_verify * const archive = &archives[i];
+
+		switch (archive->status) {
+		case STORAGE_VERIFY_RECORDED:
+			printf("%s: OK (unchanged)\n", archive->id);
+			break;
+		case STORAGE_VERIFY_VALID:
+			printf("%s: OK\n", archive->id);
+			break;
+		case STORAGE_VERIFY_INVALID:
+			printf("%s: FAILED\n", archive->id);
+			failures++;
+			break;
+		default:
+			printf("%s: UNKNOWN\n", archive->id);
+			failures++;
+			break;
+		}
+
+		json_object_put(packages[i]);
+		free(ids[i]);
+	}
+
+	free(packages);
+	free(archives);
+	free(ids);
+
+	return failures == 0;
+}
+
+/*
+ * Lists archives in store along the digest their package gives them.
+ * Only cached packages are read, never blocking on a transfer. Archives
+ * whose package is not in store are left out, their digest being unknown.
+ */
+size_t
+manifest_archives_digests(char ***pathsp, char ***sha1sp) {
+	char **ids;
+	const size_t count = storage_archives_list(&ids);
+	char ** const paths = calloc(count, sizeof (*paths));
+	char ** const sha1s = calloc(count, sizeof (*sha1s));
+	size_t found = 0;
+
+	if ((paths == NULL || sha1s == NULL) && count != 0) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const struct manifest_index_entry *entry = NULL;
+
+		for (unsigned int type = 0; entry == NULL && type < MANIFEST_TYPES_COUNT; type++) {
+			entry = manifest_index_find(manifest_types[type], ids[i]);
+		}
+
+		struct json_object * const package_object = entry != NULL ? manifest_package_cached(entry) : NULL;
+		const char *url, *sha1;
+		size_t size;
+
+		if (package_object != NULL && manifest_package_server(package_object, &url, &sha1, &size)) {
+			paths[found] = storage_archive_path(ids[i]);
+			sha1s[found] = strdup(sha1);
+			found++;
+		}
+
+		json_object_put(package_object);
+		free(ids[i]);
+	}
+
+	free(ids);
+
+	*pathsp = paths;
+	*sha1sp = sha1s;
+
+	return found;
 }
@@ -2,11 +2,24 @@
 #ifndef MANIFEST_H
 #define MANIFEST_H
 
+#include <stddef.h>
+#include <stdbool.h>
 #include <time.h>
 
-void manifest_setup(const char *url, time_t max_age);
+void manifest_setup(const char *url, time_t max_age, bool offline, bool stale);
 
-void manifest_install_version(const char *version, char **pathp);
+void manifest_refresh(void);
+
+void manifest_install_version(const char *version, unsigned int segments, char **pathp);
+
+bool manifest_install_versions(const char * const *versions, size_t count,
+	unsigned int parallel, unsigned int segments);
+
+char *manifest_version_java_component(const char *version);
+
+bool manifest_verify_archives(unsigned int parallel);
+
+size_t manifest_archives_digests(char ***pathsp, char ***sha1sp);
 
 /* MANIFEST_H */
 #endif
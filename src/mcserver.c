@@ -11,29 +11,61 @@
 #include <stdnoreturn.h>
 
 #include "config.h"
+#include "bundler.h"
+#include "jvm.h"
 #include "manifest.h"
+#include "runtime.h"
+#include "serve.h"
 #include "storage.h"
+#include "supervise.h"
+#include "trace.h"
+#include "warm.h"
 
 enum mcserver_option {
 	MCSERVER_OPTION_VERSION,
 	MCSERVER_OPTION_WORLD,
 	MCSERVER_OPTION_JVM,
+	MCSERVER_OPTION_PROFILE,
+	MCSERVER_OPTION_HEAP,
+	MCSERVER_OPTION_PARALLEL,
+	MCSERVER_OPTION_SEGMENTS,
+	MCSERVER_OPTION_BUDGET,
+	MCSERVER_OPTION_WARM,
 	MCSERVER_OPTION_NOUPDATE,
 	MCSERVER_OPTION_NOCACHE,
+	MCSERVER_OPTION_OFFLINE,
+	MCSERVER_OPTION_STALE,
+	MCSERVER_OPTION_TRACE,
+	MCSERVER_OPTION_PROGRESS,
 	MCSERVER_OPTION_HELP,
 };
 
 enum mcserver_synopsis {
 	MCSERVER_SYNOPSIS_LAUNCH,
 	MCSERVER_SYNOPSIS_INSTALL,
+	MCSERVER_SYNOPSIS_VERIFY,
+	MCSERVER_SYNOPSIS_SUPERVISE,
+	MCSERVER_SYNOPSIS_CDS,
+	MCSERVER_SYNOPSIS_SERVE,
+	MCSERVER_SYNOPSIS_BENCH,
 };
 
 struct mcserver_args {
 	char *version;
 	char *world;
 	char *jvm;
+	char *profile;
+	char *trace;
+	char *progress;
 
 	time_t max_age;
+	bool offline;
+	bool stale;
+	unsigned int parallel;
+	unsigned int segments;
+	unsigned int budget;
+	unsigned int warm;
+	unsigned int heap;
 
 	enum mcserver_synopsis synopsis;
 };
@@ -42,8 +74,18 @@ static const struct option longopts[] = {
 	[MCSERVER_OPTION_VERSION]  = { "version", required_argument },
 	[MCSERVER_OPTION_WORLD]    = { "world", required_argument },
 	[MCSERVER_OPTION_JVM]      = { "jvm", required_argument },
+	[MCSERVER_OPTION_PROFILE]  = { "profile", required_argument },
+	[MCSERVER_OPTION_HEAP]     = { "heap", required_argument },
+	[MCSERVER_OPTION_PARALLEL] = { "parallel", required_argument },
+	[MCSERVER_OPTION_SEGMENTS] = { "segments", required_argument },
+	[MCSERVER_OPTION_BUDGET]   = { "budget", required_argument },
+	[MCSERVER_OPTION_WARM]     = { "warm", required_argument },
 	[MCSERVER_OPTION_NOUPDATE] = { "noupdate", no_argument },
 	[MCSERVER_OPTION_NOCACHE]  = { "nocache", no_argument },
+	[MCSERVER_OPTION_OFFLINE]  = { "offline", no_argument },
+	[MCSERVER_OPTION_STALE]    = { "stale", no_argument },
+	[MCSERVER_OPTION_TRACE]    = { "trace", required_argument },
+	[MCSERVER_OPTION_PROGRESS] = { "progress", required_argument },
 	[MCSERVER_OPTION_HELP]     = { "help", no_argument },
 	{ },
 };
@@ -51,61 +93,326 @@ static const struct option longopts[] = {
 static const char * const synopses_names[] = {
 	[MCSERVER_SYNOPSIS_LAUNCH]  = "launch",
 	[MCSERVER_SYNOPSIS_INSTALL] = "install",
+	[MCSERVER_SYNOPSIS_VERIFY]  = "verify",
+	[MCSERVER_SYNOPSIS_SUPERVISE] = "supervise",
+	[MCSERVER_SYNOPSIS_CDS]       = "cds",
+	[MCSERVER_SYNOPSIS_SERVE]     = "serve",
+	[MCSERVER_SYNOPSIS_BENCH]     = "bench",
 };
 
+/* A profile given on the command line is stored for the world, else the stored one is used. */
+static char *
+mcserver_world_profile(const struct mcserver_args *args, const char *world) {
+
+	if (args->profile != NULL) {
+		storage_world_profile_save(world, args->profile);
+		return args->profile;
+	}
+
+	char * const profile = storage_world_profile_load(world);
+	if (profile == NULL) {
+		return CONFIG_JVM_PROFILE;
+	}
+
+	if (!jvm_profile_exists(profile)) {
+		errx(EXIT_FAILURE, "Unknown JVM profile '%s' stored for world '%s'", profile, world);
+	}
+
+	/* NB: Will leak, missing free. */
+	return profile;
+}
+
+/*
+ * A heap size given on the command line is stored for the world, else the stored one is used.
+ * Zero lets the JVM arguments size the heap from the memory of the host.
+ */
+static unsigned int
+mcserver_world_heap(const struct mcserver_args *args, const char *world) {
+
+	if (args->heap != 0) {
+		storage_world_heap_save(world, args->heap);
+		return args->heap;
+	}
+
+	return storage_world_heap_load(world);
+}
+
+/*
+ * A JVM given on the command line is used as is, else the runtime of the version, else java from PATH.
+ * The runtime of a version is recorded aside its archive, later launches read neither manifest
+ * and leave updates of the runtime to the background.
+ */
+static const char *
+mcserver_jvm(const struct mcserver_args *args, const char *version, const char *archive) {
+	char *component, *java;
+
+	if (args->jvm != NULL) {
+		return args->jvm;
+	}
+
+	if (storage_archive_java_load(archive, &component, &java)) {
+		if (access(java, X_OK) == 0) {
+			runtime_update(component);
+			free(component);
+			/* NB: Will leak, missing free. */
+			return java;
+		}
+
+		free(component);
+		free(java);
+	}
+
+	component = manifest_version_java_component(version);
+	java = component != NULL ? runtime_install(component) : NULL;
+
+	if (java != NULL) {
+		storage_archive_java_save(archive, component, java);
+	}
+
+	free(component);
+
+	if (java == NULL) {
+		warnx("Using java from PATH");
+		return "java";
+	}
+
+	/* NB: Will leak, missing free. */
+	return java;
+}
+
 static noreturn void
 mcserver_launch(const struct mcserver_args *args, int argc, char **argv) {
 	char *path;
 
-	manifest_install_version(args->version, &path);
+	manifest_install_version(args->version, args->segments, &path);
+
+	storage_archive_use(path, args->world);
+
+	const char * const jvm = mcserver_jvm(args, args->version, path);
+	const char * const workdir = storage_world_directory(args->world);
+	struct jvm_cds_dump *dump;
+	char ** const xargv = jvm_argv(jvm, mcserver_world_profile(args, args->world), mcserver_world_heap(args, args->world), 1,
+		jvm_cds_option(jvm, storage_archive_cds_path(path), &dump), bundler_server_target(path),
+		argv + optind, argc - optind);
+
+	if (chdir(workdir) != 0) {
+		err(EXIT_FAILURE, "chdir '%s'", workdir);
+	}
+
+	if (args->warm != 0) {
+		warm_world(workdir, (uint64_t)args->warm << 20);
+	}
+
+	/* Started with the invocation, the launch latency. */
+	trace_phase("exec", jvm, 0, -1);
+
+	/* The server's class data sharing archive is only put in place once it exited. */
+	if (dump != NULL) {
+		exit(jvm_cds_dump_run(xargv, dump));
+	}
+
+	execvp(jvm, xargv);
 
-	char ** const xargv = malloc((6 + argc - optind) * sizeof (*xargv));
-	unsigned int i = 0;
+	err(EXIT_FAILURE, "execvp %s (-jar %s)", jvm, path);
+}
+
+static noreturn void
+mcserver_install(const struct mcserver_args *args, int argc, char **argv) {
+	const char ** const versions = malloc((1 + argc - optind) * sizeof (*versions));
+	size_t count = 0;
 
-	xargv[i++] = args->jvm;
-	xargv[i++] = "-Xmx1024M";
-	xargv[i++] = "-Xms1024M";
+	if (args->version != NULL) {
+		versions[count++] = args->version;
+	}
 
 	while (optind < argc) {
-		xargv[i++] = argv[optind++];
+		versions[count++] = argv[optind++];
 	}
 
-	xargv[i++] = "-jar";
-	xargv[i++] = path;
-	xargv[i] = NULL;
+	const bool installed = manifest_install_versions(versions, count, args->parallel, args->segments);
 
-	const char * const workdir = storage_world_directory(args->world);
-	if (chdir(workdir) != 0) {
-		err(EXIT_FAILURE, "chdir '%s'", workdir);
+	free(versions);
+
+	exit(installed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static noreturn void
+mcserver_verify(const struct mcserver_args *args) {
+	exit(manifest_verify_archives(args->parallel) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static noreturn void
+mcserver_cds(const struct mcserver_args *args) {
+	const char * const profile = args->profile != NULL ? args->profile : CONFIG_JVM_PROFILE;
+	char *path;
+
+	manifest_install_version(args->version, args->segments, &path);
+	storage_archive_use(path, NULL);
+
+	char * const archive = storage_archive_cds_path(path);
+	const bool generated = jvm_cds_generate(mcserver_jvm(args, args->version, path), profile, bundler_server_target(path), archive);
+
+	free(archive);
+	free(path);
+
+	exit(generated ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Operands are worlds, each optionally followed by its version as in name=version. */
+static noreturn void
+mcserver_supervise(const struct mcserver_args *args, int argc, char **argv) {
+	const size_t count = argc - optind;
+	struct supervise_world * const worlds = calloc(count, sizeof (*worlds));
+
+	for (size_t i = 0; i < count; i++) {
+		struct supervise_world * const world = &worlds[i];
+		char * const name = argv[optind + i];
+		char * const separator = strchr(name, '=');
+		const char *version = args->version;
+		char *path;
+
+		if (separator != NULL) {
+			*separator = '\0';
+			version = separator + 1;
+		}
+
+		for (size_t j = 0; j < i; j++) {
+			if (strcmp(worlds[j].name, name) == 0) {
+				errx(EXIT_FAILURE, "World '%s' is supervised twice", name);
+			}
+		}
+
+		manifest_install_version(version, args->segments, &path);
+		storage_archive_use(path, name);
+
+		const char * const jvm = mcserver_jvm(args, version, path);
+
+		world->name = name;
+		world->directory = storage_world_directory(name);
+		world->argv = jvm_argv(jvm, mcserver_world_profile(args, name), mcserver_world_heap(args, name), count,
+			jvm_cds_option(jvm, storage_archive_cds_path(path), &world->dump), bundler_server_target(path), NULL, 0);
 	}
 
-	execvp(args->jvm, xargv);
+	supervise(worlds, count, storage_supervise_socket_path());
+}
+
+static noreturn void
+mcserver_serve(const struct mcserver_args *args, int argc, char **argv) {
+	const char * const address = optind != argc ? argv[optind] : CONFIG_SERVE_ADDRESS;
 
-	err(EXIT_FAILURE, "execvp %s (-jar %s)", args->jvm, path);
+	serve(address);
 }
 
+/*
+ * Operands are versions, each benchmarked with every profile, comma-separated,
+ * and again with its class data sharing archive when one was dumped for the JVM.
+ */
 static noreturn void
-mcserver_install(const struct mcserver_args *args) {
+mcserver_bench(const struct mcserver_args *args, int argc, char **argv) {
+	char *defaults[] = { args->version }, **versions = defaults;
+	char *xargs[] = { "-Djava.awt.headless=true" };
+	size_t versions_count = 1, profiles_count = 0, count = 0;
+	bool succeeded = true;
+
+	if (optind != argc) {
+		versions = argv + optind;
+		versions_count = argc - optind;
+	}
+
+	/* Profiles were validated with the arguments, the world's own is never overwritten. */
+	char * const list = strdup(args->profile != NULL ? args->profile
+		: args->world != NULL ? mcserver_world_profile(args, args->world) : CONFIG_JVM_PROFILE);
+	char **profiles = NULL;
+
+	for (char *saveptr, *token = strtok_r(list, ",", &saveptr);
+		token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+		profiles = realloc(profiles, (profiles_count + 1) * sizeof (*profiles));
+		profiles[profiles_count++] = token;
+	}
+
+	struct jvm_bench * const benches = calloc(versions_count * profiles_count * 2, sizeof (*benches));
+
+	for (size_t i = 0; i < versions_count; i++) {
+		char *path;
+
+		manifest_install_version(versions[i], args->segments, &path);
+		storage_archive_use(path, NULL);
+
+		const char * const jvm = mcserver_jvm(args, versions[i], path);
+		char * const archive = storage_archive_cds_path(path);
+		char * const share = jvm_cds_share_option(jvm, archive);
+		char ** const target = bundler_server_target(path);
+
+		/* Aliases like latest are reported under the version they resolved to. */
+		char * const id = strdup(strrchr(path, '/') + 1);
+		*strrchr(id, '.') = '\0';
+
+		for (size_t j = 0; j < profiles_count; j++) {
+			for (int cds = 0; cds <= (share != NULL); cds++) {
+				struct jvm_bench * const bench = &benches[count++];
+				char ** const xargv = jvm_argv(jvm, profiles[j], 0, 1, cds ? share : NULL, target, xargs, 1);
 
-	manifest_install_version(args->version, NULL);
+				bench->version = id;
+				bench->profile = profiles[j];
+				bench->cds = cds;
 
-	exit(EXIT_SUCCESS);
+				warnx("Benchmarking %s with profile %s%s", id, profiles[j], cds ? " and class data sharing" : "");
+				jvm_bench_run(xargv, args->world, bench);
+
+				succeeded = succeeded && bench->ready != 0;
+				/* NB: Will leak xargv, missing free. */
+			}
+		}
+
+		free(archive);
+		free(path);
+		/* NB: Will leak id, share and target, missing free. */
+	}
+
+	jvm_bench_report(benches, count);
+
+	free(benches);
+	free(profiles);
+	free(list);
+
+	exit(succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 static noreturn void
 mcserver_usage(const char *name, int status) {
-	fprintf(stderr, "usage: %1$s [-version <version>] [-world <name>] [-jvm <path>] [-noupdate] [-nocache] launch ...\n"
-	                "       %1$s [-version <version>] [-noupdate] [-nocache] install\n"
+	fprintf(stderr, "usage: %1$s [-version <version>] [-world <name>] [-jvm <path>] [-profile <name>] [-heap <MiB>] [-segments <count>] [-budget <MiB>] [-warm <MiB>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] [-progress <path>] launch ...\n"
+	                "       %1$s [-version <version>] [-parallel <count>] [-segments <count>] [-budget <MiB>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] [-progress <path>] install [<version>...]\n"
+	                "       %1$s [-parallel <count>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] verify\n"
+	                "       %1$s [-version <version>] [-jvm <path>] [-profile <name>] [-heap <MiB>] [-segments <count>] [-budget <MiB>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] [-progress <path>] supervise <world>[=<version>]...\n"
+	                "       %1$s [-version <version>] [-jvm <path>] [-profile <name>] [-segments <count>] [-budget <MiB>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] [-progress <path>] cds\n"
+	                "       %1$s [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] serve [[<host>]:<port>]\n"
+	                "       %1$s [-world <name>] [-jvm <path>] [-profile <name>[,<name>...]] [-segments <count>] [-budget <MiB>] [-noupdate] [-nocache] [-offline] [-stale] [-trace <path>] [-progress <path>] bench [<version>...]\n"
 	                "       %1$s -help\n", name);
 	exit(status);
 }
 
+static unsigned int
+mcserver_parse_count(const char *name, const char *option, const char *value) {
+	char *end;
+	const unsigned long count = strtoul(value, &end, 10);
+
+	if (*value == '\0' || *end != '\0' || count == 0 || count > UINT_MAX) {
+		fprintf(stderr, "%s: Invalid %s count '%s'\n", name, option, value);
+		mcserver_usage(name, EXIT_FAILURE);
+	}
+
+	return count;
+}
+
 static struct mcserver_args
 mcserver_parse_args(int argc, char **argv) {
 	struct mcserver_args args = {
 		.max_age = CONFIG_VERSION_MANIFEST_MAX_AGE,
+		.parallel = CONFIG_INSTALL_PARALLEL,
+		.segments = CONFIG_DOWNLOAD_SEGMENTS,
+		.budget = CONFIG_STORE_BUDGET,
 	};
-	bool noupdate = false, nocache = false, help = false;
+	bool noupdate = false, nocache = false, help = false, parallel_set = false, budget_set = false;
 	int longindex, c;
 
 	while ((c = getopt_long_only(argc, argv, ":", longopts, &longindex)) != -1) {
@@ -121,12 +428,46 @@ mcserver_parse_args(int argc, char **argv) {
 			case MCSERVER_OPTION_JVM:
 				args.jvm = optarg;
 				break;
+			case MCSERVER_OPTION_PROFILE:
+				args.profile = optarg;
+				break;
+			case MCSERVER_OPTION_HEAP:
+				args.heap = mcserver_parse_count(*argv, "heap", optarg);
+				break;
+			case MCSERVER_OPTION_PARALLEL:
+				args.parallel = mcserver_parse_count(*argv, "parallel", optarg);
+				parallel_set = true;
+				break;
+			case MCSERVER_OPTION_SEGMENTS:
+				args.segments = mcserver_parse_count(*argv, "segments", optarg);
+				break;
+			case MCSERVER_OPTION_BUDGET:
+				/* Zero is no budget, overriding the configured one. */
+				args.budget = *optarg != '\0' && optarg[strspn(optarg, "0")] == '\0'
+					? 0 : mcserver_parse_count(*argv, "budget", optarg);
+				budget_set = true;
+				break;
+			case MCSERVER_OPTION_WARM:
+				args.warm = mcserver_parse_count(*argv, "warm", optarg);
+				break;
 			case MCSERVER_OPTION_NOUPDATE:
 				noupdate = true;
 				break;
 			case MCSERVER_OPTION_NOCACHE:
 				nocache = true;
 				break;
+			case MCSERVER_OPTION_OFFLINE:
+				args.offline = true;
+				break;
+			case MCSERVER_OPTION_STALE:
+				args.stale = true;
+				break;
+			case MCSERVER_OPTION_TRACE:
+				args.trace = optarg;
+				break;
+			case MCSERVER_OPTION_PROGRESS:
+				args.progress = optarg;
+				break;
 			case MCSERVER_OPTION_HELP:
 				help = true;
 				break;
@@ -163,17 +504,120 @@ mcserver_parse_args(int argc, char **argv) {
 	}
 	optind++;
 
+	/* Only bench compares several profiles, comma-separated. */
+	if (args.profile != NULL) {
+		const char *profile = args.profile;
+		size_t length;
+
+		if (args.synopsis != MCSERVER_SYNOPSIS_BENCH && strchr(profile, ',') != NULL) {
+			fprintf(stderr, "%s: Several JVM profiles can only be compared by bench\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+
+		do {
+			length = strcspn(profile, ",");
+
+			char name[length + 1];
+			memcpy(name, profile, length);
+			name[length] = '\0';
+
+			if (!jvm_profile_exists(name)) {
+				fprintf(stderr, "%s: Unknown JVM profile '%s'\n", *argv, name);
+				mcserver_usage(*argv, EXIT_FAILURE);
+			}
+
+			profile += length;
+		} while (*profile++ != '\0');
+	}
+
 	if (noupdate && nocache) {
 		fprintf(stderr, "%s: Options noupdate and nocache together are nonsensical\n", *argv);
 		mcserver_usage(*argv, EXIT_FAILURE);
 	}
 
-	if (args.version == NULL) {
+	if (args.offline && nocache) {
+		fprintf(stderr, "%s: Options offline and nocache together are nonsensical\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.stale && (noupdate || nocache || args.offline)) {
+		fprintf(stderr, "%s: Option stale together with noupdate, nocache or offline is nonsensical\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if ((args.progress != NULL || budget_set)
+		&& (args.synopsis == MCSERVER_SYNOPSIS_VERIFY || args.synopsis == MCSERVER_SYNOPSIS_SERVE)) {
+		fprintf(stderr, "%s: Options progress and budget cannot be used for %s, it installs no archive\n", *argv, synopsis_name);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.warm != 0 && args.synopsis != MCSERVER_SYNOPSIS_LAUNCH) {
+		fprintf(stderr, "%s: Option warm can only be used for launch\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.heap != 0 && args.synopsis != MCSERVER_SYNOPSIS_LAUNCH && args.synopsis != MCSERVER_SYNOPSIS_SUPERVISE) {
+		fprintf(stderr, "%s: Option heap can only be used for launch and supervise\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.synopsis == MCSERVER_SYNOPSIS_VERIFY) {
+		if (args.version != NULL || optind != argc) {
+			fprintf(stderr, "%s: Synopsis verify checks every archive in store, it takes no version\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+	}
+
+	if (args.synopsis == MCSERVER_SYNOPSIS_SUPERVISE && optind == argc) {
+		fprintf(stderr, "%s: Synopsis supervise expects at least one world\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	/* Install and bench operands are versions, which replace the default one. */
+	if (args.version == NULL
+		&& args.synopsis != MCSERVER_SYNOPSIS_VERIFY
+		&& args.synopsis != MCSERVER_SYNOPSIS_SERVE
+		&& ((args.synopsis != MCSERVER_SYNOPSIS_INSTALL && args.synopsis != MCSERVER_SYNOPSIS_BENCH) || optind == argc)) {
 		args.version = "latest";
 	}
 
-	if (args.synopsis == MCSERVER_SYNOPSIS_LAUNCH) {
-		if (args.world == NULL) {
+	if (args.synopsis == MCSERVER_SYNOPSIS_SERVE) {
+		if (args.version != NULL || argc - optind > 1) {
+			fprintf(stderr, "%s: Synopsis serve shares the whole store, it only takes an address\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+
+		if (parallel_set) {
+			fprintf(stderr, "%s: Option parallel can only be used for install and verify\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+	}
+
+	if (args.synopsis == MCSERVER_SYNOPSIS_BENCH && argc != optind && args.version != NULL) {
+		fprintf(stderr, "%s: Synopsis bench takes its versions either as option or operands\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.synopsis == MCSERVER_SYNOPSIS_CDS && optind != argc) {
+		fprintf(stderr, "%s: Synopsis cds takes no operands\n", *argv);
+		mcserver_usage(*argv, EXIT_FAILURE);
+	}
+
+	if (args.synopsis == MCSERVER_SYNOPSIS_LAUNCH
+		|| args.synopsis == MCSERVER_SYNOPSIS_SUPERVISE
+		|| args.synopsis == MCSERVER_SYNOPSIS_CDS
+		|| args.synopsis == MCSERVER_SYNOPSIS_BENCH) {
+		if (args.synopsis == MCSERVER_SYNOPSIS_SUPERVISE && args.world != NULL) {
+			fprintf(stderr, "%s: Option world cannot be used for supervise, worlds are its operands\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+
+		if (args.synopsis == MCSERVER_SYNOPSIS_CDS && args.world != NULL) {
+			fprintf(stderr, "%s: Option world cannot be used for cds, it trains in a scratch world\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
+		}
+
+		if (args.world == NULL && args.synopsis == MCSERVER_SYNOPSIS_LAUNCH) {
 			const size_t worldsz = HOST_NAME_MAX + 1;
 			char * const world = malloc(worldsz);
 
@@ -186,11 +630,12 @@ mcserver_parse_args(int argc, char **argv) {
 			/* NB: Will leak, missing free. */
 		}
 
-		if (args.jvm == NULL) {
-			args.jvm = "java";
+		if (parallel_set) {
+			fprintf(stderr, "%s: Option parallel can only be used for install and verify\n", *argv);
+			mcserver_usage(*argv, EXIT_FAILURE);
 		}
-	} else if (args.world != NULL || args.jvm != NULL) {
-		fprintf(stderr, "%s: Options world and jvm can only be used for launch\n", *argv);
+	} else if (args.world != NULL || args.jvm != NULL || args.profile != NULL) {
+		fprintf(stderr, "%s: Options world, jvm and profile can only be used for launch, supervise, cds and bench\n", *argv);
 		mcserver_usage(*argv, EXIT_FAILURE);
 	}
 
@@ -209,12 +654,42 @@ int
 main(int argc, char *argv[]) {
 	const struct mcserver_args args = mcserver_parse_args(argc, argv);
 
-	manifest_setup(CONFIG_VERSION_MANIFEST_URL, args.max_age);
+	if (args.trace != NULL) {
+		trace_setup(args.trace, argc, argv);
+	}
+
+	if (args.progress != NULL) {
+		storage_progress_setup(args.progress);
+	}
+
+	storage_budget_setup((uint64_t)args.budget << 20);
+
+	/* Empty unless the build trusts other authorities than the system's. */
+	if (*CONFIG_CA_BUNDLE != '\0') {
+		storage_ca_bundle_setup(CONFIG_CA_BUNDLE);
+	}
+
+	if (!args.offline) {
+		storage_mirrors_setup(CONFIG_VERSION_MANIFEST_URL, args.stale);
+	}
+
+	manifest_setup(CONFIG_VERSION_MANIFEST_URL, args.max_age, args.offline, args.stale);
+	runtime_setup(CONFIG_JAVA_RUNTIMES_MANIFEST_URL, args.max_age, args.offline, args.stale);
 
 	switch (args.synopsis) {
 	case MCSERVER_SYNOPSIS_LAUNCH:
 		mcserver_launch(&args, argc, argv);
 	case MCSERVER_SYNOPSIS_INSTALL:
-		mcserver_install(&args);
+		mcserver_install(&args, argc, argv);
+	case MCSERVER_SYNOPSIS_VERIFY:
+		mcserver_verify(&args);
+	case MCSERVER_SYNOPSIS_SUPERVISE:
+		mcserver_supervise(&args, argc, argv);
+	case MCSERVER_SYNOPSIS_CDS:
+		mcserver_cds(&args);
+	case MCSERVER_SYNOPSIS_SERVE:
+		mcserver_serve(&args, argc, argv);
+	case MCSERVER_SYNOPSIS_BENCH:
+		mcserver_bench(&args, argc, argv);
 	}
 }
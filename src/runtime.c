@@ -0,0 +1,694 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include <sys/stat.h>
+
+#include <json-c/json.h>
+#include <curl/curl.h>
+
+#include "storage.h"
+#include "trace.h"
+
+/* Platforms of the Java runtimes manifest, there is no runtime for other systems. */
+#if defined(__APPLE__) && defined(__aarch64__)
+#define RUNTIME_PLATFORM "mac-os-arm64"
+#elif defined(__APPLE__) && defined(__x86_64__)
+#define RUNTIME_PLATFORM "mac-os"
+#elif defined(__linux__) && defined(__x86_64__)
+#define RUNTIME_PLATFORM "linux"
+#elif defined(__linux__) && defined(__i386__)
+#define RUNTIME_PLATFORM "linux-i386"
+#endif
+
+#ifdef __APPLE__
+#define RUNTIME_JAVA_PATH "jre.bundle/Contents/Home/bin/java"
+#else
+#define RUNTIME_JAVA_PATH "bin/java"
+#endif
+
+/* Holds the digest of the component manifest a runtime was built from. */
+#define RUNTIME_INSTALLED_FILE ".installed"
+
+/* Runtimes are thousands of small files, transferred many at once on a few multiplexed connections. */
+#define RUNTIME_DOWNLOAD_PARALLEL 32
+
+static struct {
+	const char *url;
+	time_t max_age;
+	bool offline;
+	bool stale;
+} runtime;
+
+struct runtime_object {
+	const char *sha1, *url;
+	size_t size;
+	bool executable;
+	char *path;
+	struct storage_download *download;
+};
+
+struct runtime_entry {
+	const char *path;
+
+	enum {
+		RUNTIME_ENTRY_DIRECTORY,
+		RUNTIME_ENTRY_FILE,
+		RUNTIME_ENTRY_LINK,
+	} type;
+
+	/* Target of links, object of files. */
+	const char *target;
+	struct runtime_object object;
+};
+
+void
+runtime_setup(const char *url, time_t max_age, bool offline, bool stale) {
+	runtime.url = url;
+	runtime.max_age = max_age;
+	runtime.offline = offline;
+	runtime.stale = stale;
+}
+
+#ifdef RUNTIME_PLATFORM
+/* Refreshes the Java runtimes manifest from a detached process, for the next invocation to use. */
+static void
+runtime_manifests_revalidate(const char *path) {
+	const int lock = storage_lock(path, false);
+
+	/* Another process is already fetching it. */
+	if (lock < 0) {
+		return;
+	}
+	storage_unlock(lock);
+
+	if (storage_detach()) {
+		exit(storage_fetch(path, runtime.url) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+}
+
+/* Loads the Java runtimes manifest, fetching it if missing or expired. Returns NULL if unavailable. */
+static struct json_object *
+runtime_manifests_load(void) {
+	char * const path = storage_runtimes_manifest_path();
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "stat '%s'", path);
+		}
+
+		if (runtime.offline || !storage_fetch(path, runtime.url)) {
+			free(path);
+			return NULL;
+		}
+	} else if (!runtime.offline && time(NULL) - st.st_mtime >= runtime.max_age) {
+		/* An outdated runtimes manifest is still better than none. */
+		if (!runtime.stale) {
+			storage_fetch(path, runtime.url);
+		} else {
+			runtime_manifests_revalidate(path);
+		}
+	}
+
+	struct json_object * const runtimes_object = json_object_from_file(path);
+	if (runtimes_object == NULL) {
+		warnx("Unable to parse Java runtimes manifest '%s'", path);
+	}
+
+	free(path);
+
+	return runtimes_object;
+}
+
+static bool
+runtime_object_parse(struct json_object *download_object, struct runtime_object *object) {
+	struct json_object *field;
+
+	if (!json_object_object_get_ex(download_object, "sha1", &field)
+		|| (object->sha1 = json_object_get_string(field)) == NULL
+		|| !json_object_object_get_ex(download_object, "url", &field)
+		|| (object->url = json_object_get_string(field)) == NULL
+		|| !json_object_object_get_ex(download_object, "size", &field)) {
+		return false;
+	}
+
+	errno = 0;
+	object->size = json_object_get_uint64(field);
+	if (object->size == 0 && errno != 0) {
+		return false;
+	}
+
+	object->path = NULL;
+	object->download = NULL;
+
+	return true;
+}
+
+/* Gets the manifest of the latest release of a component for our platform. */
+static bool
+runtime_component_manifest(struct json_object *runtimes_object, const char *component, struct runtime_object *manifest) {
+	struct json_object *platform_object, *releases_object, *object;
+
+	if (!json_object_object_get_ex(runtimes_object, RUNTIME_PLATFORM, &platform_object)
+		|| !json_object_object_get_ex(platform_object, component, &releases_object)
+		|| !json_object_is_type(releases_object, json_type_array)
+		|| json_object_array_length(releases_object) == 0) {
+		warnx("No Java runtime '%s' available for " RUNTIME_PLATFORM, component);
+		return false;
+	}
+
+	if (!json_object_object_get_ex(json_object_array_get_idx(releases_object, 0), "manifest", &object)
+		|| !runtime_object_parse(object, manifest)) {
+		warnx("Unable to get '" RUNTIME_PLATFORM ".%s[0].manifest' in Java runtimes manifest!", component);
+		return false;
+	}
+
+	manifest->executable = false;
+	manifest->path = storage_runtime_manifest_path(manifest->sha1);
+
+	return true;
+}
+
+/* Entries must stay in the runtime tree, rejecting absolute paths and parent references. */
+static bool
+runtime_entry_path_valid(const char *path) {
+	const char *component = path;
+
+	if (*path == '/') {
+		return false;
+	}
+
+	while (component != NULL) {
+		const char * const separator = strchr(component, '/');
+		const size_t length = separator != NULL ? (size_t)(separator - component) : strlen(component);
+
+		if (length == 0 || (length == 1 && *component == '.')
+			|| (length == 2 && strncmp(component, "..", 2) == 0)) {
+			return false;
+		}
+
+		component = separator != NULL ? separator + 1 : NULL;
+	}
+
+	return true;
+}
+
+static void
+runtime_entries_free(struct runtime_entry *entries, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		free(entries[i].object.path);
+	}
+	free(entries);
+}
+
+/*
+ * Parses the entries of a component manifest, borrowing its strings.
+ * Returns NULL if the manifest is invalid, which was already reported.
+ */
+static struct runtime_entry *
+runtime_entries_parse(struct json_object *manifest_object, size_t *countp) {
+	struct json_object *files_object;
+
+	if (!json_object_object_get_ex(manifest_object, "files", &files_object)
+		|| !json_object_is_type(files_object, json_type_object)) {
+		warnx("Unable to get 'files' in Java runtime manifest!");
+		return NULL;
+	}
+
+	struct runtime_entry * const entries = calloc(json_object_object_length(files_object), sizeof (*entries));
+	size_t count = 0;
+
+	if (entries == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	json_object_object_foreach(files_object, name, entry_object) {
+		struct runtime_entry * const entry = &entries[count++];
+		struct json_object *object;
+		const char *type;
+
+		if (!runtime_entry_path_valid(name)) {
+			warnx("Invalid path '%s' in Java runtime manifest!", name);
+			runtime_entries_free(entries, count);
+			return NULL;
+		}
+
+		if (!json_object_object_get_ex(entry_object, "type", &object)
+			|| (type = json_object_get_string(object)) == NULL) {
+			warnx("Unable to get 'files.%s.type' in Java runtime manifest!", name);
+			runtime_entries_free(entries, count);
+			return NULL;
+		}
+
+		entry->path = name;
+
+		if (strcmp(type, "directory") == 0) {
+			entry->type = RUNTIME_ENTRY_DIRECTORY;
+		} else if (strcmp(type, "file") == 0) {
+			entry->type = RUNTIME_ENTRY_FILE;
+
+			/* Only raw downloads are used, lzma ones would need another dependency. */
+			if (!json_object_object_get_ex(entry_object, "downloads", &object)
+				|| !json_object_object_get_ex(object, "raw", &object)
+				|| !runtime_object_parse(object, &entry->object)) {
+				warnx("Unable to get 'files.%s.downloads.raw' in Java runtime manifest!", name);
+				runtime_entries_free(entries, count);
+				return NULL;
+			}
+
+			entry->object.executable = json_object_object_get_ex(entry_object, "executable", &object)
+				&& json_object_get_boolean(object);
+			entry->object.path = storage_runtime_object_path(entry->object.sha1, entry->object.executable);
+		} else if (strcmp(type, "link") == 0) {
+			entry->type = RUNTIME_ENTRY_LINK;
+
+			if (!json_object_object_get_ex(entry_object, "target", &object)
+				|| (entry->target = json_object_get_string(object)) == NULL) {
+				warnx("Unable to get 'files.%s.target' in Java runtime manifest!", name);
+				runtime_entries_free(entries, count);
+				return NULL;
+			}
+		} else {
+			warnx("Unknown type '%s' for 'files.%s' in Java runtime manifest!", type, name);
+			runtime_entries_free(entries, count);
+			return NULL;
+		}
+	}
+
+	*countp = count;
+
+	return entries;
+}
+
+static int
+runtime_object_compare(const void *lhs, const void *rhs) {
+	const struct runtime_object * const * const lobject = lhs, * const * const robject = rhs;
+
+	return strcmp((*lobject)->path, (*robject)->path);
+}
+
+/*
+ * Downloads objects, at most RUNTIME_DOWNLOAD_PARALLEL at once,
+ * each one verified against its digest before it is stored.
+ * Returns the number of failed downloads.
+ */
+static size_t
+runtime_objects_download(struct runtime_object **objects, size_t count) {
+	CURLM * const multi = curl_multi_init();
+	size_t first = 0, next = 0, running = 0, failures = 0;
+
+	while (next < count || running != 0) {
+
+		while (running < RUNTIME_DOWNLOAD_PARALLEL && next < count) {
+			struct runtime_object * const object = objects[next++];
+
+			object->download = storage_download_open(object->path, object->url, object->sha1, object->size, 1, false);
+			storage_download_start(object->download, multi, object);
+			running++;
+		}
+
+		/* Restart failed transfers whose backoff expired, and wake up for the next one. */
+		while (first < next && objects[first]->download == NULL) {
+			first++;
+		}
+
+		long timeout = -1;
+		for (size_t i = first; i < next; i++) {
+			if (objects[i]->download != NULL) {
+				const long retry = storage_download_retry(objects[i]->download, multi);
+
+				if (retry >= 0 && (timeout < 0 || retry < timeout)) {
+					timeout = retry;
+				}
+			}
+		}
+
+		int still_running;
+		CURLMcode mres = curl_multi_perform(multi, &still_running);
+
+		if (mres == CURLM_OK && (still_running != 0 || timeout >= 0)) {
+			mres = curl_multi_poll(multi, NULL, 0,
+				timeout >= 0 && timeout < 1000 ? timeout : 1000, NULL);
+		}
+
+		if (mres != CURLM_OK) {
+			errx(EXIT_FAILURE, "curl_multi: %s", curl_multi_strerror(mres));
+		}
+
+		const CURLMsg *message;
+		int queued;
+
+		while ((message = curl_multi_info_read(multi, &queued)) != NULL) {
+			if (message->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			/* Message is invalidated by curl_multi_remove_handle. */
+			CURL * const easy = message->easy_handle;
+			const CURLcode res = message->data.result;
+			struct runtime_object *object;
+
+			curl_easy_getinfo(easy, CURLINFO_PRIVATE, &object);
+			curl_multi_remove_handle(multi, easy);
+
+			if (!storage_download_finished(object->download, multi, easy, res)) {
+				continue;
+			}
+
+			bool valid = storage_download_close(object->download);
+
+			if (valid && object->executable && chmod(object->path, 0555) != 0) {
+				warn("chmod '%s'", object->path);
+				unlink(object->path);
+				valid = false;
+			}
+
+			if (!valid) {
+				failures++;
+			}
+
+			object->download = NULL;
+			running--;
+		}
+	}
+
+	curl_multi_cleanup(multi);
+
+	return failures;
+}
+
+/* Creates the directories of path, after its first root characters. */
+static bool
+runtime_parents_create(char *path, size_t root) {
+	char *separator = path + root;
+
+	while ((separator = strchr(separator, '/')) != NULL) {
+		*separator = '\0';
+		if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+			warn("mkdir '%s'", path);
+			*separator = '/';
+			return false;
+		}
+		*separator++ = '/';
+	}
+
+	return true;
+}
+
+/* Builds a runtime tree, hardlinking its files to the objects shared by all runtimes. */
+static bool
+runtime_tree_build(const char *tree, const struct runtime_entry *entries, size_t count) {
+	const size_t root = strlen(tree) + 1;
+
+	/* Links come last, so no entry is ever created through one of them. */
+	for (unsigned int links = 0; links < 2; links++) {
+		for (size_t i = 0; i < count; i++) {
+			const struct runtime_entry * const entry = &entries[i];
+			bool created = true;
+			char *path;
+
+			if ((entry->type == RUNTIME_ENTRY_LINK) != (links != 0)) {
+				continue;
+			}
+
+			if (asprintf(&path, "%s/%s", tree, entry->path) < 0) {
+				errx(EXIT_FAILURE, "asprintf");
+			}
+
+			if (!runtime_parents_create(path, root)) {
+				free(path);
+				return false;
+			}
+
+			switch (entry->type) {
+			case RUNTIME_ENTRY_DIRECTORY:
+				if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+					warn("mkdir '%s'", path);
+					created = false;
+				}
+				break;
+			case RUNTIME_ENTRY_FILE:
+				if (link(entry->object.path, path) != 0) {
+					warn("link '%s'", path);
+					created = false;
+				}
+				break;
+			case RUNTIME_ENTRY_LINK:
+				if (symlink(entry->target, path) != 0) {
+					warn("symlink '%s'", path);
+					created = false;
+				}
+				break;
+			}
+
+			free(path);
+
+			if (!created) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Replaces tree with the one built in temporary, running servers keep the files they opened. */
+static bool
+runtime_tree_replace(const char *tree, const char *temporary) {
+	char *previous;
+
+	if (asprintf(&previous, "%s.old.XXXXXX", tree) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	/* A directory can be renamed over an empty one, which keeps the previous tree's name unique. */
+	if (mkdtemp(previous) == NULL) {
+		warn("mkdtemp '%s'", previous);
+		free(previous);
+		return false;
+	}
+
+	if (rename(tree, previous) != 0 && errno != ENOENT) {
+		warn("rename '%s'", tree);
+		storage_remove(previous);
+		free(previous);
+		return false;
+	}
+
+	if (rename(temporary, tree) != 0) {
+		warn("rename '%s'", temporary);
+		rename(previous, tree);
+		free(previous);
+		return false;
+	}
+
+	storage_remove(previous);
+	free(previous);
+
+	return true;
+}
+
+/* Whether tree was built from the component manifest of digest sha1. */
+static bool
+runtime_installed(const char *installed, const char *sha1) {
+	FILE * const filep = fopen(installed, "r");
+	char digest[41];
+
+	if (filep == NULL) {
+		return false;
+	}
+
+	const bool matches = fscanf(filep, "%40s", digest) == 1
+		&& strcmp(digest, sha1) == 0;
+
+	fclose(filep);
+
+	return matches;
+}
+
+/* Installs every entry of a component manifest in tree. */
+static bool
+runtime_install_manifest(const char *component, const char *tree, const struct runtime_object *manifest) {
+	struct json_object * const manifest_object = json_object_from_file(manifest->path);
+	size_t count;
+
+	if (manifest_object == NULL) {
+		warnx("Unable to parse Java runtime manifest '%s'", manifest->path);
+		return false;
+	}
+
+	struct runtime_entry * const entries = runtime_entries_parse(manifest_object, &count);
+	if (entries == NULL) {
+		json_object_put(manifest_object);
+		return false;
+	}
+
+	/* Download each missing object once, identical files share the same object. */
+	struct runtime_object ** const objects = malloc(count * sizeof (*objects));
+	size_t objects_count = 0, missing = 0;
+
+	if (objects == NULL && count != 0) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i].type == RUNTIME_ENTRY_FILE) {
+			objects[objects_count++] = &entries[i].object;
+		}
+	}
+
+	qsort(objects, objects_count, sizeof (*objects), runtime_object_compare);
+
+	for (size_t i = 0; i < objects_count; i++) {
+		if ((missing == 0 || strcmp(objects[missing - 1]->path, objects[i]->path) != 0)
+			&& access(objects[i]->path, F_OK) != 0) {
+			objects[missing++] = objects[i];
+		}
+	}
+
+	bool installed = true;
+
+	if (missing != 0) {
+		warnx("Installing Java runtime '%s', %zu files to download", component, missing);
+		installed = runtime_objects_download(objects, missing) == 0;
+	}
+
+	free(objects);
+
+	/* Build the new tree aside, so a failure never leaves a partial runtime behind. */
+	char *temporary, *installed_path;
+
+	if (asprintf(&temporary, "%s.XXXXXX", tree) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	if (installed && mkdtemp(temporary) == NULL) {
+		warn("mkdtemp '%s'", temporary);
+		installed = false;
+	} else if (installed) {
+		if (asprintf(&installed_path, "%s/" RUNTIME_INSTALLED_FILE, temporary) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		installed = chmod(temporary, 0755) == 0
+			&& runtime_tree_build(temporary, entries, count)
+			&& storage_store(installed_path, manifest->sha1, strlen(manifest->sha1))
+			&& runtime_tree_replace(tree, temporary);
+
+		if (!installed) {
+			storage_remove(temporary);
+		}
+
+		free(installed_path);
+	}
+
+	free(temporary);
+	runtime_entries_free(entries, count);
+	json_object_put(manifest_object);
+
+	return installed;
+}
+#endif
+
+/*
+ * Installs the latest release of a Java runtime component, unless already installed.
+ * Returns the path of its java executable, or NULL if unavailable, which was already reported.
+ */
+char *
+runtime_install(const char *component) {
+#ifdef RUNTIME_PLATFORM
+	const uint64_t start = trace_now();
+	char * const tree = storage_runtime_directory(component);
+	struct json_object * const runtimes_object = runtime_manifests_load();
+	struct runtime_object manifest = { };
+	char *java, *installed;
+	bool available = false;
+
+	if (asprintf(&java, "%s/" RUNTIME_JAVA_PATH, tree) < 0
+		|| asprintf(&installed, "%s/" RUNTIME_INSTALLED_FILE, tree) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	if (runtimes_object == NULL || !runtime_component_manifest(runtimes_object, component, &manifest)) {
+		/* Without a runtimes manifest, the runtime in store is the best we have. */
+		available = runtimes_object == NULL && access(java, X_OK) == 0;
+	} else if (runtime_installed(installed, manifest.sha1)) {
+		available = true;
+	} else if (runtime.offline) {
+		available = access(java, X_OK) == 0;
+		if (!available) {
+			warnx("Java runtime '%s' is not in store, unable to install it offline", component);
+		}
+	} else {
+		/* Concurrent processes install a runtime once, the others reuse it. */
+		const int lock = storage_lock(tree, true);
+
+		available = runtime_installed(installed, manifest.sha1);
+		if (!available) {
+			available = access(manifest.path, R_OK) == 0
+				|| runtime_objects_download((struct runtime_object *[]) { &manifest }, 1) == 0;
+
+			available = available && runtime_install_manifest(component, tree, &manifest);
+			if (!available) {
+				warnx("Unable to install Java runtime '%s'", component);
+			}
+		}
+
+		storage_unlock(lock);
+	}
+
+	json_object_put(runtimes_object);
+	free(manifest.path);
+	free(installed);
+	free(tree);
+
+	trace_phase("runtime", component, start, -1);
+
+	if (!available) {
+		free(java);
+		return NULL;
+	}
+
+	return java;
+#else
+	(void)component;
+	return NULL;
+#endif
+}
+
+/*
+ * Installs the latest release of an already installed Java runtime component from a detached process,
+ * once the Java runtimes manifest expired, so launches never wait on it. The next launches use the update.
+ */
+void
+runtime_update(const char *component) {
+#ifdef RUNTIME_PLATFORM
+	char * const path = storage_runtimes_manifest_path();
+	struct stat st;
+
+	if (!runtime.offline && stat(path, &st) == 0 && time(NULL) - st.st_mtime >= runtime.max_age) {
+		const int lock = storage_lock(path, false);
+
+		/* Another process is already fetching it. */
+		if (lock >= 0) {
+			storage_unlock(lock);
+
+			if (storage_detach()) {
+				runtime.stale = false;
+				exit(runtime_install(component) != NULL ? EXIT_SUCCESS : EXIT_FAILURE);
+			}
+		}
+	}
+
+	free(path);
+#else
+	(void)component;
+#endif
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <stdbool.h>
+#include <time.h>
+
+void runtime_setup(const char *url, time_t max_age, bool offline, bool stale);
+
+char *runtime_install(const char *component);
+
+void runtime_update(const char *component);
+
+/* RUNTIME_H */
+#endif
@@ -0,0 +1,706 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "serve.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <sys/uio.h>
+#else
+#include <sys/sendfile.h>
+#endif
+
+#include "manifest.h"
+#include "storage.h"
+
+#define SERVE_CONNECTIONS_MAX 256
+#define SERVE_REQUEST_MAX 8192
+
+/* Idle keep-alive connections are closed after a minute. */
+#define SERVE_IDLE_TIMEOUT_MS 60000
+
+/* Archives installed since the digests table was built are looked up again, at most this often. */
+#define SERVE_ARCHIVES_REFRESH_MS 10000
+
+/* A single connection does not hold the loop for longer than a chunk. */
+#define SERVE_SENDFILE_CHUNK (1 << 20)
+
+/* Upstream paths of packages and objects, named after their digest. */
+#define SERVE_PACKAGES_PREFIX "/v1/packages/"
+#define SERVE_OBJECTS_PREFIX "/v1/objects/"
+
+struct serve_connection {
+	int socket;
+	uint64_t deadline;
+	bool close;
+
+	/* Kept nul-terminated, for string functions to find the end of headers. */
+	char request[SERVE_REQUEST_MAX + 1];
+	size_t received;
+
+	/* Pending response, its header then its body sent from fd. */
+	char header[1024];
+	size_t header_size, header_sent;
+	int fd;
+	off_t offset, end;
+};
+
+static struct {
+	char **archives, **sha1s;
+	size_t archives_count;
+	uint64_t archives_at;
+} serve_store;
+
+static uint64_t
+serve_monotonic_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int
+serve_listen(const char *address) {
+	const char * const separator = strrchr(address, ':');
+	char *host = NULL;
+
+	if (separator == NULL) {
+		errx(EXIT_FAILURE, "Invalid address '%s', expected [<host>]:<port>", address);
+	}
+
+	/* Brackets around IPv6 addresses are not part of the host. */
+	if (separator != address) {
+		const size_t length = separator - address;
+
+		if (*address == '[' && length > 2 && address[length - 1] == ']') {
+			host = strndup(address + 1, length - 2);
+		} else {
+			host = strndup(address, length);
+		}
+	}
+
+	const struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *results;
+	int errcode = getaddrinfo(host, separator + 1, &hints, &results);
+
+	if (errcode != 0) {
+		errx(EXIT_FAILURE, "getaddrinfo '%s': %s", address, gai_strerror(errcode));
+	}
+
+	int fd = -1;
+
+	for (const struct addrinfo *result = results; fd < 0 && result != NULL; result = result->ai_next) {
+		const int enable = 1;
+
+		fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable));
+
+		if (bind(fd, result->ai_addr, result->ai_addrlen) != 0 || listen(fd, 128) != 0) {
+			errcode = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd < 0) {
+		errno = errcode;
+		err(EXIT_FAILURE, "Unable to listen on '%s'", address);
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	freeaddrinfo(results);
+	free(host);
+
+	return fd;
+}
+
+/* Archives of versions released since the manifest was mapped are only found once it is refreshed. */
+static void
+serve_archives_load(void) {
+
+	manifest_refresh();
+
+	for (size_t i = 0; i < serve_store.archives_count; i++) {
+		free(serve_store.archives[i]);
+		free(serve_store.sha1s[i]);
+	}
+	free(serve_store.archives);
+	free(serve_store.sha1s);
+
+	serve_store.archives_count = manifest_archives_digests(&serve_store.archives, &serve_store.sha1s);
+	serve_store.archives_at = serve_monotonic_ms();
+}
+
+static char *
+serve_archive(const char *sha1) {
+
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < serve_store.archives_count; i++) {
+			if (strcmp(serve_store.sha1s[i], sha1) == 0) {
+				return strdup(serve_store.archives[i]);
+			}
+		}
+
+		if (pass != 0 || serve_monotonic_ms() - serve_store.archives_at < SERVE_ARCHIVES_REFRESH_MS) {
+			break;
+		}
+
+		serve_archives_load();
+	}
+
+	return NULL;
+}
+
+/* Returns the first of the candidate paths which exists, releasing the others. */
+static char *
+serve_first_existing(char **candidates, size_t count) {
+	char *existing = NULL;
+
+	for (size_t i = 0; i < count; i++) {
+		if (existing == NULL && candidates[i] != NULL && access(candidates[i], R_OK) == 0) {
+			existing = candidates[i];
+		} else {
+			free(candidates[i]);
+		}
+	}
+
+	return existing;
+}
+
+/*
+ * Maps a request target to a file of the store, under the same path as upstream,
+ * so peers can use us as a mirror. Returns NULL if the store has no such file.
+ * Only files named after their digest are served, which peers verify against
+ * the manifests they fetched from the origin. Manifests themselves are not served.
+ */
+static char *
+serve_resolve(const char *target, bool *jsonp) {
+	const bool package = strncmp(target, SERVE_PACKAGES_PREFIX, sizeof (SERVE_PACKAGES_PREFIX) - 1) == 0;
+	const char *sha1;
+
+	if (package) {
+		sha1 = target + sizeof (SERVE_PACKAGES_PREFIX) - 1;
+	} else if (strncmp(target, SERVE_OBJECTS_PREFIX, sizeof (SERVE_OBJECTS_PREFIX) - 1) == 0) {
+		sha1 = target + sizeof (SERVE_OBJECTS_PREFIX) - 1;
+	} else {
+		return NULL;
+	}
+
+	/* Only a hexadecimal digest followed by a name, anything else is not ours. */
+	for (unsigned int i = 0; i < 40; i++) {
+		if (!isxdigit((unsigned char)sha1[i])) {
+			return NULL;
+		}
+	}
+
+	if (sha1[40] != '/') {
+		return NULL;
+	}
+
+	char digest[41];
+	memcpy(digest, sha1, 40);
+	digest[40] = '\0';
+
+	*jsonp = package;
+
+	if (package) {
+		char *candidates[] = {
+			storage_package_path(digest),
+			storage_runtime_manifest_path(digest),
+		};
+
+		return serve_first_existing(candidates, sizeof (candidates) / sizeof (*candidates));
+	} else {
+		char *candidates[] = {
+			storage_runtime_object_path(digest, false),
+			storage_runtime_object_path(digest, true),
+		};
+		char * const object = serve_first_existing(candidates, sizeof (candidates) / sizeof (*candidates));
+
+		return object != NULL ? object : serve_archive(digest);
+	}
+}
+
+/*
+ * Parses a single byte range, multiple ranges are ignored and the whole file is sent.
+ * Returns 1 for a range within size, 0 for an unsatisfiable one and -1 to ignore it.
+ */
+static int
+serve_range_parse(const char *range, off_t size, off_t *startp, off_t *endp) {
+	char *end;
+
+	if (strncmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL) {
+		return -1;
+	}
+	range += 6;
+
+	if (*range == '-') {
+		/* Suffix, the last bytes of the file. */
+		const long long suffix = strtoll(range + 1, &end, 10);
+
+		if (end == range + 1 || *end != '\0' || suffix < 0) {
+			return -1;
+		}
+
+		if (suffix == 0) {
+			return 0;
+		}
+
+		*startp = suffix < size ? size - suffix : 0;
+		*endp = size;
+		return 1;
+	}
+
+	const long long first = strtoll(range, &end, 10);
+	if (end == range || *end != '-' || first < 0) {
+		return -1;
+	}
+	range = end + 1;
+
+	long long last = size - 1;
+	if (*range != '\0') {
+		last = strtoll(range, &end, 10);
+		if (*end != '\0' || last < first) {
+			return -1;
+		}
+	}
+
+	if (first >= size) {
+		return 0;
+	}
+
+	*startp = first;
+	*endp = last < size ? last + 1 : size;
+	return 1;
+}
+
+static void
+serve_status(struct serve_connection *connection, int status, const char *reason) {
+	connection->header_size = snprintf(connection->header, sizeof (connection->header),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: %s\r\n"
+		"\r\n", status, reason, connection->close ? "close" : "keep-alive");
+	connection->header_sent = 0;
+	connection->fd = -1;
+}
+
+static void
+serve_respond(struct serve_connection *connection, const char *method, const char *target,
+	const char *range, const char *if_none_match) {
+	const bool head = strcmp(method, "HEAD") == 0;
+	bool json = false;
+
+	if (!head && strcmp(method, "GET") != 0) {
+		serve_status(connection, 405, "Method Not Allowed");
+		return;
+	}
+
+	/* Queries are meaningless to a store. */
+	char * const query = strchr(target, '?');
+	if (query != NULL) {
+		*query = '\0';
+	}
+
+	char * const path = serve_resolve(target, &json);
+	if (path == NULL) {
+		serve_status(connection, 404, "Not Found");
+		return;
+	}
+
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		warn("open '%s'", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(path);
+		serve_status(connection, 404, "Not Found");
+		return;
+	}
+
+	free(path);
+
+	/* Store files are replaced, never modified, their identity makes a strong validator. */
+	char etag[64];
+	snprintf(etag, sizeof (etag), "\"%jx-%jx-%jx\"",
+		(uintmax_t)st.st_ino, (uintmax_t)st.st_size, (uintmax_t)st.st_mtime);
+
+	if (if_none_match != NULL && strcmp(if_none_match, etag) == 0) {
+		close(fd);
+		connection->header_size = snprintf(connection->header, sizeof (connection->header),
+			"HTTP/1.1 304 Not Modified\r\n"
+			"ETag: %s\r\n"
+			"Connection: %s\r\n"
+			"\r\n", etag, connection->close ? "close" : "keep-alive");
+		connection->header_sent = 0;
+		connection->fd = -1;
+		return;
+	}
+
+	off_t start = 0, end = st.st_size;
+	const int ranged = range != NULL ? serve_range_parse(range, st.st_size, &start, &end) : -1;
+
+	if (ranged == 0) {
+		close(fd);
+		connection->header_size = snprintf(connection->header, sizeof (connection->header),
+			"HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%jd\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: %s\r\n"
+			"\r\n", (intmax_t)st.st_size, connection->close ? "close" : "keep-alive");
+		connection->header_sent = 0;
+		connection->fd = -1;
+		return;
+	}
+
+	char content_range[96] = "";
+	if (ranged > 0) {
+		snprintf(content_range, sizeof (content_range), "Content-Range: bytes %jd-%jd/%jd\r\n",
+			(intmax_t)start, (intmax_t)end - 1, (intmax_t)st.st_size);
+	}
+
+	connection->header_size = snprintf(connection->header, sizeof (connection->header),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %jd\r\n"
+		"%s"
+		"Accept-Ranges: bytes\r\n"
+		"ETag: %s\r\n"
+		"Connection: %s\r\n"
+		"\r\n", ranged > 0 ? "206 Partial Content" : "200 OK",
+		json ? "application/json" : "application/octet-stream",
+		(intmax_t)(end - start), content_range, etag, connection->close ? "close" : "keep-alive");
+	connection->header_sent = 0;
+
+	if (head) {
+		close(fd);
+		connection->fd = -1;
+	} else {
+		connection->fd = fd;
+		connection->offset = start;
+		connection->end = end;
+	}
+}
+
+/*
+ * Handles the next complete request received on a connection, if any.
+ * Returns false if the request is invalid and the connection must be closed.
+ */
+static bool
+serve_connection_process(struct serve_connection *connection) {
+	char * const request = connection->request;
+	char * const terminator = strstr(request, "\r\n\r\n");
+
+	if (terminator == NULL) {
+		if (connection->received == SERVE_REQUEST_MAX) {
+			connection->close = true;
+			serve_status(connection, 431, "Request Header Fields Too Large");
+		}
+		return true;
+	}
+
+	*terminator = '\0';
+
+	/* Request line, then headers we care about. */
+	char *line = request, *next = strstr(line, "\r\n");
+	const char *range = NULL, *if_none_match = NULL;
+
+	if (next != NULL) {
+		*next = '\0';
+		next += 2;
+	}
+
+	char *saveptr;
+	const char * const method = strtok_r(line, " ", &saveptr);
+	char * const target = strtok_r(NULL, " ", &saveptr);
+	const char * const version = strtok_r(NULL, " ", &saveptr);
+
+	if (method == NULL || target == NULL || version == NULL || strncmp(version, "HTTP/1.", 7) != 0) {
+		connection->close = true;
+		serve_status(connection, 400, "Bad Request");
+		return true;
+	}
+
+	connection->close = strcmp(version, "HTTP/1.0") == 0;
+
+	while ((line = next) != NULL) {
+		next = strstr(line, "\r\n");
+		if (next != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+
+		char * const colon = strchr(line, ':');
+		if (colon == NULL) {
+			continue;
+		}
+
+		char *value = colon + 1;
+		*colon = '\0';
+
+		while (*value == ' ' || *value == '\t') {
+			value++;
+		}
+
+		if (strcasecmp(line, "Range") == 0) {
+			range = value;
+		} else if (strcasecmp(line, "If-None-Match") == 0) {
+			if_none_match = value;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			connection->close = strcasecmp(value, "close") == 0;
+		}
+	}
+
+	serve_respond(connection, method, target, range, if_none_match);
+
+	/* Keep pipelined requests for once the response is sent. */
+	const size_t consumed = terminator + 4 - request;
+	memmove(request, request + consumed, connection->received - consumed);
+	connection->received -= consumed;
+	request[connection->received] = '\0';
+
+	return true;
+}
+
+/* Returns false once the connection must be closed. */
+static bool
+serve_connection_read(struct serve_connection *connection) {
+	const ssize_t received = recv(connection->socket, connection->request + connection->received,
+		SERVE_REQUEST_MAX - connection->received, 0);
+
+	if (received < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+
+	if (received == 0) {
+		return false;
+	}
+
+	connection->received += received;
+	connection->request[connection->received] = '\0';
+
+	return serve_connection_process(connection);
+}
+
+static ssize_t
+serve_sendfile(int socket, int fd, off_t *offsetp, size_t count) {
+#ifdef __APPLE__
+	off_t length = count;
+
+	/* A partial send still fails with EAGAIN, but reports what it sent. */
+	if (sendfile(fd, socket, *offsetp, &length, NULL, 0) != 0 && length == 0) {
+		return -1;
+	}
+
+	*offsetp += length;
+
+	return length;
+#else
+	return sendfile(socket, fd, offsetp, count);
+#endif
+}
+
+/* Returns false once the connection must be closed. */
+static bool
+serve_connection_write(struct serve_connection *connection) {
+
+	if (connection->header_sent < connection->header_size) {
+		const ssize_t sent = send(connection->socket, connection->header + connection->header_sent,
+			connection->header_size - connection->header_sent, 0);
+
+		if (sent < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		connection->header_sent += sent;
+		if (connection->header_sent < connection->header_size) {
+			return true;
+		}
+	}
+
+	if (connection->fd >= 0 && connection->offset < connection->end) {
+		const off_t left = connection->end - connection->offset;
+		const ssize_t sent = serve_sendfile(connection->socket, connection->fd, &connection->offset,
+			left < SERVE_SENDFILE_CHUNK ? left : SERVE_SENDFILE_CHUNK);
+
+		if (sent < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		/* The file shrank under us, the announced length cannot be honoured anymore. */
+		if (sent == 0) {
+			return false;
+		}
+
+		if (connection->offset < connection->end) {
+			return true;
+		}
+	}
+
+	/* Response sent. */
+	if (connection->fd >= 0) {
+		close(connection->fd);
+		connection->fd = -1;
+	}
+	connection->header_size = 0;
+	connection->header_sent = 0;
+
+	if (connection->close) {
+		return false;
+	}
+
+	return serve_connection_process(connection);
+}
+
+static void
+serve_connection_close(struct serve_connection *connection) {
+	if (connection->fd >= 0) {
+		close(connection->fd);
+	}
+	close(connection->socket);
+	connection->socket = -1;
+}
+
+/*
+ * Serves the store over HTTP, files being sent with sendfile,
+ * straight from the page cache without copies in user space.
+ */
+noreturn void
+serve(const char *address) {
+	struct serve_connection * const connections = calloc(SERVE_CONNECTIONS_MAX, sizeof (*connections));
+	struct pollfd fds[1 + SERVE_CONNECTIONS_MAX];
+	const int listener = serve_listen(address);
+
+	if (connections == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (unsigned int i = 0; i < SERVE_CONNECTIONS_MAX; i++) {
+		connections[i].socket = -1;
+	}
+
+	serve_archives_load();
+
+	/* Writes to a peer which went away must not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	warnx("Serving %zu archives on '%s'", serve_store.archives_count, address);
+
+	while (true) {
+		uint64_t now = serve_monotonic_ms();
+		nfds_t nfds = 1;
+		int timeout = -1;
+
+		fds[0] = (struct pollfd) { .fd = listener, .events = POLLIN };
+
+		for (unsigned int i = 0; i < SERVE_CONNECTIONS_MAX; i++) {
+			struct serve_connection * const connection = &connections[i];
+
+			if (connection->socket < 0) {
+				continue;
+			}
+
+			if (connection->deadline <= now) {
+				serve_connection_close(connection);
+				continue;
+			}
+
+			const uint64_t left = connection->deadline - now;
+			if (timeout < 0 || left < (uint64_t)timeout) {
+				timeout = left;
+			}
+
+			fds[nfds++] = (struct pollfd) {
+				.fd = connection->socket,
+				.events = connection->header_size != 0 ? POLLOUT : POLLIN,
+			};
+		}
+
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		now = serve_monotonic_ms();
+
+		for (nfds_t i = 1, j = 0; i < nfds; i++, j++) {
+			while (connections[j].socket != fds[i].fd) {
+				j++;
+			}
+
+			struct serve_connection * const connection = &connections[j];
+
+			if (fds[i].revents == 0) {
+				continue;
+			}
+
+			const bool open = connection->header_size != 0
+				? serve_connection_write(connection) : serve_connection_read(connection);
+
+			if (!open) {
+				serve_connection_close(connection);
+			} else {
+				connection->deadline = now + SERVE_IDLE_TIMEOUT_MS;
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd;
+
+			while ((fd = accept(listener, NULL, NULL)) >= 0) {
+				struct serve_connection *connection = connections;
+
+				while (connection != connections + SERVE_CONNECTIONS_MAX && connection->socket >= 0) {
+					connection++;
+				}
+
+				if (connection == connections + SERVE_CONNECTIONS_MAX) {
+					/* Peers retry on another mirror, or upstream. */
+					close(fd);
+					continue;
+				}
+
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+
+				*connection = (struct serve_connection) {
+					.socket = fd,
+					.deadline = now + SERVE_IDLE_TIMEOUT_MS,
+					.fd = -1,
+				};
+			}
+		}
+	}
+}
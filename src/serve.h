@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdnoreturn.h>
+
+noreturn void serve(const char *address);
+
+/* SERVE_H */
+#endif
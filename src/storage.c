@@ -6,16 +6,28 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <errno.h>
 #include <err.h>
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <curl/curl.h>
+#include <json-c/json.h>
 #include <openssl/evp.h>
 
+#include "trace.h"
+
 /* The terminating slashes are important for path compositions. */
 #ifdef __APPLE__
 #define STORAGE_DATA_DIR "Library/Application Support/mcserver/"
@@ -24,14 +36,126 @@
 #endif
 
 #define STORAGE_DATA_VERSION_MANIFEST_FILE "version_manifest.json"
+#define STORAGE_DATA_VERSION_MANIFEST_INDEX_FILE "version_manifest.idx"
 #define STORAGE_DATA_ARCHIVES_DIR "archives/"
+#define STORAGE_DATA_PACKAGES_DIR "packages/"
+#define STORAGE_DATA_LIBRARIES_DIR "libraries/"
+#define STORAGE_DATA_RUNTIMES_DIR "runtimes/"
+#define STORAGE_DATA_RUNTIMES_MANIFEST_FILE STORAGE_DATA_RUNTIMES_DIR "all.json"
+#define STORAGE_DATA_RUNTIMES_MANIFESTS_DIR STORAGE_DATA_RUNTIMES_DIR "manifests/"
+#define STORAGE_DATA_RUNTIMES_OBJECTS_DIR STORAGE_DATA_RUNTIMES_DIR "objects/"
+#define STORAGE_DATA_VERIFIED_FILE ".verified"
 #define STORAGE_DATA_WORLDS_DIR "worlds/"
+#define STORAGE_DATA_SUPERVISE_SOCKET "supervise.sock"
+#define STORAGE_DATA_MIRRORS_FILE "mirrors"
+#define STORAGE_DATA_MIRRORS_PROBE_FILE "mirrors.probe"
+#define STORAGE_DATA_PINS_FILE "pins"
+
+/* Files aside a server archive, replacing its .jar suffix. */
+#define STORAGE_ARCHIVE_CDS_SUFFIX ".jsa"
+#define STORAGE_ARCHIVE_CLASSPATH_SUFFIX ".classpath"
+#define STORAGE_ARCHIVE_JAVA_SUFFIX ".java"
+
+/* Scratch directories are hidden among worlds, world names cannot start with a dot. */
+#define STORAGE_SCRATCH_TEMPLATE STORAGE_DATA_WORLDS_DIR ".scratch.XXXXXX"
+
+/* Hidden aside the world directories, world names cannot start with a dot. */
+#define STORAGE_WORLD_RECORD_FORMAT STORAGE_DATA_WORLDS_DIR ".%s%s"
+#define STORAGE_WORLD_PROFILE_SUFFIX ".profile"
+#define STORAGE_WORLD_HEAP_SUFFIX ".heap"
+#define STORAGE_WORLD_VERSION_SUFFIX ".version"
+
+/* Empty file aside an archive, modified whenever the archive is used. */
+#define STORAGE_ARCHIVE_USED_SUFFIX ".used"
+
+/* Libraries are only collected once unreferenced for that long, an unpacking may be storing its classpath. */
+#define STORAGE_LIBRARIES_GRACE 3600
+
+#define STORAGE_STRINGIFY_(value) #value
+#define STORAGE_STRINGIFY(value) STORAGE_STRINGIFY_(value)
+
+/* Segments smaller than this are not worth an additional connection. */
+#define STORAGE_DOWNLOAD_SEGMENT_MIN_SIZE (4 << 20)
+
+/* Lock files are kept aside the file they guard, and never removed. */
+#define STORAGE_LOCK_SUFFIX ".lock"
+
+/* Validators of a fetched file, to revalidate it with a conditional request. */
+#define STORAGE_FETCH_VALIDATORS_SUFFIX ".validators"
+
+/* Partial downloads are kept aside their expected digest, size and remaining ranges. */
+#define STORAGE_DOWNLOAD_PART_SUFFIX ".part"
+#define STORAGE_DOWNLOAD_PART_INFO_SUFFIX ".part.info"
+
+/* Failed transfers are retried with an exponential backoff. */
+#define STORAGE_FETCH_RETRIES 5
+#define STORAGE_FETCH_BACKOFF_MS 500
+#define STORAGE_FETCH_BACKOFF_MAX_MS 16000
+
+/* A transfer under 1 KiB/s for 30 seconds is considered stalled. */
+#define STORAGE_FETCH_LOW_SPEED_LIMIT 1024
+#define STORAGE_FETCH_LOW_SPEED_TIME 30
+
+/* Mirrors are probed again after an hour, a mirror slower than 10 seconds to answer is unhealthy. */
+#define STORAGE_MIRRORS_PROBE_MAX_AGE 3600
+#define STORAGE_MIRRORS_PROBE_TIMEOUT_MS 10000
+
+/* Received bytes are written by a pool of threads in large batches, aligned on their size in the file. */
+#define STORAGE_WRITE_BATCH_SIZE (1 << 20)
+#define STORAGE_WRITE_THREADS 4
+
+/* Archives are verified by at most that many threads besides the main one, whatever the parallelism asked. */
+#define STORAGE_VERIFY_THREADS_MAX 64
+
+/* Remaining ranges of a part file are recorded at most this often, for a killed download to resume. */
+#define STORAGE_DOWNLOAD_PART_SAVE_MS 1000
+
+/* Progress bars are redrawn at most this often, progress events streamed at most this often. */
+#define STORAGE_PROGRESS_FRAME_MS 100
+#define STORAGE_PROGRESS_EVENT_MS 1000
+
+struct storage_mirror {
+	char *base;
+	/* Time to fetch the probe in microseconds, negative if it failed. */
+	int64_t score;
+	bool failed;
+	/* Paths the mirror does not have, looked up on the next mirrors or the origin. */
+	char **misses;
+	size_t misses_count;
+};
 
 static struct {
 	char *path;
 	struct winsize ws;
+	CURLSH *share;
+	/* Progress events are appended to it as JSON lines, if any. */
+	int progress;
+	/* Archives and libraries are evicted beyond this size in bytes, unless zero. */
+	uint64_t budget;
+	/* Certificate authorities the origin is verified with, the system's ones if NULL. */
+	const char *ca_bundle;
+
+	/* Ranked fastest first, transfers use the current one, or the origin once all failed. */
+	struct storage_mirror *mirrors;
+	unsigned int mirrors_count, mirror;
 } storage;
 
+struct storage_download_segment;
+
+/* Segments whose batch is queued for writing, lazily started threads write them in order. */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t queued, written;
+	struct storage_download_segment *head, **tail;
+	unsigned int threads;
+	bool started;
+} storage_writer = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.written = PTHREAD_COND_INITIALIZER,
+	.tail = &storage_writer.head,
+};
+
 static void __attribute__((constructor))
 storage_setup(void) {
 	const char * const home = getenv("HOME");
@@ -52,6 +176,8 @@ storage_setup(void) {
 		storage.ws.ws_col = 0;
 	}
 
+	storage.progress = -1;
+
 	/* NB: storage.path leaks, missing a free. */
 }
 
@@ -66,6 +192,17 @@ storage_version_manifest_path(void) {
 	return path;
 }
 
+char *
+storage_version_manifest_index_path(void) {
+	char *path;
+
+	if (asprintf(&path, "%s" STORAGE_DATA_VERSION_MANIFEST_INDEX_FILE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return path;
+}
+
 char *
 storage_archive_path(const char *id) {
 	char *path;
@@ -89,6 +226,136 @@ storage_archive_path(const char *id) {
 	return path;
 }
 
+char *
+storage_package_path(const char *sha1) {
+	char *path;
+
+	if (*sha1 == '\0' || *sha1 == '.'
+		|| strchr(sha1, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid package digest '%s'", sha1);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_DATA_PACKAGES_DIR "%s.json", storage.path, sha1) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const separator = strrchr(path, '/');
+	*separator = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir '%s'", path);
+	}
+	*separator = '/';
+
+	return path;
+}
+
+/* Libraries unpacked from bundlers are shared by all versions, by digest. */
+char *
+storage_library_path(const char *sha256) {
+	char *path;
+
+	if (*sha256 == '\0' || *sha256 == '.'
+		|| strchr(sha256, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid library digest '%s'", sha256);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_DATA_LIBRARIES_DIR "%s.jar", storage.path, sha256) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const separator = strrchr(path, '/');
+	*separator = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir '%s'", path);
+	}
+	*separator = '/';
+
+	return path;
+}
+
+/* Creates the directories of path, up to its last separator. */
+static void
+storage_parents_create(char *path) {
+	const size_t length = strlen(storage.path);
+	char *separator = path + length;
+
+	while ((separator = strchr(separator, '/')) != NULL) {
+		*separator = '\0';
+		if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+			err(EXIT_FAILURE, "mkdir '%s'", path);
+		}
+		*separator++ = '/';
+	}
+}
+
+char *
+storage_runtimes_manifest_path(void) {
+	char *path;
+
+	if (asprintf(&path, "%s" STORAGE_DATA_RUNTIMES_MANIFEST_FILE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	storage_parents_create(path);
+
+	return path;
+}
+
+char *
+storage_runtime_manifest_path(const char *sha1) {
+	char *path;
+
+	if (*sha1 == '\0' || *sha1 == '.'
+		|| strchr(sha1, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid runtime manifest digest '%s'", sha1);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_DATA_RUNTIMES_MANIFESTS_DIR "%s.json", storage.path, sha1) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	storage_parents_create(path);
+
+	return path;
+}
+
+/* Runtime files are shared by digest, hardlinked in each runtime, executables apart. */
+char *
+storage_runtime_object_path(const char *sha1, bool executable) {
+	char *path;
+
+	if (*sha1 == '\0' || *sha1 == '.'
+		|| strchr(sha1, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid runtime file digest '%s'", sha1);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_DATA_RUNTIMES_OBJECTS_DIR "%s%s", storage.path, sha1, executable ? ".x" : "") < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	storage_parents_create(path);
+
+	return path;
+}
+
+char *
+storage_runtime_directory(const char *component) {
+	char *path;
+
+	if (*component == '\0' || *component == '.'
+		|| strchr(component, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid runtime component '%s'", component);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_DATA_RUNTIMES_DIR "%s", storage.path, component) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	storage_parents_create(path);
+
+	return path;
+}
+
 char *
 storage_world_directory(const char *world) {
 	char *path;
@@ -116,180 +383,2694 @@ storage_world_directory(const char *world) {
 	return path;
 }
 
-void
-storage_fetch(const char *path, const char *url) {
+static char *
+storage_world_record_path(const char *world, const char *suffix) {
+	char *path;
+
+	if (*world == '\0' || *world == '.'
+		|| strchr(world, '/') != NULL) {
+		errx(EXIT_FAILURE, "Invalid world '%s'", world);
+	}
+
+	if (asprintf(&path, "%s" STORAGE_WORLD_RECORD_FORMAT, storage.path, world, suffix) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return path;
+}
+
+/* Returns the single line record of a file, or NULL if there is none. */
+static char *
+storage_record_load(const char *path) {
+	FILE * const filep = fopen(path, "r");
+	char *record = NULL;
+
+	if (filep != NULL) {
+		size_t capacity = 0;
+		const ssize_t length = getline(&record, &capacity, filep);
+
+		if (length <= 0) {
+			free(record);
+			record = NULL;
+		} else if (record[length - 1] == '\n') {
+			record[length - 1] = '\0';
+		}
+
+		fclose(filep);
+	} else if (errno != ENOENT) {
+		warn("fopen '%s'", path);
+	}
+
+	return record;
+}
+
+static void
+storage_record_save(const char *path, const char *record) {
 	FILE * const filep = fopen(path, "w");
-	CURL * const easy = curl_easy_init();
 
 	if (filep == NULL) {
-		err(EXIT_FAILURE, "fopen '%s'", path);
+		warn("fopen '%s'", path);
+	} else {
+		fprintf(filep, "%s\n", record);
+
+		if (fclose(filep) != 0) {
+			warn("fclose '%s'", path);
+		}
 	}
+}
 
-	curl_easy_setopt(easy, CURLOPT_URL, url);
-	curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "https");
-	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, fwrite);
-	curl_easy_setopt(easy, CURLOPT_WRITEDATA, filep);
+/* Returns the JVM profile stored for a world, or NULL if none was. */
+char *
+storage_world_profile_load(const char *world) {
+	char * const path = storage_world_record_path(world, STORAGE_WORLD_PROFILE_SUFFIX);
+	char * const profile = storage_record_load(path);
 
-	const CURLcode res = curl_easy_perform(easy);
-	if (res != CURLE_OK) {
-		unlink(path);
-		errx(EXIT_FAILURE, "curl_easy_perform '%s': %s", url, curl_easy_strerror(res));
+	free(path);
+
+	return profile;
+}
+
+void
+storage_world_profile_save(const char *world, const char *profile) {
+	char * const path = storage_world_record_path(world, STORAGE_WORLD_PROFILE_SUFFIX);
+
+	storage_record_save(path, profile);
+
+	free(path);
+}
+
+/* Maximum heap size of a world in MiB, zero if none was recorded. */
+unsigned int
+storage_world_heap_load(const char *world) {
+	char * const path = storage_world_record_path(world, STORAGE_WORLD_HEAP_SUFFIX);
+	char * const record = storage_record_load(path);
+	unsigned long heap = 0;
+
+	if (record != NULL) {
+		char *end;
+
+		heap = strtoul(record, &end, 10);
+		if (*end != '\0' || heap > UINT_MAX) {
+			warnx("Invalid heap size '%s' recorded in '%s', ignoring it", record, path);
+			heap = 0;
+		}
 	}
 
-	curl_easy_cleanup(easy);
-	fclose(filep);
+	free(record);
+	free(path);
+
+	return heap;
 }
 
-static inline uint8_t 
-hex2nibble(uint8_t hex) {
-       return isdigit(hex) ? hex - '0' : hex - 'a' + 10;
+void
+storage_world_heap_save(const char *world, unsigned int heap) {
+	char * const path = storage_world_record_path(world, STORAGE_WORLD_HEAP_SUFFIX);
+	char record[sizeof ("4294967295")];
+
+	snprintf(record, sizeof (record), "%u", heap);
+	storage_record_save(path, record);
+
+	free(path);
 }
 
-static int
-storage_fetch_progress_interactive(void *clientp,
-	curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-	char progress[storage.ws.ws_col];
-	char *cursor = progress;
+static char *
+storage_archive_aside_path(const char *archive, const char *suffix) {
+	const size_t length = strlen(archive);
+	char *path;
 
-	cursor = stpcpy(cursor, clientp);
-	*cursor++ = ' ';
-	*cursor++ = '[';
+	if (length < 4 || strcmp(archive + length - 4, ".jar") != 0) {
+		errx(EXIT_FAILURE, "Invalid archive '%s'", archive);
+	}
 
-	const size_t gap = progress + sizeof (progress) - cursor - 2;
-	size_t filled = 0;
+	if (asprintf(&path, "%.*s%s", (int)(length - 4), archive, suffix) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
 
-	if (dltotal != 0) {
-		filled = dlnow * gap / dltotal;
+	return path;
+}
+
+char *
+storage_archive_cds_path(const char *archive) {
+	return storage_archive_aside_path(archive, STORAGE_ARCHIVE_CDS_SUFFIX);
+}
+
+char *
+storage_archive_classpath_path(const char *archive) {
+	return storage_archive_aside_path(archive, STORAGE_ARCHIVE_CLASSPATH_SUFFIX);
+}
+
+/* Loads the Java runtime component of an archive's version and its java executable, if they were recorded. */
+bool
+storage_archive_java_load(const char *archive, char **componentp, char **javap) {
+	char * const path = storage_archive_aside_path(archive, STORAGE_ARCHIVE_JAVA_SUFFIX);
+	char * const record = storage_record_load(path);
+	char * const separator = record != NULL ? strchr(record, '\t') : NULL;
+
+	free(path);
+
+	if (separator == NULL || separator == record || separator[1] == '\0') {
+		free(record);
+		return false;
 	}
 
-	memset(cursor, '=', filled);
-	cursor += filled;
+	*separator = '\0';
+	*componentp = record;
+	*javap = strdup(separator + 1);
 
-	memset(cursor, ' ', gap - filled);
-	cursor += gap - filled;
+	return true;
+}
 
-	*cursor++ = ']';
-	*cursor++ = '\r';
+/* Records the Java runtime component of an archive's version and its java executable, for launches to skip the manifests. */
+void
+storage_archive_java_save(const char *archive, const char *component, const char *java) {
+	char * const path = storage_archive_aside_path(archive, STORAGE_ARCHIVE_JAVA_SUFFIX);
+	char *record;
 
-	fwrite(progress, sizeof (*progress), sizeof (progress), stdout);
-	fflush(stdout);
+	if (asprintf(&record, "%s\t%s", component, java) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
 
-	return 0;
+	storage_record_save(path, record);
+
+	free(record);
+	free(path);
 }
 
+/*
+ * Records the archive was just used, and that world, if any, runs on it,
+ * so neither is evicted first. Only touches files, not to slow launches.
+ */
 void
-storage_fetch_and_verify(const char *path, const char *url, const char *sha1, size_t expected_size) {
-	uint8_t expected_digest[20];
+storage_archive_use(const char *archive, const char *world) {
+	char *used;
 
-	/* Hexadecimal string, two nibbles per byte. */
-	if (strlen(sha1) != 2 * sizeof (expected_digest)) {
-		errx(EXIT_FAILURE, "Invalid SHA1 digest length for '%s'", sha1);
+	if (asprintf(&used, "%s" STORAGE_ARCHIVE_USED_SUFFIX, archive) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
 	}
 
-	for (unsigned i = 0; i < sizeof (expected_digest); i++) {
-		const char high = sha1[2 * i], low = sha1[2 * i + 1];
+	if (utimensat(AT_FDCWD, used, NULL, 0) != 0) {
+		const int fd = errno == ENOENT ? open(used, O_WRONLY | O_CREAT | O_CLOEXEC, 0666) : -1;
 
-		if (!isxdigit(high) || !isxdigit(low)) {
-			errx(EXIT_FAILURE, "Invalid SHA1 digest '%s', expected a hexadecimal string", sha1);
+		if (fd < 0) {
+			warn("Unable to record use of '%s'", archive);
+		} else {
+			close(fd);
+		}
+	}
+
+	free(used);
+
+	if (world != NULL) {
+		char * const path = storage_world_record_path(world, STORAGE_WORLD_VERSION_SUFFIX);
+		char * const recorded = storage_record_load(path);
+		char * const id = strdup(strrchr(archive, '/') + 1);
+
+		*strrchr(id, '.') = '\0';
+
+		if (recorded == NULL || strcmp(recorded, id) != 0) {
+			storage_record_save(path, id);
 		}
 
-		expected_digest[i] = hex2nibble(high) << 4 | hex2nibble(low);
+		free(id);
+		free(recorded);
+		free(path);
 	}
+}
 
-	/* Download server archive. */
-	FILE * const filep = fopen(path, "w");
-	CURL * const easy = curl_easy_init();
+char *
+storage_scratch_directory(void) {
+	char *path;
 
-	if (filep == NULL) {
-		err(EXIT_FAILURE, "fopen '%s'", path);
+	if (asprintf(&path, "%s" STORAGE_SCRATCH_TEMPLATE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
 	}
 
-	curl_easy_setopt(easy, CURLOPT_URL, url);
-	curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "https");
-	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, fwrite);
-	curl_easy_setopt(easy, CURLOPT_WRITEDATA, filep);
+	char * const separator = strrchr(path, '/');
+	*separator = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir '%s'", path);
+	}
+	*separator = '/';
 
-	char linefeed;
-	const char * const name = strrchr(path, '/') + 1;
-	if (strlen(name) + 4 <= storage.ws.ws_col) { /* 4 == strlen(" []\r") */
-		/* Enable interactive progress if the name is not too long. */
-		curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, storage_fetch_progress_interactive);
-		curl_easy_setopt(easy, CURLOPT_XFERINFODATA, name);
-		linefeed = '\n';
-	} else {
-		linefeed = '\0';
+	if (mkdtemp(path) == NULL) {
+		err(EXIT_FAILURE, "mkdtemp '%s'", path);
 	}
-	curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
 
-	const CURLcode res = curl_easy_perform(easy);
+	return path;
+}
+
+static void
+storage_remove_tree(int dirfd, const char *name) {
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+	if (fd >= 0) {
+		DIR * const dirp = fdopendir(fd);
+		const struct dirent *entry;
+
+		while ((entry = readdir(dirp)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+
+			/* Directories fail with EISDIR on Linux, EPERM elsewhere. */
+			if (unlinkat(fd, entry->d_name, 0) != 0 && (errno == EISDIR || errno == EPERM)) {
+				storage_remove_tree(fd, entry->d_name);
+			}
+		}
 
-	if (linefeed) {
-		fputc(linefeed, stdout);
+		closedir(dirp);
 	}
 
-	if (res != CURLE_OK) {
-		unlink(path);
-		errx(EXIT_FAILURE, "curl_easy_perform '%s': %s", url, curl_easy_strerror(res));
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0) {
+		warn("unlinkat '%s'", name);
 	}
+}
 
-	curl_easy_cleanup(easy);
-	fclose(filep);
+void
+storage_remove(const char *path) {
+	storage_remove_tree(AT_FDCWD, path);
+}
 
-	/* Verify server archive signature. */
-	EVP_MD_CTX * const ctx = EVP_MD_CTX_new();
-	const int fd = open(path, O_RDONLY);
-	bool valid = false;
+static void
+storage_copy_file(int sourcefd, int destinationfd, const char *name, mode_t mode) {
+	const int source = openat(sourcefd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	const int destination = openat(destinationfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 0777);
+	char buffer[65536];
+	ssize_t length;
 
-	do {
-		char buffer[getpagesize()];
-		ssize_t copied;
+	if (source < 0 || destination < 0) {
+		err(EXIT_FAILURE, "Unable to copy '%s'", name);
+	}
 
-		if (fd < 0) {
-			warn("open %s", path);
-			break;
+	while (length = read(source, buffer, sizeof (buffer)), length > 0) {
+		if (write(destination, buffer, length) != length) {
+			err(EXIT_FAILURE, "Unable to copy '%s'", name);
 		}
+	}
 
-		EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+	if (length < 0 || close(destination) != 0) {
+		err(EXIT_FAILURE, "Unable to copy '%s'", name);
+	}
 
-		while (copied = read(fd, buffer, sizeof (buffer)), copied > 0) {
-			EVP_DigestUpdate(ctx, buffer, copied);
-			expected_size -= copied;
-		}
+	close(source);
+}
 
-		if (copied != 0) {
-			warn("read %s", path);
-			break;
-		}
+/* Copies directories and regular files, links and anything else are skipped. */
+static void
+storage_copy_tree_at(int sourcefd, int destinationfd) {
+	DIR * const dirp = fdopendir(sourcefd);
+	const struct dirent *entry;
 
-		uint8_t digest[EVP_MAX_MD_SIZE];
-		unsigned int digestsz;
+	if (dirp == NULL) {
+		err(EXIT_FAILURE, "fdopendir");
+	}
 
-		EVP_DigestFinal_ex(ctx, digest, &digestsz);
+	while ((entry = readdir(dirp)) != NULL) {
+		struct stat st;
 
-		if (sizeof (expected_digest) != digestsz
-			|| memcmp(digest, expected_digest, digestsz) != 0) {
-			warnx("Incoherent digest for downloaded archive!");
-			break;
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+			|| fstatat(sourcefd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
 		}
 
-		if (expected_size != 0) {
-			warnx("Incoherent size for downloaded archive!");
-			break;
-		}
+		if (S_ISDIR(st.st_mode)) {
+			if (mkdirat(destinationfd, entry->d_name, 0777) != 0) {
+				err(EXIT_FAILURE, "mkdirat '%s'", entry->d_name);
+			}
 
-		valid = true;
-	} while (0);
+			const int source = openat(sourcefd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			const int destination = openat(destinationfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-	close(fd);
-	EVP_MD_CTX_free(ctx);
+			if (source < 0 || destination < 0) {
+				err(EXIT_FAILURE, "Unable to copy '%s'", entry->d_name);
+			}
 
-	if (!valid) {
-		unlink(path);
-		exit(EXIT_FAILURE);
+			storage_copy_tree_at(source, destination);
+			close(destination);
+		} else if (S_ISREG(st.st_mode)) {
+			storage_copy_file(sourcefd, destinationfd, entry->d_name, st.st_mode);
+		}
 	}
 
-	/* Make the archive read only. */
-	if (chmod(path, 0444) != 0) {
-		warn("chmod '%s'", path);
+	closedir(dirp);
+}
+
+/* Copies the contents of the source directory in the existing destination one. */
+void
+storage_copy_tree(const char *source, const char *destination) {
+	const int sourcefd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int destinationfd = open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (sourcefd < 0 || destinationfd < 0) {
+		err(EXIT_FAILURE, "Unable to copy '%s' to '%s'", source, destination);
+	}
+
+	storage_copy_tree_at(sourcefd, destinationfd);
+	close(destinationfd);
+}
+
+char *
+storage_supervise_socket_path(void) {
+	char *path;
+
+	if (asprintf(&path, "%s" STORAGE_DATA_SUPERVISE_SOCKET, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return path;
+}
+
+/*
+ * Locks path against other processes, through its lock file.
+ * Lock files are never removed, so all processes always lock the same file.
+ * Returns -1 if path is already locked and we must not wait.
+ */
+int
+storage_lock(const char *path, bool wait) {
+	char *lock_path;
+
+	if (asprintf(&lock_path, "%s" STORAGE_LOCK_SUFFIX, path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open '%s'", lock_path);
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno != EWOULDBLOCK) {
+			err(EXIT_FAILURE, "flock '%s'", lock_path);
+		}
+
+		if (!wait) {
+			close(fd);
+			free(lock_path);
+			return -1;
+		}
+
+		warnx("Waiting for '%s', locked by another process", strrchr(path, '/') + 1);
+
+		while (flock(fd, LOCK_EX) != 0) {
+			if (errno != EINTR) {
+				err(EXIT_FAILURE, "flock '%s'", lock_path);
+			}
+		}
+	}
+
+	free(lock_path);
+
+	return fd;
+}
+
+void
+storage_unlock(int lock) {
+	close(lock);
+}
+
+/*
+ * Forks a process detached from our session and reparented to init, so nobody has to reap it.
+ * Returns true in the detached process, which must exit once done, false in the caller.
+ */
+bool
+storage_detach(void) {
+
+	/* Buffered output would otherwise be written by both processes. */
+	fflush(NULL);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		warn("fork");
+		return false;
+	}
+
+	if (pid != 0) {
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+		return false;
+	}
+
+	if (setsid() < 0) {
+		_exit(EXIT_FAILURE);
+	}
+
+	const pid_t detached = fork();
+	if (detached != 0) {
+		_exit(detached < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	/* Keep stderr for warnings, but never read our caller's input or write on its output. */
+	const int null = open("/dev/null", O_RDWR);
+	if (null >= 0) {
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+
+	/*
+	 * Shared connections are the caller's, their TLS sessions must not be
+	 * used nor closed from here. NB: The inherited share leaks.
+	 */
+	storage.share = NULL;
+
+	/* Writer threads are not forked along, start anew without them. */
+	pthread_mutex_init(&storage_writer.mutex, NULL);
+	pthread_cond_init(&storage_writer.queued, NULL);
+	pthread_cond_init(&storage_writer.written, NULL);
+	storage_writer.head = NULL;
+	storage_writer.tail = &storage_writer.head;
+	storage_writer.threads = 0;
+	storage_writer.started = false;
+
+	return true;
+}
+
+static const char *
+storage_url_path(const char *url) {
+	const char * const authority = strstr(url, "://");
+	const char * const path = authority != NULL ? strchr(authority + 3, '/') : NULL;
+
+	return path != NULL ? path : "/";
+}
+
+/* Mirrors replace the scheme and authority of URLs, keeping their paths. */
+static char *
+storage_mirror_url(const struct storage_mirror *mirror, const char *url) {
+	char *mirrored;
+
+	if (asprintf(&mirrored, "%s%s", mirror->base, storage_url_path(url)) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	return mirrored;
+}
+
+static bool
+storage_mirror_misses(const struct storage_mirror *mirror, const char *path) {
+
+	for (size_t i = 0; i < mirror->misses_count; i++) {
+		if (strcmp(mirror->misses[i], path) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Only what is verified against a digest from a document of the origin, such as packages, archives
+ * and runtime files, is transferred from mirrors. Those documents always come from the origin.
+ */
+static void
+storage_transfer_url(CURL *easy, const char *url, bool verified) {
+	const struct storage_mirror *mirror = NULL;
+
+	/* The current mirror, unless it misses url, then the next healthy one which does not. */
+	for (unsigned int i = storage.mirror; verified && mirror == NULL && i < storage.mirrors_count; i++) {
+		if (!storage.mirrors[i].failed && !storage_mirror_misses(&storage.mirrors[i], storage_url_path(url))) {
+			mirror = &storage.mirrors[i];
+		}
+	}
+
+	if (mirror != NULL) {
+		char * const mirrored = storage_mirror_url(mirror, url);
+
+		/* libcurl keeps its own copy. Peers serving their store may only speak plain HTTP. */
+		curl_easy_setopt(easy, CURLOPT_URL, mirrored);
+		curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "http,https");
+		free(mirrored);
+	} else {
+		curl_easy_setopt(easy, CURLOPT_URL, url);
+		curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "https");
+	}
+
+	if (storage.ca_bundle != NULL) {
+		curl_easy_setopt(easy, CURLOPT_CAINFO, storage.ca_bundle);
+	}
+}
+
+/*
+ * Creates a transfer of url, sharing connections, resolved
+ * names and TLS sessions with every other transfer of the process.
+ * Whether what it transfers is verified against a digest lets it be from a mirror.
+ */
+CURL *
+storage_transfer_open(const char *url, bool verified) {
+	CURL * const easy = curl_easy_init();
+
+	if (easy == NULL) {
+		errx(EXIT_FAILURE, "curl_easy_init");
+	}
+
+	/* Created after a first easy handle, which globally initializes libcurl. */
+	if (storage.share == NULL) {
+		storage.share = curl_share_init();
+		if (storage.share == NULL) {
+			errx(EXIT_FAILURE, "curl_share_init");
+		}
+
+		curl_share_setopt(storage.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(storage.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(storage.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+		/* NB: storage.share leaks, its connections live as long as the process. */
+	}
+
+	curl_easy_setopt(easy, CURLOPT_SHARE, storage.share);
+	storage_transfer_url(easy, url, verified);
+	curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+
+	return easy;
+}
+
+/*
+ * Marks the mirror a failed transfer was from as failed, later transfers use the next one.
+ * A file missing from a mirror only fails it for that file, which is looked up elsewhere.
+ * Returns whether the transfer was from a mirror, and can be restarted at once.
+ */
+bool
+storage_mirror_failover(CURL *easy) {
+	const char *url;
+	long code = 0;
+
+	if (storage.mirrors_count == 0
+		|| curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK || url == NULL) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < storage.mirrors_count; i++) {
+		struct storage_mirror * const mirror = &storage.mirrors[i];
+		const size_t length = strlen(mirror->base);
+
+		if (strncmp(url, mirror->base, length) != 0 || url[length] != '/') {
+			continue;
+		}
+
+		curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+
+		if (code == 404 || code == 410) {
+			char ** const misses = realloc(mirror->misses, (mirror->misses_count + 1) * sizeof (*misses));
+
+			if (misses == NULL || (misses[mirror->misses_count] = strdup(url + length)) == NULL) {
+				err(EXIT_FAILURE, "alloc");
+			}
+
+			mirror->misses = misses;
+			mirror->misses_count++;
+
+			return true;
+		}
+
+		/* Concurrent transfers of a failed mirror fail over without more warnings. */
+		if (!mirror->failed) {
+			mirror->failed = true;
+
+			while (storage.mirror < storage.mirrors_count && storage.mirrors[storage.mirror].failed) {
+				storage.mirror++;
+			}
+
+			warnx("Mirror '%s' failed, falling over to '%s'", mirror->base,
+				storage.mirror < storage.mirrors_count ? storage.mirrors[storage.mirror].base : "origin");
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+static size_t
+storage_mirrors_probe_write(const void *data, size_t one, size_t count, void *unused) {
+	return count;
+}
+
+/* Fetches url from every mirror at once, scoring them by the time it took, so both latency and throughput count. */
+static void
+storage_mirrors_probe(const char *url) {
+	CURLM * const multi = curl_multi_init();
+	int still_running;
+
+	for (unsigned int i = 0; i < storage.mirrors_count; i++) {
+		struct storage_mirror * const mirror = &storage.mirrors[i];
+		char * const mirrored = storage_mirror_url(mirror, url);
+		CURL * const easy = storage_transfer_open(url, true);
+
+		/*
+		 * Probe every mirror, not only the current one. Peers do not serve the manifest
+		 * probed, any answer but a server error makes a mirror healthy.
+		 */
+		curl_easy_setopt(easy, CURLOPT_URL, mirrored);
+		curl_easy_setopt(easy, CURLOPT_FAILONERROR, 0L);
+		curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "http,https");
+		curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+		curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)STORAGE_MIRRORS_PROBE_TIMEOUT_MS);
+		curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, storage_mirrors_probe_write);
+		curl_easy_setopt(easy, CURLOPT_PRIVATE, mirror);
+		curl_multi_add_handle(multi, easy);
+
+		mirror->score = -1;
+		free(mirrored);
+	}
+
+	do {
+		CURLMcode mres = curl_multi_perform(multi, &still_running);
+
+		if (mres == CURLM_OK && still_running != 0) {
+			mres = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		}
+
+		if (mres != CURLM_OK) {
+			errx(EXIT_FAILURE, "curl_multi: %s", curl_multi_strerror(mres));
+		}
+
+		const CURLMsg *message;
+		int queued;
+
+		while ((message = curl_multi_info_read(multi, &queued)) != NULL) {
+			if (message->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			CURL * const easy = message->easy_handle;
+			struct storage_mirror *mirror;
+			curl_off_t total;
+			long code = 0;
+
+			curl_easy_getinfo(easy, CURLINFO_PRIVATE, &mirror);
+			curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+
+			if (message->data.result == CURLE_OK && code < 500
+				&& curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total) == CURLE_OK) {
+				mirror->score = total;
+			} else if (message->data.result == CURLE_OK) {
+				warnx("Mirror '%s' is unhealthy: HTTP %ld", mirror->base, code);
+			} else {
+				warnx("Mirror '%s' is unhealthy: %s", mirror->base, curl_easy_strerror(message->data.result));
+			}
+
+			curl_multi_remove_handle(multi, easy);
+			curl_easy_cleanup(easy);
+		}
+	} while (still_running != 0);
+
+	curl_multi_cleanup(multi);
+}
+
+/*
+ * Loads cached probe scores, returns false if they predate the mirrors file or do not cover every mirror.
+ * Whether they are outdated is stored in expiredp.
+ */
+static bool
+storage_mirrors_probe_load(const char *probe, const struct stat *mirrors_st, bool *expiredp) {
+	FILE * const filep = fopen(probe, "r");
+	unsigned int scored = 0;
+	char base[4096];
+	int64_t score;
+	struct stat st;
+
+	if (filep == NULL) {
+		return false;
+	}
+
+	if (fstat(fileno(filep), &st) != 0
+		|| st.st_mtime < mirrors_st->st_mtime) {
+		fclose(filep);
+		return false;
+	}
+
+	*expiredp = time(NULL) - st.st_mtime >= STORAGE_MIRRORS_PROBE_MAX_AGE;
+
+	while (fscanf(filep, "%" SCNd64 " %4095s", &score, base) == 2) {
+		for (unsigned int i = 0; i < storage.mirrors_count; i++) {
+			if (strcmp(storage.mirrors[i].base, base) == 0) {
+				storage.mirrors[i].score = score;
+				scored++;
+				break;
+			}
+		}
+	}
+
+	fclose(filep);
+
+	return scored == storage.mirrors_count;
+}
+
+static void
+storage_mirrors_probe_save(const char *probe) {
+	FILE * const filep = fopen(probe, "w");
+
+	if (filep == NULL) {
+		warn("fopen '%s'", probe);
+		return;
+	}
+
+	for (unsigned int i = 0; i < storage.mirrors_count; i++) {
+		fprintf(filep, "%" PRId64 " %s\n", storage.mirrors[i].score, storage.mirrors[i].base);
+	}
+
+	if (fclose(filep) != 0) {
+		warn("fclose '%s'", probe);
+	}
+}
+
+static int
+storage_mirror_compare(const void *lhs, const void *rhs) {
+	const struct storage_mirror * const lmirror = lhs, * const rmirror = rhs;
+
+	/* Healthy mirrors first, fastest first. */
+	if ((lmirror->score < 0) != (rmirror->score < 0)) {
+		return lmirror->score < 0 ? 1 : -1;
+	}
+
+	return (lmirror->score > rmirror->score) - (lmirror->score < rmirror->score);
+}
+
+/*
+ * Loads the mirrors of the data directory, one base URL per line,
+ * and ranks them by the time they take to serve probe_url.
+ */
+void
+storage_mirrors_setup(const char *probe_url, bool stale) {
+	char *path, *probe, *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	struct stat st;
+
+	if (asprintf(&path, "%s" STORAGE_DATA_MIRRORS_FILE, storage.path) < 0
+		|| asprintf(&probe, "%s" STORAGE_DATA_MIRRORS_PROBE_FILE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	FILE * const filep = fopen(path, "r");
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen '%s'", path);
+		}
+		free(probe);
+		free(path);
+		return;
+	}
+
+	while (length = getline(&line, &capacity, filep), length >= 0) {
+		char *base = line;
+
+		while (isspace((unsigned char)*base)) {
+			base++;
+		}
+
+		while (length > 0 && isspace((unsigned char)line[length - 1])) {
+			line[--length] = '\0';
+		}
+
+		/* Paths are appended to the base, which must not end with a slash. */
+		while (length > 0 && line[length - 1] == '/') {
+			line[--length] = '\0';
+		}
+
+		if (*base == '\0' || *base == '#') {
+			continue;
+		}
+
+		if (strncmp(base, "https://", 8) != 0 && strncmp(base, "http://", 7) != 0) {
+			errx(EXIT_FAILURE, "Mirror '%s' in '%s' is not an HTTP(S) URL", base, path);
+		}
+
+		struct storage_mirror * const mirrors = realloc(storage.mirrors,
+			(storage.mirrors_count + 1) * sizeof (*mirrors));
+		if (mirrors == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		mirrors[storage.mirrors_count++] = (struct storage_mirror) {
+			.base = strdup(base),
+			.score = -1,
+		};
+		storage.mirrors = mirrors;
+	}
+
+	if (fstat(fileno(filep), &st) != 0) {
+		err(EXIT_FAILURE, "fstat '%s'", path);
+	}
+
+	fclose(filep);
+	free(line);
+
+	if (storage.mirrors_count != 0) {
+		/* Single-flight, concurrent processes reuse the probe of the first one. */
+		const int lock = storage_lock(probe, true);
+		bool expired = false;
+
+		if (!storage_mirrors_probe_load(probe, &st, &expired) || (expired && !stale)) {
+			storage_mirrors_probe(probe_url);
+			storage_mirrors_probe_save(probe);
+			expired = false;
+		}
+
+		storage_unlock(lock);
+
+		/* Outdated scores are good enough, probe again from a detached process for the next invocation. */
+		if (expired && storage_detach()) {
+			const int detached_lock = storage_lock(probe, false);
+
+			if (detached_lock >= 0) {
+				storage_mirrors_probe(probe_url);
+				storage_mirrors_probe_save(probe);
+			}
+
+			exit(EXIT_SUCCESS);
+		}
+
+		qsort(storage.mirrors, storage.mirrors_count, sizeof (*storage.mirrors), storage_mirror_compare);
+
+		for (unsigned int i = 0; i < storage.mirrors_count; i++) {
+			storage.mirrors[i].failed = storage.mirrors[i].score < 0;
+		}
+
+		while (storage.mirror < storage.mirrors_count && storage.mirrors[storage.mirror].failed) {
+			storage.mirror++;
+		}
+	}
+
+	/* NB: storage.mirrors leak, they are used as long as the process. */
+	free(probe);
+	free(path);
+}
+
+static uint64_t
+storage_monotonic_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int
+storage_fetch_backoff(unsigned int attempts) {
+	const unsigned int backoff = STORAGE_FETCH_BACKOFF_MS << (attempts - 1);
+
+	return backoff < STORAGE_FETCH_BACKOFF_MAX_MS ? backoff : STORAGE_FETCH_BACKOFF_MAX_MS;
+}
+
+/* Whether a failed transfer is worth another attempt. */
+static bool
+storage_fetch_retryable(CURL *easy, CURLcode res) {
+	switch (res) {
+	case CURLE_HTTP_RETURNED_ERROR: {
+		long code;
+
+		curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+
+		return code == 408 || code == 429 || code >= 500;
+	}
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Builds the conditional request headers from the validators
+ * of a previous fetch, if the fetched file is still around.
+ */
+static struct curl_slist *
+storage_fetch_validators_load(const char *path, const char *validators) {
+	struct curl_slist *headers = NULL;
+	FILE *filep;
+
+	if (access(path, R_OK) != 0 || (filep = fopen(validators, "r")) == NULL) {
+		return NULL;
+	}
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	while (length = getline(&line, &capacity, filep), length > 0) {
+		if (line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		if (strncmp(line, "If-None-Match: ", 15) == 0
+			|| strncmp(line, "If-Modified-Since: ", 19) == 0) {
+			headers = curl_slist_append(headers, line);
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return headers;
+}
+
+static void
+storage_fetch_validators_save(const char *validators, CURL *easy) {
+	static const char * const names[][2] = {
+		{ "ETag", "If-None-Match" },
+		{ "Last-Modified", "If-Modified-Since" },
+	};
+	FILE * const filep = fopen(validators, "w");
+	bool empty = true;
+
+	if (filep == NULL) {
+		warn("fopen '%s'", validators);
+		return;
+	}
+
+	for (unsigned int i = 0; i < sizeof (names) / sizeof (*names); i++) {
+		struct curl_header *header;
+
+		/* NB: A header is only valid until the next curl_easy_header. */
+		if (curl_easy_header(easy, names[i][0], 0, CURLH_HEADER, -1, &header) == CURLHE_OK) {
+			fprintf(filep, "%s: %s\n", names[i][1], header->value);
+			empty = false;
+		}
+	}
+
+	if (fclose(filep) != 0) {
+		warn("fclose '%s'", validators);
+	}
+
+	if (empty) {
+		unlink(validators);
+	}
+}
+
+/*
+ * Fetches url in path, revalidating what path already holds. Nothing verifies
+ * what is fetched, so it always comes from the origin, never from mirrors.
+ * Returns false if the transfer failed, which was already reported.
+ */
+bool
+storage_fetch(const char *path, const char *url) {
+	char *temporary, *validators;
+	struct stat previous, current;
+
+	/*
+	 * Single-flight, a process refreshing path makes the others wait for it.
+	 * If path was replaced or revalidated in the meantime, its result is reused.
+	 */
+	const bool existed = stat(path, &previous) == 0;
+	const int lock = storage_lock(path, true);
+
+	if (stat(path, &current) == 0 && (!existed
+		|| current.st_ino != previous.st_ino || current.st_mtime != previous.st_mtime)) {
+		storage_unlock(lock);
+		return true;
+	}
+
+	/* Download in a temporary file, so an existing file survives failures. */
+	if (asprintf(&temporary, "%s.XXXXXX", path) < 0
+		|| asprintf(&validators, "%s" STORAGE_FETCH_VALIDATORS_SUFFIX, path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const int fd = mkstemp(temporary);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "mkstemp '%s'", temporary);
+	}
+
+	FILE * const filep = fdopen(fd, "w");
+	CURL * const easy = storage_transfer_open(url, false);
+
+	if (filep == NULL) {
+		unlink(temporary);
+		err(EXIT_FAILURE, "fdopen '%s'", temporary);
+	}
+
+	/* mkstemp creates private files, the fetched file is not. */
+	if (fchmod(fd, 0644) != 0) {
+		warn("fchmod '%s'", temporary);
+	}
+
+	/* Revalidate what we already have, the server only answers with what changed. */
+	struct curl_slist * const headers = storage_fetch_validators_load(path, validators);
+
+	curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, (long)STORAGE_FETCH_LOW_SPEED_LIMIT);
+	curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, (long)STORAGE_FETCH_LOW_SPEED_TIME);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, fwrite);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, filep);
+
+	unsigned int attempts = 0;
+	CURLcode res;
+
+	while (res = curl_easy_perform(easy), trace_transfer("fetch", easy), res != CURLE_OK) {
+
+		if (attempts < STORAGE_FETCH_RETRIES && storage_fetch_retryable(easy, res)) {
+			const unsigned int backoff = storage_fetch_backoff(++attempts);
+
+			warnx("curl_easy_perform '%s': %s, retrying in %ums", url, curl_easy_strerror(res), backoff);
+			usleep(backoff * 1000);
+		} else {
+			break;
+		}
+
+		/* Restart from scratch, there is no known digest to validate a resume. */
+		if (fflush(filep) != 0 || ftruncate(fd, 0) != 0 || fseek(filep, 0, SEEK_SET) != 0) {
+			unlink(temporary);
+			err(EXIT_FAILURE, "truncate '%s'", temporary);
+		}
+	}
+
+	long code = 0;
+	if (res == CURLE_OK) {
+		curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+	}
+
+	if (res != CURLE_OK) {
+		warnx("curl_easy_perform '%s': %s", url, curl_easy_strerror(res));
+		fclose(filep);
+		unlink(temporary);
+		curl_easy_cleanup(easy);
+		curl_slist_free_all(headers);
+		storage_unlock(lock);
+		free(validators);
+		free(temporary);
+		return false;
+	}
+
+	if (fclose(filep) != 0) {
+		unlink(temporary);
+		err(EXIT_FAILURE, "fclose '%s'", temporary);
+	}
+
+	if (code == 304) {
+		/* Not modified, only refresh its freshness. */
+		unlink(temporary);
+
+		if (utimensat(AT_FDCWD, path, NULL, 0) != 0) {
+			warn("utimensat '%s'", path);
+		}
+	} else {
+		if (rename(temporary, path) != 0) {
+			unlink(temporary);
+			err(EXIT_FAILURE, "rename '%s'", path);
+		}
+
+		storage_fetch_validators_save(validators, easy);
+	}
+
+	curl_easy_cleanup(easy);
+	curl_slist_free_all(headers);
+	storage_unlock(lock);
+
+	free(validators);
+	free(temporary);
+
+	return true;
+}
+
+static inline uint8_t 
+hex2nibble(uint8_t hex) {
+       return isdigit(hex) ? hex - '0' : hex - 'a' + 10;
+}
+
+static void
+storage_sha1_parse(const char *sha1, uint8_t digest[static 20]) {
+
+	/* Hexadecimal string, two nibbles per byte. */
+	if (strlen(sha1) != 2 * 20) {
+		errx(EXIT_FAILURE, "Invalid SHA1 digest length for '%s'", sha1);
+	}
+
+	for (unsigned i = 0; i < 20; i++) {
+		const char high = sha1[2 * i], low = sha1[2 * i + 1];
+
+		if (!isxdigit(high) || !isxdigit(low)) {
+			errx(EXIT_FAILURE, "Invalid SHA1 digest '%s', expected a hexadecimal string", sha1);
+		}
+
+		digest[i] = hex2nibble(high) << 4 | hex2nibble(low);
+	}
+}
+
+bool
+storage_store(const char *path, const void *data, size_t size) {
+	/* Write in a temporary file, renamed so readers never see a partial file. */
+	char *temporary;
+
+	if (asprintf(&temporary, "%s.XXXXXX", path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const int fd = mkstemp(temporary);
+	if (fd < 0) {
+		warn("mkstemp '%s'", temporary);
+		free(temporary);
+		return false;
+	}
+
+	const bool stored = write(fd, data, size) == (ssize_t)size
+		&& fchmod(fd, 0444) == 0
+		&& close(fd) == 0
+		&& rename(temporary, path) == 0;
+
+	if (!stored) {
+		warn("store '%s'", path);
+		unlink(temporary);
+	}
+
+	free(temporary);
+
+	return stored;
+}
+
+bool
+storage_store_verified(const char *path, const void *data, size_t size, const char *sha1) {
+	uint8_t expected_digest[20], digest[EVP_MAX_MD_SIZE];
+	unsigned int digestsz;
+
+	storage_sha1_parse(sha1, expected_digest);
+
+	if (EVP_Digest(data, size, digest, &digestsz, EVP_sha1(), NULL) != 1
+		|| digestsz != sizeof (expected_digest)
+		|| memcmp(digest, expected_digest, digestsz) != 0) {
+		warnx("Incoherent digest for '%s'!", strrchr(path, '/') + 1);
+		return false;
+	}
+
+	return storage_store(path, data, size);
+}
+
+struct storage_download_segment {
+	struct storage_download *download;
+	CURL *easy;
+	size_t offset, end;
+	unsigned int attempts;
+	uint64_t retry_at;
+	bool ranged, started;
+
+	/*
+	 * Received bytes are gathered in batch, ending at offset, while the
+	 * previous batch is written from spare. Bytes before written reached the file.
+	 */
+	uint8_t *batch, *spare;
+	size_t batch_size, spare_offset, spare_size, written;
+	bool writing;
+	struct storage_download_segment *queued;
+};
+
+struct storage_download {
+	const char *path;
+	char *part, *info, *url;
+	char sha1[41];
+	int fd;
+	EVP_MD_CTX *ctx;
+	size_t size, expected_size;
+	uint8_t expected_digest[20];
+	bool interactive, unranged, failed;
+	atomic_int write_errno;
+	uint64_t saved_at, opened_at;
+	/* Throughput is measured from started_at, where started_size bytes were already there. */
+	uint64_t started_at, rendered_at, streamed_at;
+	size_t started_size;
+
+	struct storage_download_segment *segments, *stream;
+	unsigned int segments_count, running;
+	void *private;
+};
+
+void
+storage_progress_setup(const char *path) {
+
+	storage.progress = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (storage.progress < 0) {
+		err(EXIT_FAILURE, "open '%s'", path);
+	}
+}
+
+/* Bytes per second downloaded since the download started, resumed bytes excluded. */
+static uint64_t
+storage_download_rate(const struct storage_download *download, uint64_t now) {
+	const uint64_t elapsed = now - download->started_at;
+
+	if (elapsed == 0 || download->size < download->started_size) {
+		return 0;
+	}
+
+	return (download->size - download->started_size) * 1000 / elapsed;
+}
+
+static void
+storage_download_progress_render(const struct storage_download *download, uint64_t now) {
+	const char * const name = strrchr(download->path, '/') + 1;
+	const size_t namesz = strlen(name);
+	const uint64_t rate = storage_download_rate(download, now);
+	char stats[64] = "";
+
+	if (rate != 0) {
+		const uint64_t eta = (download->expected_size - download->size) / rate;
+
+		snprintf(stats, sizeof (stats), " %" PRIu64 ".%" PRIu64 "MiB/s %" PRIu64 ":%02" PRIu64,
+			rate >> 20, (rate & ((1 << 20) - 1)) * 10 >> 20, eta / 60, eta % 60);
+	}
+
+	/* Throughput and ETA are only shown if the terminal is wide enough. */
+	if (namesz + 4 + strlen(stats) > storage.ws.ws_col) { /* 4 == strlen(" []\r") */
+		*stats = '\0';
+	}
+
+	const size_t gap = storage.ws.ws_col - namesz - 4 - strlen(stats);
+	size_t filled = 0;
+
+	/* Segments report their own progress, use the whole download's instead. */
+	if (download->expected_size != 0) {
+		filled = download->size * gap / download->expected_size;
+	}
+
+	fputs(name, stdout);
+	fputs(" [", stdout);
+	for (size_t i = 0; i < gap; i++) {
+		putchar(i < filled ? '=' : ' ');
+	}
+	printf("]%s\r", stats);
+
+	fflush(stdout);
+}
+
+static void
+storage_download_progress_stream(const struct storage_download *download, uint64_t now, const char *state) {
+	struct json_object * const event = json_object_new_object();
+	const uint64_t rate = storage_download_rate(download, now);
+
+	json_object_object_add(event, "pid", json_object_new_int64(getpid()));
+	json_object_object_add(event, "state", json_object_new_string(state));
+	json_object_object_add(event, "path", json_object_new_string(download->path));
+	json_object_object_add(event, "url", json_object_new_string(download->url));
+	json_object_object_add(event, "bytes", json_object_new_int64(download->size));
+	json_object_object_add(event, "total", json_object_new_int64(download->expected_size));
+	json_object_object_add(event, "elapsed_ms", json_object_new_int64(now - download->started_at));
+	json_object_object_add(event, "bytes_per_second", json_object_new_int64(rate));
+	if (rate != 0 && download->size < download->expected_size) {
+		json_object_object_add(event, "eta_ms",
+			json_object_new_int64((download->expected_size - download->size) * 1000 / rate));
+	}
+
+	const char * const json = json_object_to_json_string_ext(event, JSON_C_TO_STRING_PLAIN);
+	char *line;
+	const int length = asprintf(&line, "%s\n", json);
+
+	if (length < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	/* A single write, for concurrent and detached processes to share the stream. */
+	if (write(storage.progress, line, length) != length) {
+		warn("write progress");
+	}
+
+	free(line);
+	json_object_put(event);
+}
+
+/* Called on every libcurl progress tick of every segment, only a few are shown. */
+static int
+storage_download_progress(void *clientp,
+	curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+	struct storage_download * const download = clientp;
+	const uint64_t now = storage_monotonic_ms();
+
+	if (download->interactive && now - download->rendered_at >= STORAGE_PROGRESS_FRAME_MS) {
+		storage_download_progress_render(download, now);
+		download->rendered_at = now;
+	}
+
+	if (storage.progress >= 0 && now - download->streamed_at >= STORAGE_PROGRESS_EVENT_MS) {
+		storage_download_progress_stream(download, now, "downloading");
+		download->streamed_at = now;
+	}
+
+	return 0;
+}
+
+static int
+storage_download_batch_write(int fd, const uint8_t *data, size_t size, size_t offset) {
+
+	while (size != 0) {
+		const ssize_t written = pwrite(fd, data, size, offset);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+
+		data += written;
+		size -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+/* Records the outcome of the spare batch of a segment, with the writer mutex held. */
+static void
+storage_download_batch_written(struct storage_download_segment *segment, int errcode) {
+	struct storage_download * const download = segment->download;
+
+	if (errcode == 0) {
+		segment->written = segment->spare_offset + segment->spare_size;
+	} else if (download->write_errno == 0) {
+		download->write_errno = errcode;
+	}
+
+	segment->writing = false;
+	pthread_cond_broadcast(&storage_writer.written);
+}
+
+static void *
+storage_writer_worker(void *unused) {
+
+	pthread_mutex_lock(&storage_writer.mutex);
+
+	while (true) {
+		while (storage_writer.head == NULL) {
+			pthread_cond_wait(&storage_writer.queued, &storage_writer.mutex);
+		}
+
+		struct storage_download_segment * const segment = storage_writer.head;
+
+		storage_writer.head = segment->queued;
+		if (storage_writer.head == NULL) {
+			storage_writer.tail = &storage_writer.head;
+		}
+
+		pthread_mutex_unlock(&storage_writer.mutex);
+
+		const int errcode = storage_download_batch_write(segment->download->fd,
+			segment->spare, segment->spare_size, segment->spare_offset);
+
+		pthread_mutex_lock(&storage_writer.mutex);
+		storage_download_batch_written(segment, errcode);
+	}
+
+	return NULL;
+}
+
+/* Starts the writers once, batches are written synchronously if none could be. */
+static void
+storage_writers_start(void) {
+
+	if (storage_writer.started) {
+		return;
+	}
+	storage_writer.started = true;
+
+	for (unsigned int i = 0; i < STORAGE_WRITE_THREADS; i++) {
+		pthread_t writer;
+
+		if (pthread_create(&writer, NULL, storage_writer_worker, NULL) != 0) {
+			break;
+		}
+
+		/* NB: Writers live as long as the process. */
+		pthread_detach(writer);
+		storage_writer.threads++;
+	}
+}
+
+/* Hands the batch of a segment to the writers, once its previous one is written. */
+static void
+storage_download_batch_submit(struct storage_download_segment *segment) {
+	struct storage_download * const download = segment->download;
+
+	pthread_mutex_lock(&storage_writer.mutex);
+
+	while (segment->writing) {
+		pthread_cond_wait(&storage_writer.written, &storage_writer.mutex);
+	}
+
+	uint8_t * const batch = segment->spare;
+
+	segment->spare = segment->batch;
+	segment->spare_offset = segment->offset - segment->batch_size;
+	segment->spare_size = segment->batch_size;
+	segment->batch = batch;
+	segment->batch_size = 0;
+	segment->writing = true;
+
+	if (storage_writer.threads != 0) {
+		segment->queued = NULL;
+		*storage_writer.tail = segment;
+		storage_writer.tail = &segment->queued;
+		pthread_cond_signal(&storage_writer.queued);
+	} else {
+		storage_download_batch_written(segment, storage_download_batch_write(download->fd,
+			segment->spare, segment->spare_size, segment->spare_offset));
+	}
+
+	pthread_mutex_unlock(&storage_writer.mutex);
+}
+
+/* Gathers received bytes in the batch of a segment, submitting it once it reaches an aligned end. */
+static void
+storage_download_batch_push(struct storage_download_segment *segment, const uint8_t *data, size_t count) {
+	struct storage_download * const download = segment->download;
+	const size_t capacity = download->expected_size < STORAGE_WRITE_BATCH_SIZE
+		? download->expected_size : STORAGE_WRITE_BATCH_SIZE;
+
+	while (count != 0) {
+		if (segment->batch == NULL) {
+			segment->batch = malloc(capacity);
+			segment->spare = malloc(capacity);
+			if (segment->batch == NULL || segment->spare == NULL) {
+				err(EXIT_FAILURE, "malloc");
+			}
+		}
+
+		const size_t start = segment->offset - segment->batch_size;
+		const size_t room = capacity - start % capacity - segment->batch_size;
+		const size_t length = count < room ? count : room;
+
+		memcpy(segment->batch + segment->batch_size, data, length);
+		segment->batch_size += length;
+		segment->offset += length;
+		data += length;
+		count -= length;
+
+		if (length == room) {
+			storage_download_batch_submit(segment);
+		}
+	}
+}
+
+/* Submits what remains of every batch of a download, and waits for all of them to be written. */
+static void
+storage_download_flush(struct storage_download *download) {
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		if (download->segments[i].batch_size != 0) {
+			storage_download_batch_submit(&download->segments[i]);
+		}
+	}
+
+	pthread_mutex_lock(&storage_writer.mutex);
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		while (download->segments[i].writing) {
+			pthread_cond_wait(&storage_writer.written, &storage_writer.mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&storage_writer.mutex);
+}
+
+static void storage_download_part_save(const struct storage_download *download);
+
+static size_t
+storage_download_write(const void *data,
+	size_t one, size_t count, struct storage_download_segment *segment) {
+	struct storage_download * const download = segment->download;
+
+	if (!segment->started) {
+		long code;
+
+		curl_easy_getinfo(segment->easy, CURLINFO_RESPONSE_CODE, &code);
+		segment->started = true;
+
+		if (segment->ranged && code != 206) {
+			/* Range not honoured, only the segment starting at zero can go on, as a single stream. */
+			download->unranged = true;
+			if (segment->offset == 0) {
+				segment->end = download->expected_size;
+				download->stream = segment;
+			}
+		}
+	}
+
+	if (download->unranged && segment != download->stream) {
+		return 0;
+	}
+
+	if (segment->offset + count > segment->end) {
+		warnx("Received more than expected for '%s'", download->path);
+		return 0;
+	}
+
+	/* A batch failed to be written, reported once the download is closed. */
+	if (download->write_errno != 0) {
+		return 0;
+	}
+
+	if (download->ctx != NULL) {
+		EVP_DigestUpdate(download->ctx, data, count);
+	}
+	storage_download_batch_push(segment, data, count);
+	download->size += count;
+
+	/* Record what was written so far, a killed download resumes from there instead of scratch. */
+	const uint64_t now = storage_monotonic_ms();
+	if (now - download->saved_at >= STORAGE_DOWNLOAD_PART_SAVE_MS) {
+		storage_download_part_save(download);
+		download->saved_at = now;
+	}
+
+	return count;
+}
+
+static void
+storage_download_segment_start(struct storage_download_segment *segment, CURLM *multi) {
+	struct storage_download * const download = segment->download;
+	CURL * const easy = storage_transfer_open(download->url, true);
+
+	/* HTTP/2 would multiplex segments on a single connection, defeating their purpose. */
+	if (download->segments_count > 1) {
+		curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+	}
+
+	curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, (long)STORAGE_FETCH_LOW_SPEED_LIMIT);
+	curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, (long)STORAGE_FETCH_LOW_SPEED_TIME);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, storage_download_write);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, segment);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, download->private);
+
+	/* Anything but the whole archive, be it a segment or a resume, is a range. */
+	segment->ranged = segment->offset != 0 || segment->end != download->expected_size;
+	if (segment->ranged) {
+		char range[64];
+
+		snprintf(range, sizeof (range), "%zu-%zu", segment->offset, segment->end - 1);
+		curl_easy_setopt(easy, CURLOPT_RANGE, range);
+	}
+
+	if (download->interactive || storage.progress >= 0) {
+		curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, storage_download_progress);
+		curl_easy_setopt(easy, CURLOPT_XFERINFODATA, download);
+		curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+	}
+
+	segment->easy = easy;
+	segment->started = false;
+	segment->retry_at = 0;
+
+	curl_multi_add_handle(multi, easy);
+}
+
+static void
+storage_download_segments_push(struct storage_download *download, size_t offset, size_t end) {
+	struct storage_download_segment * const segments = realloc(download->segments,
+		(download->segments_count + 1) * sizeof (*segments));
+
+	if (segments == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	segments[download->segments_count++] = (struct storage_download_segment) {
+		.download = download,
+		.offset = offset,
+		.end = end,
+		.written = offset,
+	};
+
+	download->segments = segments;
+}
+
+/*
+ * Reloads the remaining ranges of a previous partial download.
+ * Returns false if there is none, or if it was for another archive.
+ */
+static bool
+storage_download_part_load(struct storage_download *download) {
+	FILE * const filep = fopen(download->info, "r");
+	char sha1[sizeof (download->sha1)];
+	size_t size, offset, end;
+
+	if (filep == NULL) {
+		return false;
+	}
+
+	if (fscanf(filep, "%40s %zu", sha1, &size) != 2
+		|| strcmp(sha1, download->sha1) != 0 || size != download->expected_size) {
+		fclose(filep);
+		return false;
+	}
+
+	while (fscanf(filep, "%zu %zu", &offset, &end) == 2) {
+		if (offset > end || end > size) {
+			download->segments_count = 0;
+			break;
+		}
+
+		if (offset != end) {
+			storage_download_segments_push(download, offset, end);
+		}
+	}
+
+	fclose(filep);
+
+	return download->segments_count != 0;
+}
+
+static void
+storage_download_part_save(const struct storage_download *download) {
+	FILE * const filep = fopen(download->info, "w");
+
+	if (filep == NULL) {
+		warn("fopen '%s'", download->info);
+		return;
+	}
+
+	fprintf(filep, "%s %zu\n", download->sha1, download->expected_size);
+
+	/* Only what reached the file, batches being written are received again on resume. */
+	pthread_mutex_lock(&storage_writer.mutex);
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		const struct storage_download_segment * const segment = &download->segments[i];
+
+		fprintf(filep, "%zu %zu\n", segment->written, segment->end);
+	}
+
+	pthread_mutex_unlock(&storage_writer.mutex);
+
+	if (fclose(filep) != 0) {
+		warn("fclose '%s'", download->info);
+	}
+}
+
+struct storage_download *
+storage_download_open(const char *path, const char *url, const char *sha1,
+	size_t expected_size, unsigned int segments, bool interactive) {
+	struct storage_download * const download = malloc(sizeof (*download));
+
+	storage_sha1_parse(sha1, download->expected_digest);
+
+	/* Download server archive in a partial file, kept for a later resume on failure. */
+	if (asprintf(&download->part, "%s" STORAGE_DOWNLOAD_PART_SUFFIX, path) < 0
+		|| asprintf(&download->info, "%s" STORAGE_DOWNLOAD_PART_INFO_SUFFIX, path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	/* The part file is locked while we download in it, a concurrent download of the same file waits. */
+	while (true) {
+		struct stat opened, current;
+
+		download->fd = open(download->part, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (download->fd < 0) {
+			err(EXIT_FAILURE, "open '%s'", download->part);
+		}
+
+		if (flock(download->fd, LOCK_EX | LOCK_NB) != 0) {
+			if (errno != EWOULDBLOCK) {
+				err(EXIT_FAILURE, "flock '%s'", download->part);
+			}
+
+			warnx("Waiting for '%s', downloaded by another process", strrchr(path, '/') + 1);
+
+			while (flock(download->fd, LOCK_EX) != 0) {
+				if (errno != EINTR) {
+					err(EXIT_FAILURE, "flock '%s'", download->part);
+				}
+			}
+		}
+
+		/* A part completed while we waited was renamed, it is not ours to write anymore. */
+		if (fstat(download->fd, &opened) == 0 && stat(download->part, &current) == 0
+			&& opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+			break;
+		}
+
+		close(download->fd);
+	}
+
+	strcpy(download->sha1, sha1);
+	download->path = path;
+	download->url = strdup(url);
+	download->expected_size = expected_size;
+	download->interactive = interactive
+		&& strlen(strrchr(path, '/') + 1) + 4 <= storage.ws.ws_col; /* 4 == strlen(" []\r") */
+	download->unranged = false;
+	download->failed = false;
+	atomic_init(&download->write_errno, 0);
+	download->opened_at = trace_now();
+	download->segments = NULL;
+	download->segments_count = 0;
+	download->stream = NULL;
+	download->running = 0;
+
+	if (storage_download_part_load(download)) {
+		/* Resumed bytes were not seen, the whole file is digested once complete. */
+		download->ctx = NULL;
+	} else {
+		free(download->segments);
+		download->segments = NULL;
+		download->segments_count = 0;
+
+		if (ftruncate(download->fd, 0) != 0) {
+			err(EXIT_FAILURE, "ftruncate '%s'", download->part);
+		}
+
+		/* Never split below the minimal segment size, small archives are a single stream. */
+		if (segments > expected_size / STORAGE_DOWNLOAD_SEGMENT_MIN_SIZE) {
+			segments = expected_size / STORAGE_DOWNLOAD_SEGMENT_MIN_SIZE;
+		}
+
+		if (segments == 0) {
+			segments = 1;
+		}
+
+		for (unsigned int i = 0; i < segments; i++) {
+			storage_download_segments_push(download, expected_size / segments * i,
+				i + 1 == segments ? expected_size : expected_size / segments * (i + 1));
+		}
+
+		if (segments == 1) {
+			/* A single stream is digested on the fly. */
+			download->ctx = EVP_MD_CTX_new();
+			EVP_DigestInit_ex(download->ctx, EVP_sha1(), NULL);
+		} else {
+			/* Segments are written out of order, the whole file is digested once complete. */
+			download->ctx = NULL;
+		}
+
+		/* Allocate the whole file at once, instead of growing it batch after batch. */
+		const int errcode = posix_fallocate(download->fd, 0, expected_size);
+		if (errcode != 0 && errcode != EOPNOTSUPP && errcode != EINVAL) {
+			errno = errcode;
+			warn("posix_fallocate '%s'", download->part);
+		}
+	}
+
+	download->size = expected_size;
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		download->size -= download->segments[i].end - download->segments[i].offset;
+	}
+
+	/* Record what the part file is expected to become, in case we get interrupted. */
+	storage_download_part_save(download);
+	download->saved_at = storage_monotonic_ms();
+
+	/* First progress is shown on the first tick. */
+	download->started_at = download->saved_at;
+	download->started_size = download->size;
+	download->rendered_at = 0;
+	download->streamed_at = 0;
+
+	storage_writers_start();
+
+	return download;
+}
+
+void
+storage_download_start(struct storage_download *download, CURLM *multi, void *private) {
+
+	download->private = private;
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		storage_download_segment_start(&download->segments[i], multi);
+		download->running++;
+	}
+}
+
+long
+storage_download_retry(struct storage_download *download, CURLM *multi) {
+	const uint64_t now = storage_monotonic_ms();
+	long timeout = -1;
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		struct storage_download_segment * const segment = &download->segments[i];
+
+		if (segment->retry_at == 0) {
+			continue;
+		}
+
+		if (segment->retry_at <= now) {
+			storage_download_segment_start(segment, multi);
+		} else if (timeout < 0 || segment->retry_at - now < (uint64_t)timeout) {
+			timeout = segment->retry_at - now;
+		}
+	}
+
+	return timeout;
+}
+
+bool
+storage_download_finished(struct storage_download *download, CURLM *multi, CURL *easy, CURLcode res) {
+	struct storage_download_segment *segment = download->segments;
+
+	while (segment->easy != easy) {
+		segment++;
+	}
+
+	if (download->unranged && segment != download->stream) {
+		/* Aborted segments of a server not honouring ranges are expected failures. */
+		res = CURLE_OK;
+	} else if (res == CURLE_OK && segment->offset != segment->end) {
+		res = CURLE_PARTIAL_FILE;
+	}
+
+	trace_transfer("download.transfer", easy);
+
+	const bool failover = res != CURLE_OK && storage_mirror_failover(easy);
+	const bool retryable = res != CURLE_OK && storage_fetch_retryable(easy, res);
+
+	curl_easy_cleanup(easy);
+	segment->easy = NULL;
+
+	if (res != CURLE_OK) {
+		if (failover) {
+			/* Resume from another mirror right away, the digest is verified once complete anyway. */
+			segment->retry_at = storage_monotonic_ms();
+			return false;
+		}
+
+		if (retryable && segment->attempts < STORAGE_FETCH_RETRIES) {
+			const unsigned int backoff = storage_fetch_backoff(++segment->attempts);
+
+			warnx("Unable to download '%s': %s, retrying in %ums", download->url, curl_easy_strerror(res), backoff);
+			segment->retry_at = storage_monotonic_ms() + backoff;
+
+			return false;
+		}
+
+		warnx("Unable to download '%s': %s", download->url, curl_easy_strerror(res));
+		download->failed = true;
+	}
+
+	download->running--;
+
+	if (download->running == 0) {
+		storage_download_flush(download);
+	}
+
+	if (download->running == 0 && download->unranged && !download->failed) {
+		segment = download->segments;
+
+		if (download->stream == NULL) {
+			/* No segment could go on as a single stream, restart with one. */
+			download->segments_count = 1;
+			download->size = 0;
+			download->stream = segment;
+			segment->offset = 0;
+			segment->written = 0;
+			segment->end = download->expected_size;
+
+			/* Bytes digested so far are about to be rewritten. */
+			EVP_MD_CTX_free(download->ctx);
+			download->ctx = NULL;
+
+			storage_download_segment_start(segment, multi);
+			download->running++;
+		} else {
+			/* Aborted segments may have written some bytes, the stream rewrote them all. */
+			download->size = download->stream->offset;
+		}
+	}
+
+	return download->running == 0;
+}
+
+/* Digest a complete file at once, through a mapping to avoid copies. */
+static bool
+storage_download_digest(struct storage_download *download, uint8_t *digest, unsigned int *digestszp) {
+	if (download->size == 0) {
+		return EVP_Digest("", 0, digest, digestszp, EVP_sha1(), NULL) == 1;
+	}
+
+	void * const mapping = mmap(NULL, download->size, PROT_READ, MAP_PRIVATE, download->fd, 0);
+	if (mapping == MAP_FAILED) {
+		warn("mmap '%s'", download->part);
+		return false;
+	}
+
+	madvise(mapping, download->size, MADV_SEQUENTIAL);
+
+	const uint64_t start = trace_now();
+	const int success = EVP_Digest(mapping, download->size, digest, digestszp, EVP_sha1(), NULL);
+
+	trace_phase("download.digest", download->path, start, download->size);
+	munmap(mapping, download->size);
+
+	return success == 1;
+}
+
+bool
+storage_download_close(struct storage_download *download) {
+	const char * const name = strrchr(download->path, '/') + 1;
+	bool valid = false, resumable = false;
+
+	storage_download_flush(download);
+
+	/* Last frame shows where the download ended, not where the last tick was. */
+	if (download->interactive) {
+		storage_download_progress_render(download, storage_monotonic_ms());
+		fputc('\n', stdout);
+	}
+
+	if (download->write_errno != 0) {
+		errno = download->write_errno;
+		warn("pwrite '%s'", download->part);
+	} else if (download->failed) {
+		/* Already reported, keep what was downloaded for a later attempt. */
+		resumable = true;
+	} else if (download->size != download->expected_size) {
+		warnx("Incoherent size for downloaded archive '%s'!", name);
+	} else {
+		/* Verify server archive signature. */
+		uint8_t digest[EVP_MAX_MD_SIZE];
+		unsigned int digestsz;
+
+		if (download->ctx != NULL) {
+			EVP_DigestFinal_ex(download->ctx, digest, &digestsz);
+		} else if (!storage_download_digest(download, digest, &digestsz)) {
+			digestsz = 0;
+		}
+
+		if (sizeof (download->expected_digest) != digestsz
+			|| memcmp(digest, download->expected_digest, digestsz) != 0) {
+			warnx("Incoherent digest for downloaded archive '%s'!", name);
+		} else {
+			valid = true;
+		}
+	}
+
+	if (close(download->fd) != 0) {
+		warn("close '%s'", download->part);
+		valid = false;
+	}
+
+	EVP_MD_CTX_free(download->ctx);
+
+	if (valid) {
+		/* Make the archive read only, and only then expose it under its final name. */
+		if (chmod(download->part, 0444) != 0) {
+			warn("chmod '%s'", download->part);
+		}
+
+		if (rename(download->part, download->path) != 0) {
+			warn("rename '%s'", download->path);
+			valid = false;
+		}
+	}
+
+	if (storage.progress >= 0) {
+		storage_download_progress_stream(download, storage_monotonic_ms(),
+			valid ? "done" : resumable ? "interrupted" : "failed");
+	}
+
+	/* From open to close, the throughput of the whole download. */
+	trace_phase(valid ? "download" : "download.failed", download->path, download->opened_at, download->size);
+
+	if (resumable && download->size != 0) {
+		storage_download_part_save(download);
+		warnx("Keeping partial download '%s' for a later resume", download->part);
+	} else {
+		if (!valid) {
+			unlink(download->part);
+		}
+		unlink(download->info);
+	}
+
+	for (unsigned int i = 0; i < download->segments_count; i++) {
+		free(download->segments[i].batch);
+		free(download->segments[i].spare);
+	}
+
+	free(download->segments);
+	free(download->part);
+	free(download->info);
+	free(download->url);
+	free(download);
+
+	return valid;
+}
+
+/* Modification time of a file to the nanosecond, named differently on macOS. */
+struct timespec
+storage_mtime(const struct stat *st) {
+#ifdef __APPLE__
+	return st->st_mtimespec;
+#else
+	return st->st_mtim;
+#endif
+}
+
+static bool
+storage_verify_record_matches(const struct storage_verify *archive, const struct stat *st,
+	const char *sha1, size_t size, uint64_t dev, uint64_t ino, int64_t mtime_sec, long mtime_nsec) {
+
+	const struct timespec mtime = storage_mtime(st);
+
+	return strcmp(sha1, archive->sha1) == 0 && size == archive->size
+		&& (size_t)st->st_size == size && dev == (uint64_t)st->st_dev && ino == (uint64_t)st->st_ino
+		&& mtime_sec == (int64_t)mtime.tv_sec && mtime_nsec == mtime.tv_nsec;
+}
+
+/*
+ * Marks archives whose integrity record still describes the file on disk.
+ * Records are lines of: id sha1 size dev ino mtime_sec mtime_nsec.
+ */
+static void
+storage_verify_records_load(const char *records, struct storage_verify *archives, size_t count) {
+	FILE * const filep = fopen(records, "r");
+	char id[NAME_MAX + 1], sha1[41];
+	size_t size;
+	uint64_t dev, ino;
+	int64_t mtime_sec;
+	long mtime_nsec;
+
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			warn("fopen '%s'", records);
+		}
+		return;
+	}
+
+	while (fscanf(filep, "%" STORAGE_STRINGIFY(NAME_MAX) "s %40s %zu %" SCNu64 " %" SCNu64 " %" SCNd64 " %ld",
+		id, sha1, &size, &dev, &ino, &mtime_sec, &mtime_nsec) == 7) {
+
+		for (size_t i = 0; i < count; i++) {
+			struct storage_verify * const archive = &archives[i];
+
+			if (archive->status == STORAGE_VERIFY_PENDING && strcmp(archive->id, id) == 0) {
+				if (storage_verify_record_matches(archive, &archive->st,
+					sha1, size, dev, ino, mtime_sec, mtime_nsec)) {
+					archive->status = STORAGE_VERIFY_RECORDED;
+				}
+				break;
+			}
+		}
+	}
+
+	fclose(filep);
+}
+
+static void
+storage_verify_records_save(const char *records, const struct storage_verify *archives, size_t count) {
+	char *temporary;
+
+	if (asprintf(&temporary, "%s.XXXXXX", records) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const int fd = mkstemp(temporary);
+	FILE *filep;
+
+	if (fd < 0 || (filep = fdopen(fd, "w")) == NULL) {
+		warn("mkstemp '%s'", temporary);
+		free(temporary);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const struct storage_verify * const archive = &archives[i];
+
+		if (archive->status == STORAGE_VERIFY_VALID || archive->status == STORAGE_VERIFY_RECORDED) {
+			const struct timespec mtime = storage_mtime(&archive->st);
+
+			fprintf(filep, "%s %s %zu %" PRIu64 " %" PRIu64 " %" PRId64 " %ld\n",
+				archive->id, archive->sha1, archive->size,
+				(uint64_t)archive->st.st_dev, (uint64_t)archive->st.st_ino,
+				(int64_t)mtime.tv_sec, mtime.tv_nsec);
+		}
+	}
+
+	if (fclose(filep) != 0 || rename(temporary, records) != 0) {
+		warn("write '%s'", records);
+		unlink(temporary);
+	}
+
+	free(temporary);
+}
+
+static void
+storage_verify_archive(struct storage_verify *archive) {
+	uint8_t expected_digest[20], digest[EVP_MAX_MD_SIZE];
+	unsigned int digestsz = 0;
+	char * const path = storage_archive_path(archive->id);
+	const uint64_t start = trace_now();
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	storage_sha1_parse(archive->sha1, expected_digest);
+	archive->status = STORAGE_VERIFY_INVALID;
+
+	if (fd < 0) {
+		warn("open '%s'", path);
+		free(path);
+		return;
+	}
+
+	if ((size_t)archive->st.st_size != archive->size) {
+		/* Not even worth reading. */
+	} else if (archive->size == 0) {
+		EVP_Digest("", 0, digest, &digestsz, EVP_sha1(), NULL);
+	} else {
+		void * const mapping = mmap(NULL, archive->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (mapping != MAP_FAILED) {
+			/* Advices are values, not flags, each is given on its own. */
+			madvise(mapping, archive->size, MADV_SEQUENTIAL);
+			madvise(mapping, archive->size, MADV_WILLNEED);
+			EVP_Digest(mapping, archive->size, digest, &digestsz, EVP_sha1(), NULL);
+			munmap(mapping, archive->size);
+		} else {
+			warn("mmap '%s'", path);
+		}
+	}
+
+	if (digestsz == sizeof (expected_digest)
+		&& memcmp(digest, expected_digest, digestsz) == 0) {
+		archive->status = STORAGE_VERIFY_VALID;
+	}
+
+	trace_phase("verify", path, start, archive->size);
+
+	close(fd);
+	free(path);
+}
+
+struct storage_verify_pool {
+	struct storage_verify *archives;
+	size_t count;
+	atomic_size_t next;
+};
+
+static void *
+storage_verify_worker(void *data) {
+	struct storage_verify_pool * const pool = data;
+	size_t i;
+
+	while (i = atomic_fetch_add(&pool->next, 1), i < pool->count) {
+		struct storage_verify * const archive = &pool->archives[i];
+
+		if (archive->status == STORAGE_VERIFY_PENDING) {
+			storage_verify_archive(archive);
+		}
+	}
+
+	return NULL;
+}
+
+size_t
+storage_archives_list(char ***idsp) {
+	char *directory;
+
+	if (asprintf(&directory, "%s" STORAGE_DATA_ARCHIVES_DIR, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	DIR * const dirp = opendir(directory);
+	char **ids = NULL;
+	size_t count = 0;
+
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "opendir '%s'", directory);
+		}
+		free(directory);
+		*idsp = NULL;
+		return 0;
+	}
+
+	const struct dirent *entry;
+	while (errno = 0, entry = readdir(dirp), entry != NULL) {
+		const size_t length = strlen(entry->d_name);
+
+		/* Only archives, neither hidden files nor partial downloads. */
+		if (*entry->d_name == '.' || length <= 4
+			|| strcmp(entry->d_name + length - 4, ".jar") != 0) {
+			continue;
+		}
+
+		ids = realloc(ids, (count + 1) * sizeof (*ids));
+		if (ids == NULL || (ids[count] = strndup(entry->d_name, length - 4)) == NULL) {
+			err(EXIT_FAILURE, "alloc");
+		}
+		count++;
+	}
+
+	if (errno != 0) {
+		err(EXIT_FAILURE, "readdir '%s'", directory);
+	}
+
+	closedir(dirp);
+	free(directory);
+
+	*idsp = ids;
+	return count;
+}
+
+void
+storage_verify_archives(struct storage_verify *archives, size_t count, unsigned int threads) {
+	char *records;
+
+	if (asprintf(&records, "%s" STORAGE_DATA_ARCHIVES_DIR STORAGE_DATA_VERIFIED_FILE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct storage_verify * const archive = &archives[i];
+		char * const path = storage_archive_path(archive->id);
+
+		if (archive->status == STORAGE_VERIFY_PENDING && stat(path, &archive->st) != 0) {
+			warn("stat '%s'", path);
+			archive->status = STORAGE_VERIFY_INVALID;
+		}
+
+		free(path);
+	}
+
+	/* Skip archives unchanged since their last verification. */
+	storage_verify_records_load(records, archives, count);
+
+	struct storage_verify_pool pool = {
+		.archives = archives,
+		.count = count,
+	};
+	pthread_t workers[STORAGE_VERIFY_THREADS_MAX];
+	unsigned int started = 0;
+
+	atomic_init(&pool.next, 0);
+
+	while (started < threads && started < STORAGE_VERIFY_THREADS_MAX && started < count
+		&& pthread_create(&workers[started], NULL, storage_verify_worker, &pool) == 0) {
+		started++;
+	}
+
+	/* Help the workers, or do it all if none could be started. */
+	storage_verify_worker(&pool);
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	storage_verify_records_save(records, archives, count);
+
+	free(records);
+}
+
+void
+storage_budget_setup(uint64_t budget) {
+	storage.budget = budget;
+}
+
+void
+storage_ca_bundle_setup(const char *path) {
+	storage.ca_bundle = path;
+}
+
+/* Sum of the sizes of the regular files of a directory, lock files being empty. */
+static uint64_t
+storage_directory_size(const char *directory) {
+	DIR * const dirp = opendir(directory);
+	uint64_t size = 0;
+
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			warn("opendir '%s'", directory);
+		}
+		return 0;
+	}
+
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		struct stat st;
+
+		if (fstatat(dirfd(dirp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+			size += st.st_size;
+		}
+	}
+
+	closedir(dirp);
+
+	return size;
+}
+
+static int
+storage_string_compare(const void *lhs, const void *rhs) {
+	return strcmp(*(char * const *)lhs, *(char * const *)rhs);
+}
+
+/*
+ * Removes libraries the classpath of no remaining archive refers to,
+ * once they have been stored for a while. Returns the bytes freed.
+ */
+static uint64_t
+storage_libraries_collect(const char *archives, const char *libraries) {
+	char **referenced = NULL, *line = NULL;
+	size_t count = 0, capacity = 0;
+	uint64_t freed = 0;
+
+	DIR *dirp = opendir(archives);
+	if (dirp == NULL) {
+		warn("opendir '%s'", archives);
+		return 0;
+	}
+
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		const size_t length = strlen(entry->d_name), suffixsz = sizeof (STORAGE_ARCHIVE_CLASSPATH_SUFFIX) - 1;
+
+		if (length <= suffixsz || strcmp(entry->d_name + length - suffixsz, STORAGE_ARCHIVE_CLASSPATH_SUFFIX) != 0) {
+			continue;
+		}
+
+		const int fd = openat(dirfd(dirp), entry->d_name, O_RDONLY | O_CLOEXEC);
+		FILE * const filep = fd >= 0 ? fdopen(fd, "r") : NULL;
+
+		if (filep == NULL) {
+			/* Unknown references, better keep every library. */
+			warn("Unable to read '%s%s'", archives, entry->d_name);
+			closedir(dirp);
+			goto end;
+		}
+
+		/* Main class first, then the classpath. */
+		if (getline(&line, &capacity, filep) > 0 && getline(&line, &capacity, filep) > 0) {
+			line[strcspn(line, "\n")] = '\0';
+
+			for (char *saveptr, *library = strtok_r(line, ":", &saveptr);
+				library != NULL; library = strtok_r(NULL, ":", &saveptr)) {
+				referenced = realloc(referenced, (count + 1) * sizeof (*referenced));
+				referenced[count++] = strdup(strrchr(library, '/') + 1);
+			}
+		}
+
+		fclose(filep);
+	}
+	closedir(dirp);
+
+	qsort(referenced, count, sizeof (*referenced), storage_string_compare);
+
+	dirp = opendir(libraries);
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			warn("opendir '%s'", libraries);
+		}
+		goto end;
+	}
+
+	const time_t now = time(NULL);
+	while (entry = readdir(dirp), entry != NULL) {
+		const char * const name = entry->d_name;
+		struct stat st;
+
+		if (*name == '.' || bsearch(&name, referenced, count, sizeof (*referenced), storage_string_compare) != NULL
+			|| fstatat(dirfd(dirp), name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)
+			|| now - st.st_mtime < STORAGE_LIBRARIES_GRACE) {
+			continue;
+		}
+
+		if (unlinkat(dirfd(dirp), name, 0) != 0) {
+			warn("unlink '%s%s'", libraries, name);
+		} else {
+			freed += st.st_size;
+		}
+	}
+	closedir(dirp);
+
+end:
+	for (size_t i = 0; i < count; i++) {
+		free(referenced[i]);
+	}
+	free(referenced);
+	free(line);
+
+	return freed;
+}
+
+struct storage_eviction {
+	char *id;
+	struct timespec used;
+};
+
+static int
+storage_eviction_compare(const void *lhs, const void *rhs) {
+	const struct timespec * const a = &((const struct storage_eviction *)lhs)->used;
+	const struct timespec * const b = &((const struct storage_eviction *)rhs)->used;
+
+	if (a->tv_sec != b->tv_sec) {
+		return (a->tv_sec > b->tv_sec) - (a->tv_sec < b->tv_sec);
+	}
+
+	return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+/* Ids listed in the pins file, one per line, an optional type prefix being ignored. */
+static size_t
+storage_pins_load(char ***pinsp) {
+	char *path, *line = NULL, **pins = NULL;
+	size_t capacity = 0, count = 0;
+	ssize_t length;
+
+	if (asprintf(&path, "%s" STORAGE_DATA_PINS_FILE, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	FILE * const filep = fopen(path, "r");
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen '%s'", path);
+		}
+		free(path);
+		*pinsp = NULL;
+		return 0;
+	}
+
+	while (length = getline(&line, &capacity, filep), length >= 0) {
+		char *id = line;
+
+		while (isspace((unsigned char)*id)) {
+			id++;
+		}
+
+		while (length > 0 && isspace((unsigned char)line[length - 1])) {
+			line[--length] = '\0';
+		}
+
+		if (*id == '\0' || *id == '#') {
+			continue;
+		}
+
+		if (strchr(id, '/') != NULL) {
+			id = strrchr(id, '/') + 1;
+		}
+
+		pins = realloc(pins, (count + 1) * sizeof (*pins));
+		pins[count++] = strdup(id);
+	}
+
+	fclose(filep);
+	free(line);
+	free(path);
+
+	*pinsp = pins;
+	return count;
+}
+
+/* Ids of the versions worlds were last launched on, recorded aside them. */
+static size_t
+storage_worlds_versions_load(char ***idsp) {
+	char *directory, **ids = NULL;
+	size_t count = 0;
+
+	if (asprintf(&directory, "%s" STORAGE_DATA_WORLDS_DIR, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	DIR * const dirp = opendir(directory);
+	if (dirp != NULL) {
+		const size_t suffixsz = sizeof (STORAGE_WORLD_VERSION_SUFFIX) - 1;
+		const struct dirent *entry;
+
+		while (entry = readdir(dirp), entry != NULL) {
+			const size_t length = strlen(entry->d_name);
+
+			if (*entry->d_name != '.' || length <= suffixsz + 1
+				|| strcmp(entry->d_name + length - suffixsz, STORAGE_WORLD_VERSION_SUFFIX) != 0) {
+				continue;
+			}
+
+			char *path, *id;
+			if (asprintf(&path, "%s%s", directory, entry->d_name) < 0) {
+				errx(EXIT_FAILURE, "asprintf");
+			}
+
+			id = storage_record_load(path);
+			if (id != NULL) {
+				ids = realloc(ids, (count + 1) * sizeof (*ids));
+				ids[count++] = id;
+			}
+
+			free(path);
+		}
+
+		closedir(dirp);
+	} else if (errno != ENOENT) {
+		warn("opendir '%s'", directory);
+	}
+
+	free(directory);
+
+	*idsp = ids;
+	return count;
+}
+
+/*
+ * Removes an archive and every file derived from it, except its lock file. Returns the bytes freed.
+ * An archive locked by another process, installing it or dumping its class data sharing archive, is kept.
+ */
+static uint64_t
+storage_archive_evict(const char *archives, const char *id) {
+	static const char * const suffixes[] = {
+		".jar", ".jar" STORAGE_ARCHIVE_USED_SUFFIX, STORAGE_ARCHIVE_CLASSPATH_SUFFIX, STORAGE_ARCHIVE_JAVA_SUFFIX,
+		/* The class data sharing archive, and the stamp of the JVM which dumped it. */
+		STORAGE_ARCHIVE_CDS_SUFFIX, STORAGE_ARCHIVE_CDS_SUFFIX ".jvm",
+		/* What is left of an interrupted download of the archive. */
+		".jar" STORAGE_DOWNLOAD_PART_SUFFIX, ".jar" STORAGE_DOWNLOAD_PART_INFO_SUFFIX,
+	};
+	char * const archive = storage_archive_path(id);
+	const int lock = storage_lock(archive, false);
+	uint64_t freed = 0;
+
+	if (lock < 0) {
+		warnx("Not evicting '%s' from store, locked by another process", id);
+		free(archive);
+		return 0;
+	}
+
+	warnx("Evicting '%s' from store, over its budget", id);
+
+	for (unsigned int i = 0; i < sizeof (suffixes) / sizeof (*suffixes); i++) {
+		struct stat st;
+		char *path;
+
+		if (asprintf(&path, "%s%s%s", archives, id, suffixes[i]) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+
+		if (stat(path, &st) == 0) {
+			if (unlink(path) != 0) {
+				warn("unlink '%s'", path);
+			} else {
+				freed += st.st_size;
+			}
+		}
+
+		free(path);
+	}
+
+	storage_unlock(lock);
+	free(archive);
+
+	return freed;
+}
+
+/*
+ * Evicts the least recently used archives until archives and libraries fit in the budget.
+ * Kept archives, those pinned, and those a world was last launched on are never evicted.
+ */
+void
+storage_archives_evict(const char * const *kept, size_t kept_count) {
+	char *archives, *libraries;
+
+	if (storage.budget == 0) {
+		return;
+	}
+
+	if (asprintf(&archives, "%s" STORAGE_DATA_ARCHIVES_DIR, storage.path) < 0
+		|| asprintf(&libraries, "%s" STORAGE_DATA_LIBRARIES_DIR, storage.path) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	/* Another process evicting is as good as us doing it. */
+	const int lock = storage_lock(archives, false);
+	if (lock < 0) {
+		free(libraries);
+		free(archives);
+		return;
+	}
+
+	uint64_t size = storage_directory_size(archives) + storage_directory_size(libraries);
+
+	if (size > storage.budget) {
+		char **ids, **pins, **worlds;
+		const size_t count = storage_archives_list(&ids);
+		const size_t pins_count = storage_pins_load(&pins);
+		const size_t worlds_count = storage_worlds_versions_load(&worlds);
+		struct storage_eviction * const evictions = calloc(count, sizeof (*evictions));
+		size_t evictions_count = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			bool protected = false;
+
+			for (size_t j = 0; !protected && j < kept_count; j++) {
+				protected = strcmp(ids[i], kept[j]) == 0;
+			}
+
+			for (size_t j = 0; !protected && j < pins_count; j++) {
+				protected = strcmp(ids[i], pins[j]) == 0;
+			}
+
+			for (size_t j = 0; !protected && j < worlds_count; j++) {
+				protected = strcmp(ids[i], worlds[j]) == 0;
+			}
+
+			if (protected) {
+				continue;
+			}
+
+			struct storage_eviction * const eviction = &evictions[evictions_count];
+			char * const archive = storage_archive_path(ids[i]), *used;
+			struct stat st;
+
+			if (asprintf(&used, "%s" STORAGE_ARCHIVE_USED_SUFFIX, archive) < 0) {
+				errx(EXIT_FAILURE, "asprintf");
+			}
+
+			/* Never used archives were last used when installed. */
+			if (stat(used, &st) == 0 || stat(archive, &st) == 0) {
+				eviction->used = storage_mtime(&st);
+				eviction->id = ids[i];
+				evictions_count++;
+			}
+
+			free(used);
+			free(archive);
+		}
+
+		qsort(evictions, evictions_count, sizeof (*evictions), storage_eviction_compare);
+
+		size -= storage_libraries_collect(archives, libraries);
+
+		for (size_t i = 0; i < evictions_count && size > storage.budget; i++) {
+			size -= storage_archive_evict(archives, evictions[i].id);
+			size -= storage_libraries_collect(archives, libraries);
+		}
+
+		if (size > storage.budget) {
+			warnx("Store exceeds its budget by %" PRIu64 "MiB, with only kept, pinned, worlds' or locked archives left",
+				(size - storage.budget + (1 << 20) - 1) >> 20);
+		}
+
+		for (size_t i = 0; i < worlds_count; i++) {
+			free(worlds[i]);
+		}
+		for (size_t i = 0; i < pins_count; i++) {
+			free(pins[i]);
+		}
+		for (size_t i = 0; i < count; i++) {
+			free(ids[i]);
+		}
+		free(evictions);
+		free(worlds);
+		free(pins);
+		free(ids);
 	}
+
+	storage_unlock(lock);
+	free(libraries);
+	free(archives);
 }
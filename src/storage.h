@@ -3,16 +3,119 @@
 #define STORAGE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <curl/curl.h>
+
+struct storage_download;
+
+struct storage_verify {
+	char *id;
+	/* Expected digest and size, from the version's package. */
+	const char *sha1;
+	size_t size;
+
+	enum {
+		STORAGE_VERIFY_PENDING,
+		STORAGE_VERIFY_RECORDED,
+		STORAGE_VERIFY_VALID,
+		STORAGE_VERIFY_INVALID,
+		STORAGE_VERIFY_UNKNOWN,
+	} status;
+
+	struct stat st;
+};
 
 char *storage_version_manifest_path(void);
 
+char *storage_version_manifest_index_path(void);
+
 char *storage_archive_path(const char *id);
 
+char *storage_package_path(const char *sha1);
+
+char *storage_library_path(const char *sha256);
+
+char *storage_runtimes_manifest_path(void);
+
+char *storage_runtime_manifest_path(const char *sha1);
+
+char *storage_runtime_object_path(const char *sha1, bool executable);
+
+char *storage_runtime_directory(const char *component);
+
 char *storage_world_directory(const char *world);
 
-void storage_fetch(const char *path, const char *url);
+char *storage_world_profile_load(const char *world);
+
+void storage_world_profile_save(const char *world, const char *profile);
+
+unsigned int storage_world_heap_load(const char *world);
+
+void storage_world_heap_save(const char *world, unsigned int heap);
+
+char *storage_archive_cds_path(const char *archive);
+
+char *storage_archive_classpath_path(const char *archive);
+
+bool storage_archive_java_load(const char *archive, char **componentp, char **javap);
+
+void storage_archive_java_save(const char *archive, const char *component, const char *java);
+
+void storage_archive_use(const char *archive, const char *world);
+
+char *storage_scratch_directory(void);
+
+void storage_remove(const char *path);
+
+struct timespec storage_mtime(const struct stat *st);
+
+void storage_copy_tree(const char *source, const char *destination);
+
+char *storage_supervise_socket_path(void);
+
+int storage_lock(const char *path, bool wait);
+
+void storage_unlock(int lock);
+
+bool storage_detach(void);
+
+CURL *storage_transfer_open(const char *url, bool verified);
+
+bool storage_mirror_failover(CURL *easy);
+
+void storage_mirrors_setup(const char *probe_url, bool stale);
+
+bool storage_store(const char *path, const void *data, size_t size);
+
+bool storage_store_verified(const char *path, const void *data, size_t size, const char *sha1);
+
+bool storage_fetch(const char *path, const char *url);
+
+void storage_progress_setup(const char *path);
+
+struct storage_download *storage_download_open(const char *path, const char *url, const char *sha1,
+	size_t expected_size, unsigned int segments, bool interactive);
+
+void storage_download_start(struct storage_download *download, CURLM *multi, void *private);
+
+long storage_download_retry(struct storage_download *download, CURLM *multi);
+
+bool storage_download_finished(struct storage_download *download, CURLM *multi, CURL *easy, CURLcode res);
+
+bool storage_download_close(struct storage_download *download);
+
+size_t storage_archives_list(char ***idsp);
+
+void storage_budget_setup(uint64_t budget);
+
+void storage_ca_bundle_setup(const char *path);
+
+void storage_archives_evict(const char * const *kept, size_t kept_count);
 
-void storage_fetch_and_verify(const char *path, const char *url, const char *sha1, size_t expected_size);
+void storage_verify_archives(struct storage_verify *archives, size_t count, unsigned int threads);
 
 /* STORAGE_H */
 #endif
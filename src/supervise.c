@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "supervise.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "jvm.h"
+
+/* Worlds are started apart, so their JIT warm-ups do not pile up. */
+#define SUPERVISE_STAGGER_MS 10000
+
+/* Crashed worlds are restarted with an exponential backoff. */
+#define SUPERVISE_BACKOFF_MS 1000
+#define SUPERVISE_BACKOFF_MAX_MS 300000
+
+/* A world running for this long is considered healthy, resetting its backoff. */
+#define SUPERVISE_HEALTHY_MS 60000
+
+/* Time left to a world to save itself after each stop request. */
+#define SUPERVISE_STOP_TIMEOUT_MS 120000
+
+static const char * const supervise_world_states[] = {
+	[SUPERVISE_WORLD_WAITING]  = "waiting",
+	[SUPERVISE_WORLD_RUNNING]  = "running",
+	[SUPERVISE_WORLD_STOPPING] = "stopping",
+	[SUPERVISE_WORLD_STOPPED]  = "stopped",
+};
+
+/* Self-pipe, signals are handled in the main loop. */
+static int supervise_signals[2];
+
+static uint64_t
+supervise_monotonic_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+supervise_signal(int signo) {
+	const unsigned char byte = signo;
+	const int errnum = errno;
+
+	/* NB: A full pipe drops the signal, there is already enough pending to wake up. */
+	(void)!write(supervise_signals[1], &byte, 1);
+
+	errno = errnum;
+}
+
+static void
+supervise_signals_setup(void) {
+	static const int signals[] = { SIGCHLD, SIGINT, SIGTERM, SIGHUP };
+	struct sigaction action = { .sa_handler = supervise_signal, .sa_flags = SA_RESTART };
+
+	if (pipe(supervise_signals) != 0) {
+		err(EXIT_FAILURE, "pipe");
+	}
+
+	for (unsigned int i = 0; i < 2; i++) {
+		fcntl(supervise_signals[i], F_SETFD, FD_CLOEXEC);
+		fcntl(supervise_signals[i], F_SETFL, O_NONBLOCK);
+	}
+
+	sigemptyset(&action.sa_mask);
+	for (unsigned int i = 0; i < sizeof (signals) / sizeof (*signals); i++) {
+		if (sigaction(signals[i], &action, NULL) != 0) {
+			err(EXIT_FAILURE, "sigaction");
+		}
+	}
+
+	/* Writes to the input of a dead world must not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+static int
+supervise_control_open(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof (addr.sun_path)) {
+		errx(EXIT_FAILURE, "Control socket path '%s' is too long", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0) {
+		err(EXIT_FAILURE, "socket");
+	}
+
+	/* A socket left behind by a dead supervisor refuses connections. */
+	if (connect(probe, (const struct sockaddr *)&addr, sizeof (addr)) == 0) {
+		errx(EXIT_FAILURE, "Another supervisor is listening on '%s'", path);
+	}
+	close(probe);
+
+	if (unlink(path) != 0 && errno != ENOENT) {
+		err(EXIT_FAILURE, "unlink '%s'", path);
+	}
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "socket");
+	}
+
+	if (bind(fd, (const struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		err(EXIT_FAILURE, "bind '%s'", path);
+	}
+
+	if (listen(fd, 8) != 0) {
+		err(EXIT_FAILURE, "listen '%s'", path);
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+/* Writes one line per world to a control client: name, state, pid, restarts and uptime in seconds. */
+static void
+supervise_control_accept(int listener, const struct supervise_world *worlds, size_t count, uint64_t now) {
+	const int fd = accept(listener, NULL, NULL);
+
+	if (fd < 0) {
+		warn("accept");
+		return;
+	}
+
+	FILE * const filep = fdopen(fd, "w");
+	if (filep == NULL) {
+		warn("fdopen");
+		close(fd);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const struct supervise_world * const world = &worlds[i];
+		const uint64_t uptime = world->state == SUPERVISE_WORLD_RUNNING ? (now - world->started_at) / 1000 : 0;
+
+		fprintf(filep, "%s %s %d %u %" PRIu64 "\n", world->name,
+			supervise_world_states[world->state], (int)world->pid, world->restarts, uptime);
+	}
+
+	fclose(filep);
+}
+
+static void
+supervise_world_start(struct supervise_world *world, uint64_t now) {
+	int fds[2];
+
+	if (pipe(fds) != 0) {
+		err(EXIT_FAILURE, "pipe");
+	}
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		/* Own process group, terminal signals are left to the supervisor. */
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+
+		close(fds[1]);
+		if (fds[0] != STDIN_FILENO) {
+			if (dup2(fds[0], STDIN_FILENO) < 0) {
+				warn("dup2");
+				_exit(127);
+			}
+			close(fds[0]);
+		}
+
+		if (chdir(world->directory) != 0) {
+			warn("chdir '%s'", world->directory);
+			_exit(127);
+		}
+
+		execvp(*world->argv, world->argv);
+
+		warn("execvp %s", *world->argv);
+		_exit(127);
+	}
+
+	close(fds[0]);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	world->state = SUPERVISE_WORLD_RUNNING;
+	world->pid = pid;
+	world->input = fds[1];
+	world->started_at = now;
+
+	warnx("%s: Started with pid %d", world->name, (int)pid);
+}
+
+static void
+supervise_world_stop(struct supervise_world *world, uint64_t now) {
+	switch (world->state) {
+	case SUPERVISE_WORLD_WAITING:
+		world->state = SUPERVISE_WORLD_STOPPED;
+		break;
+	case SUPERVISE_WORLD_RUNNING:
+		/* The server saves its world before exiting on stop. */
+		if (write(world->input, "stop\n", 5) != 5) {
+			warn("%s: Unable to request stop", world->name);
+		}
+		world->state = SUPERVISE_WORLD_STOPPING;
+		world->signal = SIGTERM;
+		world->deadline = now + SUPERVISE_STOP_TIMEOUT_MS;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Escalates a stop the world did not honour in time, from a stop request to SIGTERM, then SIGKILL. */
+static void
+supervise_world_escalate(struct supervise_world *world, uint64_t now) {
+	warnx("%s: Still running after %us, sending %s", world->name,
+		SUPERVISE_STOP_TIMEOUT_MS / 1000, world->signal == SIGTERM ? "SIGTERM" : "SIGKILL");
+
+	kill(world->pid, world->signal);
+
+	world->signal = SIGKILL;
+	world->deadline = now + SUPERVISE_STOP_TIMEOUT_MS;
+}
+
+static void
+supervise_reap(struct supervise_world *worlds, size_t count, uint64_t now, bool stopping) {
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct supervise_world *world = worlds;
+
+		while (world != worlds + count && world->pid != pid) {
+			world++;
+		}
+
+		if (world == worlds + count) {
+			continue;
+		}
+
+		close(world->input);
+		world->input = -1;
+		world->pid = 0;
+
+		/* Restarts use the archive once in place, or dump it again. */
+		if (world->dump != NULL
+			&& jvm_cds_dump_finish(world->dump, world->argv, WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+			world->dump = NULL;
+		}
+
+		if (stopping || world->state == SUPERVISE_WORLD_STOPPING) {
+			world->state = SUPERVISE_WORLD_STOPPED;
+			warnx("%s: Stopped", world->name);
+			continue;
+		}
+
+		if (now - world->started_at >= SUPERVISE_HEALTHY_MS || world->backoff == 0) {
+			world->backoff = SUPERVISE_BACKOFF_MS;
+		} else if (world->backoff < SUPERVISE_BACKOFF_MAX_MS / 2) {
+			world->backoff *= 2;
+		} else {
+			world->backoff = SUPERVISE_BACKOFF_MAX_MS;
+		}
+
+		if (WIFSIGNALED(status)) {
+			warnx("%s: Killed by signal %d, restarting in %ums", world->name, WTERMSIG(status), world->backoff);
+		} else {
+			warnx("%s: Exited with status %d, restarting in %ums", world->name, WEXITSTATUS(status), world->backoff);
+		}
+
+		world->state = SUPERVISE_WORLD_WAITING;
+		world->deadline = now + world->backoff;
+		world->restarts++;
+	}
+}
+
+noreturn void
+supervise(struct supervise_world *worlds, size_t count, const char *socket_path) {
+	supervise_signals_setup();
+
+	const int listener = supervise_control_open(socket_path);
+	uint64_t now = supervise_monotonic_ms();
+	bool stopping = false;
+
+	for (size_t i = 0; i < count; i++) {
+		struct supervise_world * const world = &worlds[i];
+
+		world->state = SUPERVISE_WORLD_WAITING;
+		world->pid = 0;
+		world->input = -1;
+		world->restarts = 0;
+		world->backoff = 0;
+		world->deadline = now + i * SUPERVISE_STAGGER_MS;
+	}
+
+	while (true) {
+		bool alive = false;
+		int timeout = -1;
+
+		now = supervise_monotonic_ms();
+
+		for (size_t i = 0; i < count; i++) {
+			struct supervise_world * const world = &worlds[i];
+
+			if (world->state == SUPERVISE_WORLD_WAITING && world->deadline <= now) {
+				supervise_world_start(world, now);
+			} else if (world->state == SUPERVISE_WORLD_STOPPING && world->deadline <= now) {
+				supervise_world_escalate(world, now);
+			}
+
+			if (world->state == SUPERVISE_WORLD_WAITING || world->state == SUPERVISE_WORLD_STOPPING) {
+				const uint64_t left = world->deadline - now;
+
+				if (timeout < 0 || left < (uint64_t)timeout) {
+					timeout = left < INT_MAX ? left : INT_MAX;
+				}
+			}
+
+			alive = alive || world->state != SUPERVISE_WORLD_STOPPED;
+		}
+
+		if (!alive) {
+			break;
+		}
+
+		struct pollfd fds[] = {
+			{ .fd = supervise_signals[0], .events = POLLIN },
+			{ .fd = listener, .events = POLLIN },
+		};
+
+		if (poll(fds, sizeof (fds) / sizeof (*fds), timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		now = supervise_monotonic_ms();
+
+		if (fds[0].revents & POLLIN) {
+			unsigned char signos[64];
+			ssize_t received;
+
+			while (received = read(supervise_signals[0], signos, sizeof (signos)), received > 0) {
+				for (ssize_t i = 0; i < received; i++) {
+					if (signos[i] == SIGCHLD) {
+						supervise_reap(worlds, count, now, stopping);
+					} else if (!stopping) {
+						warnx("Stopping all worlds");
+						stopping = true;
+						for (size_t j = 0; j < count; j++) {
+							supervise_world_stop(&worlds[j], now);
+						}
+					}
+				}
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			supervise_control_accept(listener, worlds, count, now);
+		}
+	}
+
+	close(listener);
+	unlink(socket_path);
+
+	exit(EXIT_SUCCESS);
+}
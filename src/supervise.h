@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef SUPERVISE_H
+#define SUPERVISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+#include <sys/types.h>
+
+struct jvm_cds_dump;
+
+struct supervise_world {
+	const char *name;
+	const char *directory;
+	/* Server command line, its first element being the jvm. */
+	char **argv;
+	/* Class data sharing archive the server dumps on exit, if any. */
+	struct jvm_cds_dump *dump;
+
+	enum {
+		SUPERVISE_WORLD_WAITING,
+		SUPERVISE_WORLD_RUNNING,
+		SUPERVISE_WORLD_STOPPING,
+		SUPERVISE_WORLD_STOPPED,
+	} state;
+
+	pid_t pid;
+	int input;
+	unsigned int restarts;
+	unsigned int backoff;
+	uint64_t started_at;
+	/* Next start when waiting, next stop escalation when stopping. */
+	uint64_t deadline;
+	int signal;
+};
+
+noreturn void supervise(struct supervise_world *worlds, size_t count, const char *socket_path);
+
+/* SUPERVISE_H */
+#endif
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+
+#include <json-c/json.h>
+
+/*
+ * Events are appended to the trace file as JSON lines, each in a single write,
+ * so concurrent and detached invocations can share a file. Times are
+ * in microseconds since the invocation started, bytes are -1 if unknown.
+ */
+static struct {
+	int fd;
+	uint64_t origin;
+} trace = {
+	.fd = -1,
+};
+
+static uint64_t
+trace_monotonic_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static struct json_object *
+trace_event(const char *phase, uint64_t start) {
+	struct json_object * const event = json_object_new_object();
+
+	json_object_object_add(event, "pid", json_object_new_int64(getpid()));
+	json_object_object_add(event, "phase", json_object_new_string(phase));
+	json_object_object_add(event, "start_us", json_object_new_int64(start));
+
+	return event;
+}
+
+static void
+trace_emit(struct json_object *event) {
+	const char * const json = json_object_to_json_string_ext(event, JSON_C_TO_STRING_PLAIN);
+	char *line;
+	const int length = asprintf(&line, "%s\n", json);
+
+	if (length < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	if (write(trace.fd, line, length) != length) {
+		warn("write trace");
+	}
+
+	free(line);
+	json_object_put(event);
+}
+
+void
+trace_setup(const char *path, int argc, char **argv) {
+	struct json_object *event, *arguments;
+	struct timespec now;
+
+	trace.origin = trace_monotonic_us();
+
+	trace.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (trace.fd < 0) {
+		err(EXIT_FAILURE, "open '%s'", path);
+	}
+
+	/* Wall clock time of the invocation, to correlate traces across hosts. */
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	event = trace_event("invocation", 0);
+	json_object_object_add(event, "realtime_us",
+		json_object_new_int64((int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000));
+
+	arguments = json_object_new_array();
+	for (int i = 0; i < argc; i++) {
+		json_object_array_add(arguments, json_object_new_string(argv[i]));
+	}
+	json_object_object_add(event, "argv", arguments);
+
+	trace_emit(event);
+}
+
+/* Current time of the invocation, zero if it is not traced. */
+uint64_t
+trace_now(void) {
+	return trace.fd >= 0 ? trace_monotonic_us() - trace.origin : 0;
+}
+
+void
+trace_phase(const char *phase, const char *subject, uint64_t start, int64_t bytes) {
+
+	if (trace.fd < 0) {
+		return;
+	}
+
+	struct json_object * const event = trace_event(phase, start);
+
+	json_object_object_add(event, "duration_us", json_object_new_int64(trace_now() - start));
+	if (subject != NULL) {
+		json_object_object_add(event, "subject", json_object_new_string(subject));
+	}
+	json_object_object_add(event, "bytes", json_object_new_int64(bytes));
+
+	trace_emit(event);
+}
+
+/*
+ * Traces a finished transfer, started total time ago according to libcurl.
+ * Its timings are cumulative since that start, as libcurl reports them.
+ */
+void
+trace_transfer(const char *phase, CURL *easy) {
+	static const struct {
+		const char *name;
+		CURLINFO info;
+	} timings[] = {
+		{ "dns_us", CURLINFO_NAMELOOKUP_TIME_T },
+		{ "connect_us", CURLINFO_CONNECT_TIME_T },
+		{ "tls_us", CURLINFO_APPCONNECT_TIME_T },
+		{ "first_byte_us", CURLINFO_STARTTRANSFER_TIME_T },
+	};
+	curl_off_t total, value;
+	long status, connects;
+	const char *url;
+
+	if (trace.fd < 0) {
+		return;
+	}
+
+	if (curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK) {
+		total = 0;
+	}
+
+	const uint64_t now = trace_now();
+	struct json_object * const event = trace_event(phase, now > (uint64_t)total ? now - total : 0);
+
+	json_object_object_add(event, "duration_us", json_object_new_int64(total));
+
+	if (curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url) == CURLE_OK && url != NULL) {
+		json_object_object_add(event, "subject", json_object_new_string(url));
+	}
+
+	if (curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &value) != CURLE_OK) {
+		value = -1;
+	}
+	json_object_object_add(event, "bytes", json_object_new_int64(value));
+
+	for (unsigned int i = 0; i < sizeof (timings) / sizeof (*timings); i++) {
+		if (curl_easy_getinfo(easy, timings[i].info, &value) == CURLE_OK) {
+			json_object_object_add(event, timings[i].name, json_object_new_int64(value));
+		}
+	}
+
+	if (curl_easy_getinfo(easy, CURLINFO_SPEED_DOWNLOAD_T, &value) == CURLE_OK) {
+		json_object_object_add(event, "bytes_per_second", json_object_new_int64(value));
+	}
+
+	if (curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK) {
+		json_object_object_add(event, "status", json_object_new_int64(status));
+	}
+
+	/* No new connection means a warm one was reused. */
+	if (curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+		json_object_object_add(event, "connects", json_object_new_int64(connects));
+	}
+
+	trace_emit(event);
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+void trace_setup(const char *path, int argc, char **argv);
+
+uint64_t trace_now(void);
+
+void trace_phase(const char *phase, const char *subject, uint64_t start, int64_t bytes);
+
+void trace_transfer(const char *phase, CURL *easy);
+
+/* TRACE_H */
+#endif
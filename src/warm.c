@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#include "warm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "trace.h"
+
+/* Server properties and defaults to locate the level, see the vanilla server. */
+#define WARM_PROPERTIES_FILE "server.properties"
+#define WARM_LEVEL_NAME_PROPERTY "level-name="
+#define WARM_LEVEL_NAME_DEFAULT "world"
+#define WARM_LEVEL_DAT_FILE "level.dat"
+
+/* Named int tags of the level's spawn in its gzipped NBT, each followed by a big endian value. */
+#define WARM_NBT_SPAWN_X "\x03\x00\x06SpawnX"
+#define WARM_NBT_SPAWN_Z "\x03\x00\x06SpawnZ"
+#define WARM_NBT_SPAWN_SIZE 9
+#define WARM_LEVEL_DAT_MAX (1 << 20)
+
+/* A region file, named r.<x>.<z>.mca, holds 32 by 32 chunks of 16 by 16 blocks. */
+#define WARM_REGION_BLOCKS 512
+
+/* Regions at most this far from the spawn's hold the spawn chunks, which are loaded on start. */
+#define WARM_SPAWN_DISTANCE 1
+
+/* Regions are advised to the kernel by that many threads. */
+#define WARM_THREADS 4
+
+struct warm_region {
+	char *path;
+	off_t size;
+	time_t mtime;
+	/* Distance in regions from the spawn's, INT_MAX if irrelevant. */
+	int distance;
+};
+
+struct warm_pool {
+	const struct warm_region *regions;
+	size_t count;
+	atomic_size_t next;
+	atomic_uint_least64_t bytes;
+};
+
+/* Overworld directories first, their regions only are relative to the spawn. */
+static const char * const warm_directories[] = {
+	"region", "entities", "poi",
+	"DIM-1/region", "DIM-1/entities", "DIM-1/poi",
+	"DIM1/region", "DIM1/entities", "DIM1/poi",
+};
+
+#define WARM_OVERWORLD_DIRECTORIES 3
+
+/* Level directory name from the server properties, the vanilla default if unset. */
+static char *
+warm_level_name(const char *directory) {
+	char *path, *line = NULL, *name = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	if (asprintf(&path, "%s/" WARM_PROPERTIES_FILE, directory) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	FILE * const filep = fopen(path, "r");
+	if (filep != NULL) {
+		while (name == NULL && (length = getline(&line, &capacity, filep)) >= 0) {
+			line[strcspn(line, "\r\n")] = '\0';
+
+			if (strncmp(line, WARM_LEVEL_NAME_PROPERTY, sizeof (WARM_LEVEL_NAME_PROPERTY) - 1) == 0
+				&& line[sizeof (WARM_LEVEL_NAME_PROPERTY) - 1] != '\0') {
+				name = strdup(line + sizeof (WARM_LEVEL_NAME_PROPERTY) - 1);
+			}
+		}
+
+		fclose(filep);
+	}
+
+	free(line);
+	free(path);
+
+	return name != NULL ? name : strdup(WARM_LEVEL_NAME_DEFAULT);
+}
+
+static bool
+warm_nbt_int(const uint8_t *data, size_t size, const char *tag, int32_t *valuep) {
+
+	for (size_t i = 0; i + WARM_NBT_SPAWN_SIZE + 4 <= size; i++) {
+		if (memcmp(data + i, tag, WARM_NBT_SPAWN_SIZE) == 0) {
+			const uint8_t * const value = data + i + WARM_NBT_SPAWN_SIZE;
+
+			*valuep = (int32_t)((uint32_t)value[0] << 24 | (uint32_t)value[1] << 16 | (uint32_t)value[2] << 8 | value[3]);
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Region of the level's spawn, looking for its tags in the decompressed level.dat
+ * rather than walking the NBT tree. A new level spawns around the origin.
+ */
+static void
+warm_spawn_region(const char *level, int *xp, int *zp) {
+	int32_t x = 0, z = 0;
+	char *path;
+
+	if (asprintf(&path, "%s/" WARM_LEVEL_DAT_FILE, level) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	const gzFile file = gzopen(path, "rb");
+	if (file != NULL) {
+		uint8_t * const data = malloc(WARM_LEVEL_DAT_MAX);
+		const int size = gzread(file, data, WARM_LEVEL_DAT_MAX);
+
+		if (size <= 0 || !warm_nbt_int(data, size, WARM_NBT_SPAWN_X, &x)
+			|| !warm_nbt_int(data, size, WARM_NBT_SPAWN_Z, &z)) {
+			warnx("No spawn found in '%s', assuming the origin", path);
+			x = 0;
+			z = 0;
+		}
+
+		free(data);
+		gzclose(file);
+	}
+
+	free(path);
+
+	/* Rounding towards negative infinity, as negative regions start at -1. */
+	*xp = x >= 0 ? x / WARM_REGION_BLOCKS : -((-x - 1) / WARM_REGION_BLOCKS) - 1;
+	*zp = z >= 0 ? z / WARM_REGION_BLOCKS : -((-z - 1) / WARM_REGION_BLOCKS) - 1;
+}
+
+static void
+warm_regions_list(const char *level, unsigned int index, int spawn_x, int spawn_z,
+	struct warm_region **regionsp, size_t *countp) {
+	char *directory;
+
+	if (asprintf(&directory, "%s/%s", level, warm_directories[index]) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	DIR * const dirp = opendir(directory);
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			warn("opendir '%s'", directory);
+		}
+		free(directory);
+		return;
+	}
+
+	const struct dirent *entry;
+	while (entry = readdir(dirp), entry != NULL) {
+		const size_t length = strlen(entry->d_name);
+		struct stat st;
+		int x, z;
+
+		if (length <= 4 || strcmp(entry->d_name + length - 4, ".mca") != 0
+			|| fstatat(dirfd(dirp), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			continue;
+		}
+
+		struct warm_region * const regions = realloc(*regionsp, (*countp + 1) * sizeof (*regions));
+		if (regions == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		struct warm_region * const region = &regions[(*countp)++];
+
+		if (asprintf(&region->path, "%s/%s", directory, entry->d_name) < 0) {
+			errx(EXIT_FAILURE, "asprintf");
+		}
+		region->size = st.st_size;
+		region->mtime = st.st_mtime;
+		region->distance = INT_MAX;
+
+		if (index < WARM_OVERWORLD_DIRECTORIES && sscanf(entry->d_name, "r.%d.%d.mca", &x, &z) == 2) {
+			const int dx = abs(x - spawn_x), dz = abs(z - spawn_z);
+
+			region->distance = dx > dz ? dx : dz;
+		}
+
+		*regionsp = regions;
+	}
+
+	closedir(dirp);
+	free(directory);
+}
+
+/* Spawn regions first, nearest first, then most recently modified regions first. */
+static int
+warm_region_compare(const void *lhs, const void *rhs) {
+	const struct warm_region * const a = lhs, * const b = rhs;
+	const bool a_spawn = a->distance <= WARM_SPAWN_DISTANCE, b_spawn = b->distance <= WARM_SPAWN_DISTANCE;
+
+	if (a_spawn != b_spawn) {
+		return b_spawn - a_spawn;
+	}
+
+	if (a_spawn && a->distance != b->distance) {
+		return a->distance - b->distance;
+	}
+
+	return (b->mtime > a->mtime) - (b->mtime < a->mtime);
+}
+
+static void *
+warm_worker(void *arg) {
+	struct warm_pool * const pool = arg;
+	size_t index;
+
+	while (index = atomic_fetch_add(&pool->next, 1), index < pool->count) {
+		const struct warm_region * const region = &pool->regions[index];
+		const int fd = open(region->path, O_RDONLY | O_CLOEXEC);
+		int errcode;
+
+		if (fd < 0) {
+			warn("open '%s'", region->path);
+			continue;
+		}
+
+		/* Only an advice, reads go on in the background while the JVM starts. */
+#ifdef __APPLE__
+		struct radvisory advisory = { .ra_offset = 0, .ra_count = region->size };
+		errcode = fcntl(fd, F_RDADVISE, &advisory) == 0 ? 0 : errno;
+#else
+		errcode = posix_fadvise(fd, 0, region->size, POSIX_FADV_WILLNEED);
+#endif
+
+		if (errcode != 0) {
+			errno = errcode;
+			warn("Unable to warm '%s'", region->path);
+		} else {
+			atomic_fetch_add(&pool->bytes, region->size);
+		}
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Warms the page cache with at most budget bytes of the region files of the world
+ * running in directory, so its first players do not wait on random reads.
+ */
+void
+warm_world(const char *directory, uint64_t budget) {
+	char * const name = warm_level_name(directory);
+	struct warm_region *regions = NULL;
+	size_t count = 0, selected = 0;
+	uint64_t size = 0;
+	struct timespec start, end;
+	char *level;
+	int spawn_x, spawn_z;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const uint64_t trace_start = trace_now();
+
+	if (asprintf(&level, "%s/%s", directory, name) < 0) {
+		errx(EXIT_FAILURE, "asprintf");
+	}
+
+	warm_spawn_region(level, &spawn_x, &spawn_z);
+
+	for (unsigned int i = 0; i < sizeof (warm_directories) / sizeof (*warm_directories); i++) {
+		warm_regions_list(level, i, spawn_x, spawn_z, &regions, &count);
+	}
+
+	qsort(regions, count, sizeof (*regions), warm_region_compare);
+
+	/* Regions are warmed whole, those not fitting in what is left of the budget are skipped. */
+	for (size_t i = 0; i < count; i++) {
+		if (size + regions[i].size <= budget) {
+			size += regions[i].size;
+			regions[selected++] = regions[i];
+		} else {
+			free(regions[i].path);
+		}
+	}
+
+	struct warm_pool pool = {
+		.regions = regions,
+		.count = selected,
+	};
+	pthread_t workers[WARM_THREADS];
+	unsigned int started = 0;
+
+	atomic_init(&pool.next, 0);
+	atomic_init(&pool.bytes, 0);
+
+	while (started < WARM_THREADS && started < selected
+		&& pthread_create(&workers[started], NULL, warm_worker, &pool) == 0) {
+		started++;
+	}
+
+	/* Help the workers, or do it all if none could be started. */
+	warm_worker(&pool);
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	const uint64_t bytes = atomic_load(&pool.bytes);
+	const uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+	warnx("Warming %" PRIu64 ".%" PRIu64 "MiB of %zu region files out of %zu for '%s', in %" PRIu64 "ms",
+		bytes >> 20, (bytes & ((1 << 20) - 1)) * 10 >> 20, selected, count, name, elapsed);
+	trace_phase("warm", level, trace_start, bytes);
+
+	for (size_t i = 0; i < selected; i++) {
+		free(regions[i].path);
+	}
+	free(regions);
+	free(level);
+	free(name);
+}
@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later */
+#ifndef WARM_H
+#define WARM_H
+
+#include <stdint.h>
+
+void warm_world(const char *directory, uint64_t budget);
+
+/* WARM_H */
+#endif
@@ -0,0 +1,294 @@
+# SPDX-License-Identifier: AGPL-3.0-or-later
+"""
+Benchmarks installs and launches of an mcserver built against a local origin,
+see tests/fixture.py, serving a generated version manifest. Each scenario
+runs in a fresh store, or in the store of a previous one, and is reported
+from the phases of its -trace JSON lines.
+"""
+
+import argparse
+import hashlib
+import io
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import time
+import zipfile
+
+FIXTURE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fixture.py')
+
+# Files of the generated Java runtime, its java only exits.
+RUNTIME_COMPONENT = 'java-runtime-bench'
+RUNTIME_FILES = 200
+RUNTIME_PLATFORMS = ('linux', 'linux-i386', 'mac-os', 'mac-os-arm64')
+
+# Versions with an archive, the latest release first, the last one unknown to the peer.
+ARCHIVES = 4
+
+
+def write(root, path, data):
+	"""Writes data under root at the upstream path, returning its digest."""
+	file = os.path.join(root, path.lstrip('/'))
+	os.makedirs(os.path.dirname(file), exist_ok=True)
+	with open(file, 'wb') as output:
+		output.write(data)
+	return hashlib.sha1(data).hexdigest()
+
+
+def digested(root, origin, prefix, name, data):
+	"""Writes data at the upstream path named after its digest, returning the entry locating it."""
+	sha1 = hashlib.sha1(data).hexdigest()
+	path = '%s/%s/%s' % (prefix, sha1, name)
+	write(root, path, data)
+	return {'sha1': sha1, 'size': len(data), 'url': origin + path}
+
+
+def archive(size, seed):
+	"""Server archive, not a bundler, of size bytes which do not compress."""
+	payload = io.BytesIO()
+	with zipfile.ZipFile(payload, 'w', zipfile.ZIP_STORED) as jar:
+		jar.writestr('META-INF/MANIFEST.MF', 'Manifest-Version: 1.0\r\nMain-Class: net.minecraft.server.Main\r\n\r\n')
+		jar.writestr('payload.bin', hashlib.shake_256(seed.encode()).digest(size))
+	return payload.getvalue()
+
+
+def generate(root, origin, versions, archive_size):
+	"""Generates the tree of the origin, returning the identifiers of the versions with an archive."""
+	runtime_files = {'bin': {'type': 'directory'}, 'lib': {'type': 'directory'}}
+	java = b'#!/bin/sh\nexit 0\n'
+	runtime_files['bin/java'] = {
+		'type': 'file', 'executable': True,
+		'downloads': {'raw': digested(root, origin, '/v1/objects', 'java', java)},
+	}
+	for i in range(RUNTIME_FILES):
+		data = ('runtime file %d\n' % i).encode() * (1 + i % 64)
+		runtime_files['lib/f%d.dat' % i] = {
+			'type': 'file', 'executable': False,
+			'downloads': {'raw': digested(root, origin, '/v1/objects', 'f%d.dat' % i, data)},
+		}
+
+	runtime_manifest = digested(root, origin, '/v1/packages', 'manifest.json',
+		json.dumps({'files': runtime_files}).encode())
+	runtime = [{'manifest': runtime_manifest, 'version': {'name': '17.0.0'}}]
+	write(root, '/v1/products/java-runtime/all.json',
+		json.dumps({platform: {RUNTIME_COMPONENT: runtime} for platform in RUNTIME_PLATFORMS}).encode())
+
+	entries, archived = [], []
+	for i in range(versions):
+		identifier = '1.%d' % (versions - i)
+		package = {
+			'id': identifier,
+			'javaVersion': {'component': RUNTIME_COMPONENT, 'majorVersion': 17},
+		}
+
+		# Only the most recent versions are installed, the others only weigh on the manifest.
+		if i < ARCHIVES:
+			package['downloads'] = {
+				'server': digested(root, origin, '/v1/objects', 'server.jar', archive(archive_size, identifier)),
+			}
+			archived.append(identifier)
+
+		entry = digested(root, origin, '/v1/packages', identifier + '.json', json.dumps(package).encode())
+		released = '%04d-01-01T00:00:00+00:00' % (2000 + versions - i)
+		entries.append({
+			'id': identifier, 'type': 'snapshot' if i % 4 == 1 and i > ARCHIVES else 'release',
+			'url': entry['url'], 'sha1': entry['sha1'],
+			'time': released, 'releaseTime': released,
+		})
+
+	write(root, '/mc/game/version_manifest_v2.json', json.dumps({
+		'latest': {'release': archived[0], 'snapshot': archived[0]},
+		'versions': entries,
+	}).encode())
+
+	return archived
+
+
+def certificate(openssl, directory):
+	"""Self-signed certificate of the origin, both the bundle mcserver trusts and what the fixture serves."""
+	path = os.path.join(directory, 'cert.pem')
+	key = os.path.join(directory, 'key.pem')
+
+	subprocess.run([openssl, 'req', '-x509', '-newkey', 'rsa:2048', '-nodes', '-days', '2',
+		'-subj', '/CN=127.0.0.1', '-addext', 'subjectAltName=IP:127.0.0.1',
+		'-keyout', key, '-out', path], check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+	with open(path, 'ab') as output, open(key, 'rb') as input:
+		output.write(input.read())
+
+	return path
+
+
+class Fixture:
+	"""Origin running for the duration of a with statement."""
+
+	def __init__(self, root, port, cert, injection):
+		self.arguments = [sys.executable, FIXTURE, '--root', root, '--port', str(port), '--cert', cert]
+		for option, value in injection.items():
+			self.arguments += ['--' + option.replace('_', '-'), str(value)]
+
+	def __enter__(self):
+		self.process = subprocess.Popen(self.arguments, stdout=subprocess.PIPE)
+		if self.process.stdout.readline() != b'ready\n':
+			raise RuntimeError('Fixture origin did not start')
+		return self
+
+	def __exit__(self, *exception):
+		self.process.terminate()
+		self.process.wait()
+
+
+class Peer:
+	"""Node serving a store as a mirror, for the duration of a with statement."""
+
+	def __init__(self, mcserver, home, address):
+		self.mcserver, self.home, self.address = mcserver, home, address
+
+	def __enter__(self):
+		self.process = subprocess.Popen([self.mcserver, 'serve', self.address],
+			env=dict(os.environ, HOME=self.home), stdin=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+		# Ready once it answers, even with a miss.
+		host, port = self.address.rsplit(':', 1)
+		deadline = time.monotonic() + 10
+		while time.monotonic() < deadline:
+			try:
+				socket.create_connection((host, int(port)), timeout=1).close()
+				return self
+			except OSError:
+				time.sleep(0.1)
+
+		raise RuntimeError('Peer did not start serving')
+
+	def __exit__(self, *exception):
+		self.process.terminate()
+		self.process.wait()
+
+
+def store(home):
+	"""Fresh store, as if mcserver was never run for that home."""
+	shutil.rmtree(home, ignore_errors=True)
+	os.makedirs(os.path.join(home, '.local', 'share', 'mcserver'))
+	return home
+
+
+def run(mcserver, home, trace, arguments, timeout):
+	"""Runs mcserver in home, returning its exit status and wall clock time."""
+	start = time.monotonic()
+	completed = subprocess.run([mcserver, '-trace', trace] + arguments,
+		env=dict(os.environ, HOME=home), stdin=subprocess.DEVNULL,
+		stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, timeout=timeout)
+	elapsed = time.monotonic() - start
+
+	if completed.returncode != 0:
+		sys.stderr.write(completed.stderr.decode(errors='replace'))
+
+	return completed.returncode, elapsed
+
+
+def phases(trace):
+	"""Events of the invocation itself, by phase, detached invocations are left out."""
+	with open(trace) as input:
+		events = [json.loads(line) for line in input if line.strip()]
+
+	pid = events[0]['pid'] if events else None
+	summary = {}
+	for event in events:
+		if event['pid'] != pid or 'duration_us' not in event:
+			continue
+		phase = summary.setdefault(event['phase'], {'count': 0, 'duration_us': 0, 'bytes': 0})
+		phase['count'] += 1
+		phase['duration_us'] += event['duration_us']
+		phase['bytes'] += max(event.get('bytes', -1), 0)
+
+	return summary
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__)
+	parser.add_argument('--mcserver', required=True, help='mcserver built against the origin')
+	parser.add_argument('--openssl', required=True, help='openssl program to create the certificate with')
+	parser.add_argument('--directory', required=True, help='directory of the certificate, the origin and the stores')
+	parser.add_argument('--port', type=int, required=True, help='port of the origin, the peer serves on the next one')
+	parser.add_argument('--versions', type=int, default=500, help='versions in the version manifest')
+	parser.add_argument('--archive-size', type=int, default=16, help='size of server archives, in MiB')
+	parser.add_argument('--timeout', type=int, default=300, help='time limit of each invocation, in seconds')
+	options = parser.parse_args()
+
+	if options.versions < ARCHIVES:
+		parser.error('At least %d versions are required' % ARCHIVES)
+
+	directory = os.path.abspath(options.directory)
+	root = os.path.join(directory, 'origin')
+	origin = 'https://127.0.0.1:%d' % options.port
+	peer = '127.0.0.1:%d' % (options.port + 1)
+
+	# The certificate's path was built in the program, it must be there before any transfer.
+	os.makedirs(directory, exist_ok=True)
+	cert = certificate(options.openssl, directory)
+
+	shutil.rmtree(root, ignore_errors=True)
+	archived = generate(root, origin, options.versions, options.archive_size << 20)
+
+	cold, warm = os.path.join(directory, 'cold'), os.path.join(directory, 'warm')
+	mirrored = os.path.join(directory, 'mirrored')
+
+	# Name, origin injection, store, arguments, whether the store is fresh, peer store.
+	scenarios = [
+		('cold install', {}, cold, ['install'] + archived[:-1], True, None),
+		('warm install', {}, cold, ['install'] + archived[:-1], False, None),
+		('cold launch', {}, warm, ['launch'], True, None),
+		('warm launch', {}, warm, ['launch'], False, None),
+		('latency install', {'delay_ms': 40, 'rate_kib': 16384}, os.path.join(directory, 'latency'),
+			['install'] + archived, True, None),
+		('failures install', {'fail_first': 1, 'reset_first': 1}, os.path.join(directory, 'failures'),
+			['-segments', '4', 'install'] + archived, True, None),
+		('mirrored install', {}, mirrored, ['install'] + archived, True, cold),
+	]
+
+	results, succeeded = [], True
+	for name, injection, home, arguments, fresh, served in scenarios:
+		trace = os.path.join(directory, name.replace(' ', '-') + '.jsonl')
+
+		if fresh:
+			store(home)
+			if served is not None:
+				with open(os.path.join(home, '.local', 'share', 'mcserver', 'mirrors'), 'w') as mirrors:
+					mirrors.write('http://%s\n' % peer)
+		if os.path.exists(trace):
+			os.unlink(trace)
+
+		with Fixture(root, options.port, cert, injection):
+			if served is not None:
+				with Peer(options.mcserver, served, peer):
+					status, elapsed = run(options.mcserver, home, trace, arguments, options.timeout)
+			else:
+				status, elapsed = run(options.mcserver, home, trace, arguments, options.timeout)
+
+		results.append({
+			'scenario': name,
+			'status': status,
+			'wall_us': int(elapsed * 1000000),
+			'phases': phases(trace),
+		})
+		succeeded = succeeded and status == 0
+
+	print('%-18s %-16s %6s %12s %12s' % ('scenario', 'phase', 'count', 'ms', 'KiB'))
+	for result in results:
+		print('%-18s %-16s %6s %12.1f %12s%s' % (result['scenario'], 'wall', '', result['wall_us'] / 1000, '',
+			'' if result['status'] == 0 else '  FAILED (%d)' % result['status']))
+		for phase, summary in sorted(result['phases'].items()):
+			print('%-18s %-16s %6d %12.1f %12d' % ('', phase, summary['count'],
+				summary['duration_us'] / 1000, summary['bytes'] >> 10))
+
+	with open(os.path.join(directory, 'bench.json'), 'w') as output:
+		json.dump({'versions': options.versions, 'archive_size': options.archive_size, 'results': results}, output, indent='\t')
+
+	sys.exit(0 if succeeded else 1)
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,139 @@
+# SPDX-License-Identifier: AGPL-3.0-or-later
+"""
+HTTPS stand-in for the Mojang hosts, serving a generated tree of files,
+with latency, bandwidth and failure injection.
+"""
+
+import argparse
+import http.server
+import os
+import socket
+import ssl
+import sys
+import threading
+import time
+
+# Files larger than this many bytes only are subject to fault injection.
+FAULTY_SIZE = 1 << 16
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+
+	def log_message(self, format, *args):
+		pass
+
+	def inject(self, counters, first):
+		"""Whether this request is one of the first ones of its path to inject a fault in."""
+		with self.server.lock:
+			count = counters.get(self.path, 0)
+			counters[self.path] = count + 1
+		return count < first
+
+	def respond_empty(self, status):
+		self.send_response(status)
+		self.send_header('Content-Length', '0')
+		self.end_headers()
+
+	def send_body(self, body):
+		options = self.server.options
+		chunk = 1 << 16
+
+		for offset in range(0, len(body), chunk):
+			self.wfile.write(body[offset:offset + chunk])
+			if options.rate_kib != 0:
+				time.sleep(len(body[offset:offset + chunk]) / (options.rate_kib << 10))
+
+	def do_GET(self):
+		options = self.server.options
+		path = os.path.normpath(os.path.join(options.root, self.path.split('?')[0].lstrip('/')))
+
+		if options.delay_ms != 0:
+			time.sleep(options.delay_ms / 1000)
+
+		if not path.startswith(options.root + os.sep) or not os.path.isfile(path):
+			self.respond_empty(404)
+			return
+
+		with open(path, 'rb') as file:
+			data = file.read()
+
+		# Faults are only injected in transfers of large files, which are retried and resumed.
+		if len(data) > FAULTY_SIZE and self.inject(self.server.failures, options.fail_first):
+			self.respond_empty(503)
+			return
+
+		status, body, start = 200, data, 0
+		ranged = self.headers.get('Range')
+		if ranged is not None and ranged.startswith('bytes=') and ',' not in ranged:
+			first, _, last = ranged[6:].partition('-')
+			if first == '':
+				start = max(len(data) - int(last), 0)
+				end = len(data)
+			else:
+				start = int(first)
+				end = min(int(last) + 1, len(data)) if last != '' else len(data)
+			if start >= len(data):
+				self.send_response(416)
+				self.send_header('Content-Range', 'bytes */%d' % len(data))
+				self.send_header('Content-Length', '0')
+				self.end_headers()
+				return
+			status, body = 206, data[start:end]
+
+		self.send_response(status)
+		self.send_header('Content-Length', str(len(body)))
+		self.send_header('Accept-Ranges', 'bytes')
+		if status == 206:
+			self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, start + len(body) - 1, len(data)))
+		self.end_headers()
+
+		if self.command == 'HEAD':
+			return
+
+		# Cut the connection halfway through, as a flaky network would.
+		if len(body) > FAULTY_SIZE and self.inject(self.server.resets, options.reset_first):
+			self.send_body(body[:len(body) // 2])
+			self.wfile.flush()
+			self.connection.shutdown(socket.SHUT_RDWR)
+			self.close_connection = True
+			return
+
+		self.send_body(body)
+
+	def do_HEAD(self):
+		self.do_GET()
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__)
+	parser.add_argument('--root', required=True, help='directory served')
+	parser.add_argument('--port', type=int, required=True)
+	parser.add_argument('--cert', required=True, help='certificate and key, in PEM')
+	parser.add_argument('--delay-ms', type=int, default=0, help='latency added to every request')
+	parser.add_argument('--rate-kib', type=int, default=0, help='bandwidth of every response, in KiB/s, unlimited if zero')
+	parser.add_argument('--fail-first', type=int, default=0, help='requests of each large file answered with 503 first')
+	parser.add_argument('--reset-first', type=int, default=0, help='transfers of each large file cut halfway first')
+	options = parser.parse_args()
+	options.root = os.path.realpath(options.root)
+
+	server = http.server.ThreadingHTTPServer(('127.0.0.1', options.port), Handler)
+	server.daemon_threads = True
+	server.options = options
+	server.lock = threading.Lock()
+	server.failures = {}
+	server.resets = {}
+
+	context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+	context.load_cert_chain(options.cert)
+	server.socket = context.wrap_socket(server.socket, server_side=True)
+
+	# Ready to accept once it says so.
+	print('ready', flush=True)
+	sys.stdout.close()
+
+	server.serve_forever()
+
+
+if __name__ == '__main__':
+	main()